@@ -165,6 +165,18 @@ def cmd_status(args):
 		print("Uptime: %s. Connected: %s. Last alive: %s%s%s" %
 			(uptime, conn_delta, la_color, alive_delta, color.reset))
 
+		# link stats are in microseconds, and only there for nodes
+		# new enough to answer our pulses
+		if is_running and int(info.get('rtt_samples', 0)):
+			print("Link rtt (last, p50, p99, max): %.3fms, %.3fms, %.3fms, %.3fms. Clock offset: %.3fms" %
+				(float(info['rtt']) / 1000, float(info['rtt_p50']) / 1000,
+				float(info['rtt_p99']) / 1000, float(info['rtt_max']) / 1000,
+				float(info['clock_offset']) / 1000))
+		if is_running and int(info.get('event_age_samples', 0)):
+			print("Event age (p50, p99, max): %.3fs, %.3fs, %.3fs" %
+				(float(info['event_age_p50']) / 1000000, float(info['event_age_p99']) / 1000000,
+				float(info['event_age_max']) / 1000000))
+
 		hchecks = int(info.get('host_checks_executed'))
 		schecks = int(info.get('service_checks_executed'))
 		expired_hchecks = int(info.get('expired_hosts'))
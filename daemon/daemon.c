@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include "daemonize.h"
 #include "db_updater.h"
 #include "config.h"
@@ -13,6 +14,7 @@
 #include "configuration.h"
 #include "sql.h"
 #include "state.h"
+#include "rollup.h"
 #include "shared.h"
 #include "db_updater.h"
 
@@ -163,17 +165,11 @@ static int handle_ipc_event(merlin_event *pkt)
 	return mrm_db_update(&ipc, pkt);
 }
 
-static int ipc_reap_events(void)
+static int ipc_handle_events(void)
 {
-	int len, events = 0;
+	int events = 0;
 	merlin_event *pkt;
 
-	node_log_event_count(&ipc, 0);
-
-	len = node_recv(&ipc);
-	if (len < 0)
-		return len;
-
 	while ((pkt = node_get_event(&ipc))) {
 		events++;
 		if (pkt->hdr.type != CTRL_PACKET) {
@@ -197,6 +193,11 @@ static int ipc_reap_events(void)
 				/* our naemon instance might be restarting */
 				memset(&ipc.info, 0, sizeof(ipc.info));
 				break;
+
+			case CTRL_SHMRING:
+				ipc_shm_ctrl(pkt);
+				break;
+
 			default:
 				break;
 			}
@@ -205,14 +206,49 @@ static int ipc_reap_events(void)
 		free(pkt);
 	}
 
+	return events;
+}
+
+static int ipc_reap_events(void)
+{
+	int len;
+
+	node_log_event_count(&ipc, 0);
+
+	len = ipc_recv();
+	if (len < 0)
+		return len;
+
+	/*
+	 * socket input always goes first, since the module only
+	 * starts using the ring once it's done with the socket
+	 */
+	ipc_handle_events();
+	if (ipc_shm_drain() > 0)
+		ipc_handle_events();
+
 	return 0;
 }
 
+/* bytes of input the module has sent that we haven't read yet */
+static unsigned long ipc_backlog(void)
+{
+	int avail = 0;
+
+	if (ipc.sock < 0)
+		return 0;
+	if (ioctl(ipc.sock, FIONREAD, &avail) < 0)
+		avail = 0;
+
+	return avail + ipc_shm_pending();
+}
+
 static int io_poll_sockets(void)
 {
 	fd_set rd, wr;
 	int sel_val, ipc_listen_sock, nfound;
-	int sockets = 0;
+	int sockets = 0, shm_fd, shm_pending;
+	long commit_wait;
 	struct timeval tv = { 2, 0 };
 	static time_t last_ipc_reinit = 0;
 
@@ -226,7 +262,8 @@ static int io_poll_sockets(void)
 	}
 
 	ipc_listen_sock = ipc_listen_sock_desc();
-	sel_val = max(ipc.sock, ipc_listen_sock);
+	shm_fd = ipc_shm_wait_fd(&shm_pending);
+	sel_val = max(max(ipc.sock, ipc_listen_sock), shm_fd);
 
 	FD_ZERO(&rd);
 	FD_ZERO(&wr);
@@ -234,11 +271,26 @@ static int io_poll_sockets(void)
 		FD_SET(ipc.sock, &rd);
 	if (ipc_listen_sock >= 0)
 		FD_SET(ipc_listen_sock, &rd);
+	if (shm_fd >= 0)
+		FD_SET(shm_fd, &rd);
+
+	/* the module has already put events in the ring, so don't sleep */
+	if (shm_pending)
+		tv.tv_sec = 0;
+
+	/* wake up in time to commit queries that have waited long enough */
+	commit_wait = sql_commit_wait();
+	if (commit_wait >= 0 && commit_wait < tv.tv_sec * 1000000 + tv.tv_usec) {
+		tv.tv_sec = commit_wait / 1000000;
+		tv.tv_usec = commit_wait % 1000000;
+	}
 
 	if (sel_val < 0)
 		return 0;
 
 	nfound = select(sel_val + 1, &rd, &wr, NULL, &tv);
+	if (shm_fd >= 0)
+		ipc_shm_wakeup();
 	if (nfound < 0) {
 		lerr("select() returned %d (errno = %d): %s", nfound, errno, strerror(errno));
 		return -1;
@@ -247,14 +299,46 @@ static int io_poll_sockets(void)
 	if (ipc_listen_sock > 0 && FD_ISSET(ipc_listen_sock, &rd)) {
 		linfo("Accepting inbound connection on ipc socket");
 		ipc_accept();
-	} else if (ipc.sock > 0 && FD_ISSET(ipc.sock, &rd)) {
+	} else if (ipc.sock > 0 && (FD_ISSET(ipc.sock, &rd) || shm_pending ||
+	           (shm_fd >= 0 && FD_ISSET(shm_fd, &rd))))
+	{
 		sockets++;
 		ipc_reap_events();
 	}
 
+	sql_set_backlog(ipc_backlog());
+
 	return 0;
 }
 
+/*
+ * This is also called when we crash, so it may not allocate or
+ * log anything.
+ */
+static void dump_flightrecs(void)
+{
+	int fd;
+	unsigned int i;
+
+	fd = open("/tmp/merlind.flightrec", O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		return;
+
+	flightrec_dump(&ipc.flightrec, ipc.name, fd);
+	for (i = 0; i < num_nodes; i++)
+		flightrec_dump(&node_table[i]->flightrec, node_table[i]->name, fd);
+	close(fd);
+}
+
+static void crash_handler(int sig)
+{
+	dump_flightrecs();
+
+	/* let the default action (probably a core dump) take it from here */
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
 static void dump_daemon_nodes(void)
 {
 	int fd;
@@ -271,6 +355,10 @@ static void dump_daemon_nodes(void)
 	dump_nodeinfo(&ipc, fd, 0);
 	for (i = 0; i < num_nodes; i++)
 		dump_nodeinfo(node_table[i], fd, i + 1);
+	sql_dump_commit_stats(fd);
+	close(fd);
+
+	dump_flightrecs();
 }
 
 static void polling_loop(void)
@@ -441,12 +529,17 @@ int merlind_main(int argc, char **argv)
 	signal(SIGTERM, merlind_sighandler);
 	signal(SIGUSR1, sigusr_handler);
 	signal(SIGUSR2, sigusr_handler);
+	signal(SIGSEGV, crash_handler);
+	signal(SIGBUS, crash_handler);
+	signal(SIGFPE, crash_handler);
+	signal(SIGABRT, crash_handler);
 
 	sql_init();
 	state_init();
 	linfo("Merlin daemon " PACKAGE_VERSION " successfully initialized");
 	polling_loop();
 	state_deinit();
+	rollup_deinit();
 	clean_exit(0);
 
 	return 0;
@@ -3,6 +3,7 @@
 #include "ipc.h"
 #include "sql.h"
 #include "configuration.h"
+#include "rollup.h"
 #include <naemon/naemon.h>
 
 
@@ -55,6 +56,10 @@ static int handle_host_status(int cb, const merlin_host_status *p)
 				p->state.current_attempt, output,
 				sql_safe_unescaped_long_output,
 				p->state.scheduled_downtime_depth);
+		if (db_log_rollups) {
+			rollup_state(p->name, NULL, p->state.last_check, p->state.current_state,
+			             p->state.state_type == HARD_STATE || p->state.current_state == STATE_UP);
+		}
 	}
 
 	/*
@@ -130,6 +135,11 @@ static int handle_service_status(int cb, const merlin_service_status *p)
 				p->state.current_attempt, output,
 				sql_safe_unescaped_long_output,
 				p->state.scheduled_downtime_depth);
+		if (db_log_rollups) {
+			rollup_state(p->host_name, p->service_description, p->state.last_check,
+			             p->state.current_state,
+			             p->state.state_type == HARD_STATE || p->state.current_state == STATE_OK);
+		}
 	}
 
 	/*
@@ -196,6 +206,9 @@ static int rpt_downtime(void *data)
 	}
 	free(host_name);
 
+	if (db_log_rollups)
+		rollup_downtime(ds->host_name, ds->service_description, ds->timestamp.tv_sec, depth);
+
 	return result;
 }
 
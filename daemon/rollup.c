@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <glib.h>
+#include "rollup.h"
+#include "sql.h"
+#include "logging.h"
+#include "shared.h"
+
+/* rows per INSERT when adding up long intervals */
+#define ROLLUP_BATCH 256
+
+int rollup_persist = 1;
+
+/* what an object has been doing since "since" */
+struct rollup_obj {
+	time_t since;
+	int state, hard, downtime;
+};
+
+/*
+ * keyed on "host;service", or "host;" for hosts. Naemon treats ';' as
+ * the start of a comment in object configuration, so no name has one.
+ */
+static GHashTable *objects;
+
+int rollup_init(void)
+{
+	if (objects)
+		return 0;
+
+	objects = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	return objects ? 0 : -1;
+}
+
+void rollup_deinit(void)
+{
+	if (objects)
+		g_hash_table_destroy(objects);
+	objects = NULL;
+}
+
+/* looks up the interval an object is in, in memory or in the database */
+static struct rollup_obj *get_obj(const char *host, const char *service,
+                                  const char *qhost, const char *qservice)
+{
+	struct rollup_obj *o;
+	db_wrap_result *result;
+	char *key;
+
+	if (asprintf(&key, "%s;%s", host, service) < 0)
+		return NULL;
+	if ((o = g_hash_table_lookup(objects, key))) {
+		free(key);
+		return o;
+	}
+
+	if (!(o = calloc(1, sizeof(*o)))) {
+		free(key);
+		return NULL;
+	}
+
+	if (!sql_query("SELECT since, state, hard, downtime_depth "
+	               "FROM report_data_rollup_open "
+	               "WHERE host_name = %s AND service_description = %s",
+	               qhost, qservice) &&
+	    (result = sql_get_result()) && !result->api->step(result))
+	{
+		int32_t since = 0, state = 0, hard = 0, downtime = 0;
+
+		result->api->get_int32_ndx(result, 0, &since);
+		result->api->get_int32_ndx(result, 1, &state);
+		result->api->get_int32_ndx(result, 2, &hard);
+		result->api->get_int32_ndx(result, 3, &downtime);
+		o->since = since;
+		o->state = state;
+		o->hard = hard;
+		o->downtime = downtime;
+	}
+	sql_free_result();
+
+	g_hash_table_insert(objects, key, o);
+	return o;
+}
+
+/* adds the time from o->since to "end" to the periods it spans */
+static int add_duration(const char *qhost, const char *qservice,
+                        const struct rollup_obj *o, time_t end)
+{
+	size_t row_max = strlen(qhost) + strlen(qservice) + 80;
+	char *buf;
+	time_t start = o->since;
+	int result = 0;
+
+	if (!(buf = malloc(row_max * ROLLUP_BATCH)))
+		return -1;
+
+	while (start < end && !result) {
+		size_t len = 0;
+		unsigned int rows;
+
+		for (rows = 0; rows < ROLLUP_BATCH && start < end; rows++) {
+			time_t period = start - start % ROLLUP_PERIOD;
+			time_t next = period + ROLLUP_PERIOD < end ? period + ROLLUP_PERIOD : end;
+
+			len += snprintf(buf + len, row_max, "%s(%s, %s, %lu, %d, %d, %d, %lu)",
+			                rows ? ", " : "", qhost, qservice, period,
+			                o->state, o->hard, !!o->downtime, next - start);
+			start = next;
+		}
+
+		result = sql_query("INSERT INTO report_data_rollup"
+		                   "(host_name, service_description, period, "
+		                   "state, hard, downtime, duration) VALUES %s "
+		                   "ON DUPLICATE KEY UPDATE duration = duration + VALUES(duration)",
+		                   buf);
+	}
+
+	free(buf);
+	return result;
+}
+
+static int save_obj(const char *qhost, const char *qservice, const struct rollup_obj *o)
+{
+	return sql_query("REPLACE INTO report_data_rollup_open"
+	                 "(host_name, service_description, since, state, hard, downtime_depth) "
+	                 "VALUES(%s, %s, %lu, %d, %d, %d)",
+	                 qhost, qservice, o->since, o->state, o->hard, o->downtime);
+}
+
+/*
+ * Closes the object's current interval at "when" and opens a new one
+ * with the given state. state < 0 keeps the current state and
+ * downtime < 0 the current downtime.
+ */
+static int update(const char *host, const char *service, time_t when,
+                  int state, int hard, int downtime)
+{
+	struct rollup_obj *o;
+	char *qhost, *qservice;
+	int result = 0;
+
+	if (!host || (!objects && rollup_init() < 0))
+		return -1;
+	if (!service)
+		service = "";
+
+	sql_quote(host, &qhost);
+	sql_quote(service, &qservice);
+	if (!qhost || !qservice) {
+		safe_free(qhost);
+		safe_free(qservice);
+		return -1;
+	}
+
+	o = get_obj(host, service, qhost, qservice);
+	if (!o) {
+		lerr("ROLLUP: Failed to allocate memory for '%s;%s'", host, service);
+		result = -1;
+	} else if (o->since && when < o->since) {
+		/* late events would make intervals overlap */
+		ldebug("ROLLUP: Ignoring event for '%s;%s' older than its current state",
+		       host, service);
+	} else {
+		if (o->since)
+			result = add_duration(qhost, qservice, o, when);
+		/* we can't account for time until we know the state */
+		if (o->since || state >= 0)
+			o->since = when;
+		if (state >= 0) {
+			o->state = state;
+			o->hard = hard;
+		}
+		if (downtime >= 0)
+			o->downtime = downtime;
+		if (rollup_persist && !result)
+			result = save_obj(qhost, qservice, o);
+	}
+
+	free(qhost);
+	free(qservice);
+	return result;
+}
+
+int rollup_state(const char *host, const char *service, time_t when, int state, int hard)
+{
+	return update(host, service, when, state, hard, -1);
+}
+
+int rollup_downtime(const char *host, const char *service, time_t when, int downtime)
+{
+	return update(host, service, when, -1, 0, downtime);
+}
+
+int rollup_flush(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	int errors = 0;
+
+	if (!objects)
+		return 0;
+
+	g_hash_table_iter_init(&iter, objects);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		char *host = key, *semi = strchr(host, ';');
+		char *qhost, *qservice;
+
+		*semi = 0;
+		sql_quote(host, &qhost);
+		sql_quote(semi + 1, &qservice);
+		*semi = ';';
+		if (!qhost || !qservice || save_obj(qhost, qservice, value))
+			errors++;
+		safe_free(qhost);
+		safe_free(qservice);
+	}
+
+	if (errors)
+		lerr("ROLLUP: Failed to save %d open intervals", errors);
+	return errors ? -1 : 0;
+}
+
+void rollup_truncate(void)
+{
+	sql_query("TRUNCATE report_data_rollup");
+	sql_query("TRUNCATE report_data_rollup_open");
+	if (objects)
+		g_hash_table_remove_all(objects);
+}
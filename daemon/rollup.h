@@ -0,0 +1,58 @@
+#ifndef INCLUDE_rollup_h__
+#define INCLUDE_rollup_h__
+#include <time.h>
+
+/*
+ * Availability rollups. Every time a host or service changes state
+ * or enters or leaves downtime, the time it spent in its previous
+ * state is added to report_data_rollup, split into hourly periods.
+ * Reports can then sum up a handful of rows per object instead of
+ * walking its report_data history. The interval each object is in
+ * right now is kept in report_data_rollup_open, so we can pick up
+ * where we left off after a restart.
+ */
+
+/* seconds per rollup period */
+#define ROLLUP_PERIOD 3600
+
+/*
+ * write each object's open interval to the database as it changes.
+ * Bulk importers turn this off and call rollup_flush() when done
+ */
+extern int rollup_persist;
+
+extern int rollup_init(void);
+extern void rollup_deinit(void);
+
+/**
+ * Record a state change
+ * @param host The host's name
+ * @param service The service's description, or NULL for hosts
+ * @param when When the new state began
+ * @param state The new state
+ * @param hard Whether the new state is hard (as in report_data)
+ * @return 0 on success, < 0 on errors
+ */
+extern int rollup_state(const char *host, const char *service, time_t when, int state, int hard);
+
+/**
+ * Record an object entering or leaving downtime
+ * @param host The host's name
+ * @param service The service's description, or NULL for hosts
+ * @param when When the downtime started or stopped
+ * @param downtime 1 if it started, 0 if it stopped
+ * @return 0 on success, < 0 on errors
+ */
+extern int rollup_downtime(const char *host, const char *service, time_t when, int downtime);
+
+/**
+ * Write all open intervals to the database
+ * @return 0 on success, < 0 on errors
+ */
+extern int rollup_flush(void);
+
+/**
+ * Empty both rollup tables and forget all open intervals
+ */
+extern void rollup_truncate(void);
+#endif
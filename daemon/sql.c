@@ -1,7 +1,10 @@
 #include "sql.h"
 #include "logging.h"
 #include "shared.h"
+#include "histogram.h"
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdio.h> /* debuggering only. */
 #include <string.h>
 
@@ -121,35 +124,172 @@ db_wrap_result * sql_get_result(void)
 	return db.result;
 }
 
+/*
+ * Adaptive group commit. Instead of committing on a fixed schedule,
+ * we try to spend no more than a tenth of our time committing. The
+ * transaction size we aim for is the number of queries that arrive
+ * while ten commits could run, going by recent commit latency and
+ * query rate. Whenever we've caught up with the module we commit
+ * whatever we have, unless we just did. commit_queries caps the
+ * transaction size, and commit_interval is a hard limit on how many
+ * seconds any query may go uncommitted. With neither of them set we
+ * run in auto-commit mode, so there's nothing to group.
+ */
+#define COMMIT_AMORTIZE 10
+int commit_adaptive = 1;
+static struct {
+	uint64_t first;     /* when the oldest uncommitted query ran */
+	uint64_t last;      /* when we last committed */
+	double usec;        /* average commit latency */
+	double rate;        /* average queries per microsecond */
+	unsigned long target;  /* queries to commit at while busy */
+	unsigned long backlog; /* bytes of input we haven't read yet */
+	unsigned long long forced; /* commits forced by commit_interval */
+	histogram latency;  /* commit latency, in microseconds */
+	histogram size;     /* queries per commit */
+} gc;
+static int queries;
+
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* with neither set, the connection is in auto-commit mode */
+static inline int use_transactions(void)
+{
+	return commit_interval || commit_queries;
+}
+
+static void update_target(void)
+{
+	double target = gc.rate * gc.usec * COMMIT_AMORTIZE;
+
+	if (target < 1)
+		target = 1;
+	if (commit_queries && target > commit_queries)
+		target = commit_queries;
+	gc.target = (unsigned long)target;
+}
+
+static void sql_commit(uint64_t now)
+{
+	uint64_t end;
+
+	ldebug("Committing %d queries", queries);
+	/*
+	 * we ignore the return value here, as each db
+	 * seems to return a different code on success
+	 * and failure. Bleh...
+	 */
+	(void)db.conn->api->commit(db.conn);
+	end = usec_now();
+
+	histogram_add(&gc.latency, end - now);
+	histogram_add(&gc.size, queries);
+	if (gc.latency.count == 1) {
+		gc.usec = end - now;
+	} else {
+		gc.usec = gc.usec * 0.8 + (end - now) * 0.2;
+	}
+	if (gc.last && now > gc.last) {
+		double rate = (double)queries / (now - gc.last);
+		gc.rate = gc.rate ? gc.rate * 0.8 + rate * 0.2 : rate;
+	}
+	update_target();
+
+	gc.last = end;
+	last_commit = time(NULL);
+	total_queries += queries;
+	queries = 0;
+}
+
+void sql_set_backlog(unsigned long bytes)
+{
+	gc.backlog = bytes;
+}
+
+long sql_commit_wait(void)
+{
+	uint64_t now, when;
+
+	if (!queries || !commit_adaptive || !use_transactions() ||
+	    !db.conn || !db.conn->api->commit)
+	{
+		return -1;
+	}
+
+	now = usec_now();
+	when = gc.last + (uint64_t)gc.usec;
+	if (commit_interval && gc.first + commit_interval * 1000000 < when)
+		when = gc.first + commit_interval * 1000000;
+
+	return when > now ? (long)(when - now) : 0;
+}
+
 void sql_try_commit(int query)
 {
-	static int queries;
-	time_t now = time(NULL);
+	uint64_t now;
 
 	if (!db.conn || !use_database || !db.conn->api->commit)
 		return;
 
-	if (query > 0)
+	now = usec_now();
+	if (query > 0) {
+		if (!queries)
+			gc.first = now;
 		queries += query;
+	}
 
-	if (queries &&
-	    (query == -1 ||
-	     (commit_interval && last_commit + commit_interval <= now) ||
-	     (commit_queries && queries >= commit_queries)
-	    )
-	   )
-	{
-		ldebug("Committing %d queries", queries);
-		/*
-		 * we ignore the return value here, as each db
-		 * seems to return a different code on success
-		 * and failure. Bleh...
-		 */
-		(void)db.conn->api->commit(db.conn);
-		last_commit = now;
-		total_queries += queries;
-		queries = 0;
+	if (!queries)
+		return;
+
+	if (query == -1) {
+		sql_commit(now);
+		return;
 	}
+
+	if (!commit_adaptive || !use_transactions()) {
+		if ((commit_interval && last_commit + commit_interval <= time(NULL)) ||
+		    (commit_queries && queries >= commit_queries))
+		{
+			sql_commit(now);
+		}
+		return;
+	}
+
+	if (commit_interval && now - gc.first >= (uint64_t)commit_interval * 1000000) {
+		gc.forced++;
+		sql_commit(now);
+	} else if ((unsigned long)queries >= gc.target) {
+		sql_commit(now);
+	} else if (!query && !gc.backlog && now - gc.last >= gc.usec) {
+		/* we've caught up, so this is as big as the group gets */
+		sql_commit(now);
+	}
+}
+
+void sql_dump_commit_stats(int sd)
+{
+	nsock_printf(sd, "commit_adaptive=%d;commits=%llu;commits_forced=%llu;"
+	             "commit_target=%lu;uncommitted_queries=%d;"
+	             "commit_usec_avg=%llu;commit_usec_p50=%llu;"
+	             "commit_usec_p99=%llu;commit_usec_max=%llu;"
+	             "commit_queries_avg=%llu;commit_queries_p50=%llu;"
+	             "commit_queries_p99=%llu;commit_queries_max=%llu\n",
+	             commit_adaptive, (unsigned long long)gc.latency.count, gc.forced,
+	             gc.target, queries,
+	             (unsigned long long)histogram_mean(&gc.latency),
+	             (unsigned long long)histogram_percentile(&gc.latency, 50),
+	             (unsigned long long)histogram_percentile(&gc.latency, 99),
+	             (unsigned long long)gc.latency.max,
+	             (unsigned long long)histogram_mean(&gc.size),
+	             (unsigned long long)histogram_percentile(&gc.size, 50),
+	             (unsigned long long)histogram_percentile(&gc.size, 99),
+	             (unsigned long long)gc.size.max);
 }
 
 static int run_query(char *query, size_t len)
@@ -457,6 +597,7 @@ int sql_init(void)
 				  commit_queries, commit_interval);
 		}
 		last_commit = time(NULL);
+		gc.last = usec_now();
 	}
 
 	last_logged = 0;
@@ -587,6 +728,11 @@ int sql_config(const char *key, const char *value)
 		ldebug("DB: commit_queries set to %ld queries", commit_queries);
 		free(value_cpy);
 	}
+	else if (!strcmp(key, "commit_adaptive") && value_cpy != NULL) {
+		commit_adaptive = strtobool(value_cpy);
+		ldebug("DB: adaptive commits %s", commit_adaptive ? "enabled" : "disabled");
+		free(value_cpy);
+	}
 	else {
 		if (value_cpy)
 			free(value_cpy);
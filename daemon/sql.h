@@ -8,6 +8,7 @@ extern char *host_perf_table;
 extern char *service_perf_table;
 extern unsigned long total_queries;
 extern int sql_table_crashed;
+extern int commit_adaptive;
 
 /*typedef dbi_result SQL_RESULT;*/
 
@@ -26,6 +27,9 @@ extern int sql_query(const char *fmt, ...)
 extern int sql_vquery(const char *fmt, va_list ap);
 extern db_wrap_result * sql_get_result(void);
 extern void sql_try_commit(int query);
+extern void sql_set_backlog(unsigned long bytes);
+extern long sql_commit_wait(void);
+extern void sql_dump_commit_stats(int sd);
 extern const char *sql_table_name(void);
 extern const char *sql_db_name(void);
 extern const char *sql_db_user(void);
@@ -1,27 +1,197 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include "state.h"
 #include "logging.h"
-#include <glib.h>
-#include <naemon/naemon.h>
 
-static GHashTable *host_states, *svc_states;
+/*
+ * The import tool runs every state change in the log through here,
+ * so this has to be quick and small even with a million objects.
+ *
+ * Host names are interned: each gets an id, and services are keyed
+ * on their host's id and their description. All names live in one
+ * arena, and the tables are open addressing with linear probing.
+ * Slots hold the key's hash and the object's id, so probing rarely
+ * has to look at the objects themselves and growing the table never
+ * has to hash any names again.
+ */
+
+#define NO_STATE INT_MIN /* host we've only seen services for */
+
+struct state_slot {
+	uint32_t hash;
+	uint32_t id;    /* object id + 1. 0 means the slot is free */
+};
+
+struct state_obj {
+	size_t name;    /* offset of the name or description in the arena */
+	uint32_t host;  /* the host's id, for services */
+	int state;
+};
+
+struct state_table {
+	struct state_slot *slot;
+	uint32_t mask;  /* number of slots - 1 */
+	struct state_obj *obj;
+	uint32_t num_objs, alloc_objs;
+};
+
+static struct state_table hosts, services;
+static char *arena;
+static size_t arena_len, arena_alloc;
+
+static uint32_t hash_str(uint32_t h, const char *str)
+{
+	/* FNV-1a */
+	for (; *str; str++) {
+		h ^= (unsigned char)*str;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static size_t arena_add(const char *str)
+{
+	size_t len = strlen(str) + 1, ret;
+
+	if (arena_len + len > arena_alloc) {
+		size_t new_alloc = arena_alloc ? arena_alloc * 2 : 1 << 16;
+		char *new_arena;
+
+		while (new_alloc < arena_len + len)
+			new_alloc *= 2;
+		if (!(new_arena = realloc(arena, new_alloc)))
+			return (size_t)-1;
+		arena = new_arena;
+		arena_alloc = new_alloc;
+	}
+
+	ret = arena_len;
+	memcpy(arena + ret, str, len);
+	arena_len += len;
+	return ret;
+}
+
+static int table_init(struct state_table *t, uint32_t slots)
+{
+	t->slot = calloc(slots, sizeof(*t->slot));
+	t->mask = slots - 1;
+	t->obj = NULL;
+	t->num_objs = t->alloc_objs = 0;
+	return t->slot ? 0 : -1;
+}
+
+static void table_destroy(struct state_table *t)
+{
+	free(t->slot);
+	free(t->obj);
+	memset(t, 0, sizeof(*t));
+}
+
+/* doubles the number of slots, keeping the load factor below 3/4 */
+static int table_grow(struct state_table *t)
+{
+	uint32_t i, mask = t->mask * 2 + 1;
+	struct state_slot *slot;
+
+	if (!(slot = calloc((size_t)mask + 1, sizeof(*slot))))
+		return -1;
+
+	for (i = 0; i <= t->mask; i++) {
+		uint32_t pos;
+
+		if (!t->slot[i].id)
+			continue;
+		for (pos = t->slot[i].hash & mask; slot[pos].id; pos = (pos + 1) & mask)
+			;
+		slot[pos] = t->slot[i];
+	}
+
+	free(t->slot);
+	t->slot = slot;
+	t->mask = mask;
+	return 0;
+}
+
+/*
+ * Adds an object to "t" in the free slot at "pos", which must be the
+ * first free slot on the probe path of "hash". Returns its id, or -1.
+ */
+static int64_t table_add(struct state_table *t, uint32_t pos, uint32_t hash,
+                         const char *name, uint32_t host, int state)
+{
+	struct state_obj *obj;
+	size_t off;
+
+	/* we failed to grow earlier. Keep a free slot so probing ends */
+	if (t->num_objs >= t->mask)
+		return -1;
+
+	if (t->num_objs == t->alloc_objs) {
+		uint32_t alloc = t->alloc_objs ? t->alloc_objs * 2 : 1024;
+
+		if (!(obj = realloc(t->obj, alloc * sizeof(*obj))))
+			return -1;
+		t->obj = obj;
+		t->alloc_objs = alloc;
+	}
+	if ((off = arena_add(name)) == (size_t)-1)
+		return -1;
+
+	obj = &t->obj[t->num_objs];
+	obj->name = off;
+	obj->host = host;
+	obj->state = state;
+	t->slot[pos].hash = hash;
+	t->slot[pos].id = ++t->num_objs;
+
+	if (t->num_objs > (t->mask + 1) / 4 * 3 && table_grow(t) < 0) {
+		lerr("Failed to grow state table to %u slots", (t->mask + 1) * 2);
+	}
+
+	return t->num_objs - 1;
+}
+
+/* returns the id of "name", adding it if it's new. -1 on errors */
+static int64_t host_id(const char *name, int state)
+{
+	uint32_t hash = hash_str(2166136261U, name), pos;
+
+	for (pos = hash & hosts.mask; hosts.slot[pos].id; pos = (pos + 1) & hosts.mask) {
+		struct state_slot *s = &hosts.slot[pos];
+
+		if (s->hash == hash && !strcmp(arena + hosts.obj[s->id - 1].name, name))
+			return s->id - 1;
+	}
+
+	return table_add(&hosts, pos, hash, name, 0, state);
+}
 
 int state_init(void)
 {
-	host_states = g_hash_table_new_full(g_str_hash, g_str_equal,
-			free, free);
-	svc_states = g_hash_table_new_full(nm_service_hash, nm_service_equal,
-			(GDestroyNotify) nm_service_key_destroy, free);
+	state_deinit();
+	if (table_init(&hosts, 1 << 12) < 0 || table_init(&services, 1 << 14) < 0) {
+		lerr("Failed to allocate memory for state tables");
+		return -1;
+	}
 	return 0;
 }
 
 void state_deinit(void)
 {
-	g_hash_table_destroy(host_states);
-	g_hash_table_destroy(svc_states);
-	host_states = NULL;
-	svc_states = NULL;
+	table_destroy(&hosts);
+	table_destroy(&services);
+	free(arena);
+	arena = NULL;
+	arena_len = arena_alloc = 0;
+}
+
+size_t state_memory_usage(void)
+{
+	return arena_alloc +
+		((size_t)hosts.mask + 1 + (size_t)services.mask + 1) * sizeof(struct state_slot) +
+		((size_t)hosts.alloc_objs + services.alloc_objs) * sizeof(struct state_obj);
 }
 
 static inline int has_state_change(int *old, int state, int type)
@@ -47,28 +217,26 @@ static inline int has_state_change(int *old, int state, int type)
 
 int host_has_new_state(char *host, int state, int type)
 {
-	int *old_state;
+	int64_t id;
 
 	if (!host) {
 		lerr("host_has_new_state() called with NULL host");
 		return 0;
 	}
-	old_state = g_hash_table_lookup(host_states, host);
-	if (!old_state) {
-		int *cur_state;
 
-		cur_state = malloc(sizeof(*cur_state));
-		*cur_state = CAT_STATE(state, type);
-		g_hash_table_insert(host_states, strdup(host), cur_state);
+	id = host_id(host, NO_STATE);
+	if (id < 0) {
+		lerr("Failed to allocate memory for state of host '%s'", host);
 		return 1;
 	}
 
-	return has_state_change(old_state, state, type);
+	return has_state_change(&hosts.obj[id].state, state, type);
 }
 
 int service_has_new_state(char *host, char *desc, int state, int type)
 {
-	int *old_state;
+	int64_t hid, id;
+	uint32_t hash, pos;
 
 	if (!host) {
 		lerr("service_has_new_state() called with NULL host");
@@ -78,15 +246,24 @@ int service_has_new_state(char *host, char *desc, int state, int type)
 		lerr("service_has_new_state() called with NULL desc");
 		return 0;
 	}
-	old_state = g_hash_table_lookup(svc_states, &((nm_service_key){host, desc}));
-	if (!old_state) {
-		int *cur_state;
 
-		cur_state = malloc(sizeof(*cur_state));
-		*cur_state = CAT_STATE(state, type);
-		g_hash_table_insert(svc_states, nm_service_key_create(host, desc), cur_state);
+	hid = host_id(host, NO_STATE);
+	if (hid < 0) {
+		lerr("Failed to allocate memory for state of service '%s;%s'", host, desc);
 		return 1;
 	}
 
-	return has_state_change(old_state, state, type);
+	hash = hash_str(2166136261U ^ (uint32_t)hid * 2654435761U, desc);
+	for (pos = hash & services.mask; services.slot[pos].id; pos = (pos + 1) & services.mask) {
+		struct state_slot *s = &services.slot[pos];
+		struct state_obj *obj = &services.obj[s->id - 1];
+
+		if (s->hash == hash && obj->host == hid && !strcmp(arena + obj->name, desc))
+			return has_state_change(&obj->state, state, type);
+	}
+
+	id = table_add(&services, pos, hash, desc, hid, CAT_STATE(state, type));
+	if (id < 0)
+		lerr("Failed to allocate memory for state of service '%s;%s'", host, desc);
+	return 1;
 }
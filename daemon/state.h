@@ -1,7 +1,9 @@
 #ifndef INCLUDE_state_h__
 #define INCLUDE_state_h__
+#include <stddef.h>
 extern int state_init(void);
 extern void state_deinit(void);
+extern size_t state_memory_usage(void);
 extern int host_has_new_state(char *host, int state, int type);
 extern int service_has_new_state(char *host, char *desc, int state, int type);
 #define CAT_STATE(__state, __type) ((__state | (__type << 8)))
@@ -0,0 +1,85 @@
+#include <time.h>
+#include "cbtiming.h"
+#include "shared.h"
+#include "node.h"
+
+unsigned int cbtiming_sample_rate = 8;
+struct cb_timing cb_timing[2][NEBCALLBACK_NUMITEMS + 1];
+static unsigned int sample_counter;
+static uint64_t started; /* when we started keeping track */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 0 means "don't time this call" */
+uint64_t cbtiming_start(void)
+{
+	if (!cbtiming_sample_rate)
+		return 0;
+
+	if (!started)
+		started = now_ns();
+
+	if (++sample_counter < cbtiming_sample_rate)
+		return 0;
+	sample_counter = 0;
+
+	return now_ns();
+}
+
+void cbtiming_stop(int dir, int type, uint64_t start)
+{
+	struct cb_timing *t;
+
+	if (type == CTRL_PACKET || type < 0 || type > NEBCALLBACK_NUMITEMS)
+		type = NEBCALLBACK_NUMITEMS;
+
+	t = &cb_timing[dir][type];
+	t->calls++;
+	if (start)
+		histogram_add(&t->ns, now_ns() - start);
+}
+
+int dump_cbtiming(int sd)
+{
+	uint64_t wall, total = 0;
+	int dir, type;
+
+	for (dir = CBTIMING_OUT; dir <= CBTIMING_IN; dir++) {
+		for (type = 0; type <= NEBCALLBACK_NUMITEMS; type++) {
+			struct cb_timing *t = &cb_timing[dir][type];
+			uint64_t est;
+
+			if (!t->calls)
+				continue;
+
+			/* scale the sampled time up to all calls we've seen */
+			est = t->ns.count ? (histogram_mean(&t->ns) * t->calls) : 0;
+			total += est;
+			nsock_printf(sd, "direction=%s;type=%s;calls=%llu;sampled=%llu;"
+			             "p50_ns=%llu;p99_ns=%llu;max_ns=%llu;est_total_ns=%llu\n",
+			             dir == CBTIMING_OUT ? "out" : "in",
+			             type == NEBCALLBACK_NUMITEMS ? "CTRL_PACKET" : callback_name(type),
+			             (unsigned long long)t->calls, (unsigned long long)t->ns.count,
+			             (unsigned long long)histogram_percentile(&t->ns, 50),
+			             (unsigned long long)histogram_percentile(&t->ns, 99),
+			             (unsigned long long)t->ns.max, (unsigned long long)est);
+		}
+	}
+
+	wall = started ? now_ns() - started : 0;
+	nsock_printf(sd, "sample_rate=%u;wall_ns=%llu;merlin_ns=%llu;fraction=%.4f\n",
+	             cbtiming_sample_rate, (unsigned long long)wall,
+	             (unsigned long long)total, wall ? (double)total / wall : 0.0);
+
+	return 0;
+}
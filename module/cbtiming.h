@@ -0,0 +1,48 @@
+#ifndef INCLUDE_cbtiming_h__
+#define INCLUDE_cbtiming_h__
+
+#include <stdint.h>
+#include <naemon/naemon.h>
+#include "histogram.h"
+
+/*
+ * Time spent handling events, per event type. Outbound is what Naemon
+ * hands us through merlin_mod_hook(), inbound is what other nodes
+ * send us and we apply through handle_event(). Control packets are
+ * counted as type NEBCALLBACK_NUMITEMS.
+ *
+ * Only every cbtiming_sample_rate'th call is timed, so the totals
+ * used to work out how much of the event loop we use are estimates.
+ */
+#define CBTIMING_OUT 0
+#define CBTIMING_IN  1
+
+struct cb_timing {
+	uint64_t calls;
+	histogram ns; /* sampled durations */
+};
+
+extern unsigned int cbtiming_sample_rate;
+extern struct cb_timing cb_timing[2][NEBCALLBACK_NUMITEMS + 1];
+
+/**
+ * Start timing a call, if this one should be sampled
+ * @return A start time to pass to cbtiming_stop()
+ */
+extern uint64_t cbtiming_start(void);
+
+/**
+ * Account for a call started with cbtiming_start()
+ * @param dir CBTIMING_OUT or CBTIMING_IN
+ * @param type The callback type, or CTRL_PACKET for control packets
+ * @param start What cbtiming_start() returned
+ */
+extern void cbtiming_stop(int dir, int type, uint64_t start);
+
+/**
+ * Print timing statistics for all event types we've seen
+ * @param sd The socket to print to
+ */
+extern int dump_cbtiming(int sd);
+
+#endif
@@ -0,0 +1,258 @@
+#include "shared.h"
+#include <string.h>
+#include <naemon/naemon.h>
+#include "handover.h"
+#include "module.h"
+#include "logging.h"
+#include "ipc.h"
+#include "pgroup.h"
+
+unsigned int handover_timeout = 5;
+
+/* next check times handed over to us by a peer that's leaving */
+struct handover_entry {
+	time_t next_check;
+	merlin_node *from;
+};
+static struct handover_entry *host_handover, *service_handover;
+
+/* 0 means we don't own the host, or won't be checking it */
+static time_t host_next_check(unsigned int id, time_t now)
+{
+	host *h = host_ary[id];
+
+	if (pgroup_host_node(id) != &ipc || !h->checks_enabled)
+		return 0;
+
+	/* the result of a running check would be lost */
+	if (h->is_executing || h->next_check < now)
+		return now;
+	return h->next_check;
+}
+
+static time_t service_next_check(unsigned int id, time_t now)
+{
+	service *s = service_ary[id];
+
+	if (pgroup_service_node(id) != &ipc || !s->checks_enabled)
+		return 0;
+
+	if (s->is_executing || s->next_check < now)
+		return now;
+	return s->next_check;
+}
+
+static int send_handover(merlin_node *node, merlin_event *pkt, uint32_t count, uint32_t what)
+{
+	struct merlin_handover *ho = (struct merlin_handover *)pkt->body;
+
+	ho->what = what;
+	ho->count = count;
+	memset(&pkt->hdr, 0, HDR_SIZE);
+	pkt->hdr.sig.id = MERLIN_SIGNATURE;
+	pkt->hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	gettimeofday(&pkt->hdr.sent, NULL);
+	pkt->hdr.type = CTRL_PACKET;
+	pkt->hdr.code = CTRL_HANDOVER;
+	pkt->hdr.selection = CTRL_GENERIC;
+	pkt->hdr.len = sizeof(*ho) + count * (sizeof(int64_t) + sizeof(uint32_t));
+
+	return node_send_event(node, pkt, 1000);
+}
+
+static int send_times(merlin_node *node, uint32_t what, unsigned int total,
+                      time_t (*get)(unsigned int, time_t))
+{
+	static merlin_event pkt;
+	const unsigned int max = (sizeof(pkt.body) - sizeof(struct merlin_handover)) /
+		(sizeof(int64_t) + sizeof(uint32_t));
+	int64_t *next_check = (int64_t *)(pkt.body + sizeof(struct merlin_handover));
+	uint32_t *id = (uint32_t *)(next_check + max);
+	unsigned int i, count = 0, sent = 0;
+	time_t now = time(NULL);
+
+	/*
+	 * the columns are laid out for a full packet, so we move the
+	 * ids down next to the times before sending a partial one
+	 */
+	for (i = 0; i < total; i++) {
+		time_t when = get(i, now);
+
+		if (!when)
+			continue;
+		next_check[count] = when;
+		id[count++] = i;
+		if (count == max) {
+			memmove(next_check + count, id, count * sizeof(*id));
+			if (send_handover(node, &pkt, count, what) < 0)
+				return -1;
+			sent += count;
+			count = 0;
+		}
+	}
+	if (count) {
+		memmove(next_check + count, id, count * sizeof(*id));
+		if (send_handover(node, &pkt, count, what) < 0)
+			return -1;
+		sent += count;
+	}
+
+	return sent;
+}
+
+void handover_leave(void)
+{
+	static merlin_event pkt;
+	time_t deadline;
+	unsigned int i;
+
+	if (!handover_timeout)
+		return;
+
+	deadline = time(NULL) + handover_timeout;
+	for (i = 0; i < num_peers; i++) {
+		merlin_node *node = peer_table[i];
+		int left, prev = -1;
+		int hosts, services;
+
+		if (node->state != STATE_CONNECTED)
+			continue;
+		if (!(node->info.capabilities & MERLIN_CAP_HANDOVER)) {
+			linfo("HANDOVER: %s doesn't take handovers. It will reschedule our checks itself",
+			      node->name);
+			continue;
+		}
+
+		/* results first, or they'd arrive after the peer took over */
+		while (time(NULL) < deadline) {
+			left = node_drain_backlog(node, 250);
+			if (left <= 0 || left == prev)
+				break;
+			prev = left;
+		}
+		if (binlog_has_entries(node->binlog)) {
+			lwarn("HANDOVER: Failed to send %u backlogged events to %s before leaving",
+			      binlog_num_entries(node->binlog), node->name);
+		}
+
+		hosts = send_times(node, HANDOVER_HOSTS, num_objects.hosts, host_next_check);
+		services = send_times(node, HANDOVER_SERVICES, num_objects.services, service_next_check);
+		send_handover(node, &pkt, 0, HANDOVER_DONE);
+		linfo("HANDOVER: Sent next check times of %d hosts and %d services to %s",
+		      hosts, services, node->name);
+	}
+}
+
+static void store_times(merlin_node *node, struct merlin_handover *ho, uint32_t len)
+{
+	struct handover_entry **ary;
+	unsigned int i, total;
+	int64_t *next_check;
+	uint32_t *id;
+
+	if (ho->what == HANDOVER_HOSTS) {
+		ary = &host_handover;
+		total = num_objects.hosts;
+	} else {
+		ary = &service_handover;
+		total = num_objects.services;
+	}
+
+	if ((len - sizeof(*ho)) / (sizeof(int64_t) + sizeof(uint32_t)) < ho->count) {
+		lerr("HANDOVER: Packet from %s is truncated", node->name);
+		return;
+	}
+	if (!*ary && !(*ary = calloc(total, sizeof(**ary)))) {
+		lerr("HANDOVER: Failed to allocate memory for next check times");
+		return;
+	}
+
+	next_check = (int64_t *)((char *)ho + sizeof(*ho));
+	id = (uint32_t *)(next_check + ho->count);
+	for (i = 0; i < ho->count; i++) {
+		if (id[i] >= total)
+			continue;
+		(*ary)[id[i]].next_check = next_check[i];
+		(*ary)[id[i]].from = node;
+	}
+}
+
+/*
+ * Called once the node that sent us its check times is gone and the
+ * checks have been redistributed. Whatever we now own gets scheduled
+ * when the leaving node would have run it, and the expiry events of
+ * its running checks are cancelled since we'll be running them.
+ */
+static void apply_times(merlin_node *node)
+{
+	unsigned int i, hosts = 0, services = 0;
+	time_t now = time(NULL);
+
+	for (i = 0; host_handover && i < num_objects.hosts; i++) {
+		struct handover_entry *e = &host_handover[i];
+		host *h = host_ary[i];
+
+		if (e->from != node)
+			continue;
+		e->from = NULL;
+		if (pgroup_host_node(i) != &ipc)
+			continue;
+
+		unexpire_host(h);
+		if (h->next_check_event) {
+			destroy_event(h->next_check_event);
+			h->next_check_event = NULL;
+		}
+		schedule_host_check(h, e->next_check > now ? e->next_check : now, CHECK_OPTION_NONE);
+		hosts++;
+	}
+
+	for (i = 0; service_handover && i < num_objects.services; i++) {
+		struct handover_entry *e = &service_handover[i];
+		service *s = service_ary[i];
+
+		if (e->from != node)
+			continue;
+		e->from = NULL;
+		if (pgroup_service_node(i) != &ipc)
+			continue;
+
+		unexpire_service(s);
+		if (s->next_check_event) {
+			destroy_event(s->next_check_event);
+			s->next_check_event = NULL;
+		}
+		schedule_service_check(s, e->next_check > now ? e->next_check : now, CHECK_OPTION_NONE);
+		services++;
+	}
+
+	linfo("HANDOVER: Took over %u hosts and %u services from %s", hosts, services, node->name);
+}
+
+void handover_handle(merlin_node *node, merlin_event *pkt)
+{
+	struct merlin_handover *ho = (struct merlin_handover *)pkt->body;
+
+	if (node->type != MODE_PEER || pkt->hdr.len < sizeof(*ho))
+		return;
+
+	switch (ho->what) {
+	case HANDOVER_HOSTS:
+	case HANDOVER_SERVICES:
+		store_times(node, ho, pkt->hdr.len);
+		break;
+	case HANDOVER_DONE:
+		linfo("HANDOVER: %s is leaving", node->name);
+		node_disconnect(node, "Node is shutting down");
+		apply_times(node);
+		break;
+	default:
+		lwarn_ratelimit(10, "HANDOVER: Unknown handover type %u from %s", ho->what, node->name);
+	}
+}
+
+void handover_deinit(void)
+{
+	safe_free(host_handover);
+	safe_free(service_handover);
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_handover_h__
+#define INCLUDE_handover_h__
+
+#include "node.h"
+
+/*
+ * Planned leave. A peer that is shutting down flushes its backlog to
+ * its peers and tells them when it would have run its checks next,
+ * so the peers that take them over can keep the same schedule.
+ */
+
+/* seconds we may spend handing over when shutting down. 0 disables it */
+extern unsigned int handover_timeout;
+
+/**
+ * Hand our checks over to our peers. Called before we disconnect
+ * from everyone when we're shutting down.
+ */
+extern void handover_leave(void);
+
+/**
+ * Handle a CTRL_HANDOVER packet from a peer that is leaving
+ * @param node The node that sent it
+ * @param pkt The packet
+ */
+extern void handover_handle(merlin_node *node, merlin_event *pkt);
+
+extern void handover_deinit(void);
+
+#endif
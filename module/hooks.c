@@ -9,6 +9,7 @@
  * thingie.
  */
 #include "hooks.h"
+#include "cbtiming.h"
 #include "node.h"
 #include "shared.h"
 #include "node.h"
@@ -23,147 +24,158 @@
 extern merlin_event *recv_event;
 
 static nebstruct_comment_data *block_comment;
-static int check_dupes;
-static merlin_event last_pkt;
-static unsigned long long dupes, dupe_bytes;
 static uint32_t ev_mask;
 
+/*
+ * Duplicate suppression. We keep a 64-bit hash of the last encoded
+ * status packet we sent for each host and service, indexed by object
+ * id. send_{host,service}_status() point dedup_slot at the entry for
+ * the object being sent, and send_generic() compares and updates it.
+ */
+static uint64_t *host_pkt_hash, *service_pkt_hash;
+static uint64_t *dedup_slot;
+struct merlin_dedup_stats dedup_stats[NEBCALLBACK_NUMITEMS];
+
 struct merlin_check_stats {
 	unsigned long long poller, peer, self, orphaned;
 };
 static struct merlin_check_stats service_checks, host_checks;
 
 
-#ifdef DEBUG_DUPES_CAREFULLY
-#define mos_case(vname) \
-	if (offset >= offsetof(monitored_object_state, vname) && \
-	    offset < offsetof(monitored_object_state, vname) + sizeof(mss.vname)) \
-			return #vname
-static const char *mos_offset_name(int offset)
+/*
+ * 64-bit FNV-1a over the parts of the packet that describe the
+ * object's state. Most of the header is left out on purpose, since
+ * 'sent' and 'selection' vary between otherwise identical events.
+ * Hash 0 is reserved to mean "nothing sent yet".
+ */
+static uint64_t pkt_hash(merlin_event *pkt)
 {
-	monitored_object_state mss;
+	const unsigned char *p = (const unsigned char *)pkt->body;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t i;
 
-	if (offset >= sizeof(monitored_object_state)) {
-		return "string area";
-	}
+	h = (h ^ pkt->hdr.type) * 0x100000001b3ULL;
+	h = (h ^ pkt->hdr.code) * 0x100000001b3ULL;
+	h = (h ^ pkt->hdr.len) * 0x100000001b3ULL;
+	for (i = 0; i < pkt->hdr.len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
 
-	mos_case(initial_state);
-	mos_case(flap_detection_enabled);
-	mos_case(low_flap_threshold);
-	mos_case(high_flap_threshold);
-	mos_case(check_freshness);
-	mos_case(freshness_threshold);
-	mos_case(process_performance_data);
-	mos_case(checks_enabled);
-	mos_case(accept_passive_checks);
-	mos_case(event_handler_enabled);
-	mos_case(obsess);
-	mos_case(problem_has_been_acknowledged);
-	mos_case(acknowledgement_type);
-	mos_case(check_type);
-	mos_case(current_state);
-	mos_case(last_state);
-	mos_case(last_hard_state);
-	mos_case(state_type);
-	mos_case(current_attempt);
-	mos_case(current_event_id);
-	mos_case(last_event_id);
-	mos_case(current_problem_id);
-	mos_case(last_problem_id);
-	mos_case(latency);
-	mos_case(execution_time);
-	mos_case(notifications_enabled);
-	mos_case(last_notification);
-	mos_case(next_notification);
-	mos_case(next_check);
-	mos_case(last_check);
-	mos_case(last_state_change);
-	mos_case(last_hard_state_change);
-	mos_case(last_time_up);
-	mos_case(last_time_down);
-	mos_case(last_time_unreachable);
-	mos_case(has_been_checked);
-	mos_case(current_notification_number);
-	mos_case(current_notification_id);
-	mos_case(check_flapping_recovery_notification);
-	mos_case(scheduled_downtime_depth);
-	mos_case(pending_flex_downtime);
-	mos_case(is_flapping);
-	mos_case(flapping_comment_id);
-	mos_case(percent_state_change);
-	mos_case(plugin_output);
-	mos_case(long_plugin_output);
-	mos_case(perf_data);
-
-	return NULL;
+	return h ? h : 1;
 }
-#endif
 
-static int is_dupe(merlin_event *pkt)
+static int is_dupe(merlin_event *pkt, uint64_t *slot, uint64_t hash)
 {
-	if (!check_dupes) {
-		return 0;
-	}
+	struct merlin_dedup_stats *ds;
 
-	if (last_pkt.hdr.type != pkt->hdr.type) {
+	if (!slot) {
 		return 0;
 	}
 
-	if (packet_size(&last_pkt) != packet_size(pkt)) {
+	ds = &dedup_stats[pkt->hdr.type];
+	ds->checked++;
+	if (*slot != hash) {
 		return 0;
 	}
 
-	/* if this is truly a dupe, return 1 and log every 100'th */
-	if (!memcmp(&last_pkt, pkt, packet_size(pkt))) {
-		dupe_bytes += packet_size(pkt);
-		if (!(++dupes % 100)) {
-			ldebug("%s in %llu duplicate packets dropped",
-				   human_bytes(dupe_bytes), dupes);
-		}
-		return 1;
+	/* this is truly a dupe, so return 1 and log every 100'th */
+	ds->dupe_bytes += packet_size(pkt);
+	if (!(++ds->dupes % 100)) {
+		ldebug("%s in %llu duplicate %s packets dropped",
+			   human_bytes(ds->dupe_bytes), ds->dupes,
+			   callback_name(pkt->hdr.type));
 	}
 
-#ifdef DEBUG_DUPES_CAREFULLY
-	/*
-	 * The "near-dupes" detection only works for host and
-	 * service status events for now, so return early if
-	 * the event type is neither of those
-	 */
-	if (pkt->hdr.type == NEBCALLBACK_SERVICE_STATUS_DATA ||
-		pkt->hdr.type == NEBCALLBACK_HOST_STATUS_DATA)
-	{
-		int i, diffbytes = 0, diffvars = 0;
-		const char *name, *last_name = NULL;
-		unsigned char *a, *b;
-
-		lwarn("Near-duplicate %s event created by Nagios",
-			  callback_name(pkt->hdr.type));
-
-		a = (unsigned char *)&last_pkt;
-		b = (unsigned char *)pkt;
-		for (i = 0; i < packet_size(pkt); i++) {
-			if (a[i] == b[i])
-				continue;
-			diffbytes++;
-			name = mos_offset_name(i);
-			if (name && name == last_name)
-				continue;
-			diffvars++;
-			ldebug("%s differs", name);
-			last_name = name;
-		}
-		ldebug("%d variables and %d bytes differ", diffvars, diffbytes);
+	return 1;
+}
+
+int dump_dedup_stats(int sd)
+{
+	int i;
+
+	for (i = 0; i < NEBCALLBACK_NUMITEMS; i++) {
+		struct merlin_dedup_stats *ds = &dedup_stats[i];
+
+		if (!ds->checked)
+			continue;
+		nsock_printf(sd, "type=%s;checked=%llu;dupes=%llu;dupe_bytes=%llu;rate=%.2f\n",
+					 callback_name(i), ds->checked, ds->dupes, ds->dupe_bytes,
+					 (float)ds->dupes * 100 / ds->checked);
 	}
-#endif
 
 	return 0;
 }
 
+/*
+ * Status events for nodes that don't want all fields. Each variant
+ * is encoded at most once per event, no matter how many nodes want
+ * it, and the buffers are reused for the next event.
+ */
+static merlin_event *projected[STRIP_ALL + 1];
+static unsigned int projected_valid;
+
+static merlin_event *project_event(merlin_event *pkt, void *data, int strip)
+{
+	monitored_object_state *state;
+	char *perf_data, *long_output;
+	merlin_event *p;
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		state = &((merlin_host_status *)data)->state;
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		state = &((merlin_service_status *)data)->state;
+		break;
+	default:
+		return pkt;
+	}
+
+	if (projected_valid & (1 << strip))
+		return projected[strip];
+
+	if (!projected[strip] && !(projected[strip] = malloc(sizeof(merlin_event)))) {
+		lerr("Failed to allocate memory for stripped event: %s", strerror(errno));
+		return pkt;
+	}
+	p = projected[strip];
+
+	perf_data = state->perf_data;
+	long_output = state->long_plugin_output;
+	if (strip & STRIP_PERF_DATA)
+		state->perf_data = NULL;
+	if (strip & STRIP_LONG_OUTPUT)
+		state->long_plugin_output = NULL;
+
+	memcpy(&p->hdr, &pkt->hdr, HDR_SIZE);
+	p->hdr.len = merlin_encode_event(p, data);
+
+	state->perf_data = perf_data;
+	state->long_plugin_output = long_output;
+
+	projected_valid |= 1 << strip;
+	return p;
+}
+
+static int send_projected(merlin_node *node, merlin_event *pkt, void *data)
+{
+	if (node->strip)
+		pkt = project_event(pkt, data, node->strip & STRIP_ALL);
+
+	return net_sendto(node, pkt);
+}
+
 static int send_generic(merlin_event *pkt, void *data)
 {
 	int result = 0;
 	uint i, ntable_stop = num_masters + num_peers;
-	linked_item *li;
+	uint64_t hash = 0, *slot = dedup_slot;
+	node_selection *sel;
+
+	/* only the status event the slot was set up for may use it */
+	dedup_slot = NULL;
+	projected_valid = 0;
 
 	if ((!num_nodes || pkt->hdr.code == MAGIC_NONET) && !daemon_wants(pkt->hdr.type)) {
 		ldebug("ipcfilter: Not sending %s event. %s, and daemon doesn't want it",
@@ -183,24 +195,26 @@ static int send_generic(merlin_event *pkt, void *data)
 		return -1;
 	}
 
-	if (is_dupe(pkt)) {
-		ldebug("ipcfilter: Not sending %s event: Duplicate packet",
-		       callback_name(pkt->hdr.type));
-		return 0;
+	if (slot) {
+		hash = pkt_hash(pkt);
+		if (is_dupe(pkt, slot, hash)) {
+			ldebug("ipcfilter: Not sending %s event: Duplicate packet",
+			       callback_name(pkt->hdr.type));
+			return 0;
+		}
 	}
 
 	if (daemon_wants(pkt->hdr.type)) {
 		result = ipc_send_event(pkt);
-		/*
-		 * preserve the event so we can check for dupes,
-		 * but only if we successfully sent it
-		 */
-		if (result < 0)
-			memset(&last_pkt, 0, sizeof(last_pkt));
-		else
-			memcpy(&last_pkt, pkt, packet_size(pkt));
 	}
 
+	/*
+	 * remember the hash so we can check for dupes, but only
+	 * if we successfully sent the event
+	 */
+	if (slot)
+		*slot = result < 0 ? 0 : hash;
+
 	if (!num_nodes)
 		return 0;
 
@@ -212,17 +226,17 @@ static int send_generic(merlin_event *pkt, void *data)
 	if (magic_destination(pkt)) {
 		if ((pkt->hdr.selection & DEST_MASTERS) == DEST_MASTERS) {
 			for (i = 0; i < num_masters; i++) {
-				net_sendto(node_table[i], pkt);
+				send_projected(node_table[i], pkt, data);
 			}
 		}
 		if ((pkt->hdr.selection & DEST_PEERS) == DEST_PEERS) {
 			for (i = 0; i < num_peers; i++) {
-				net_sendto(peer_table[i], pkt);
+				send_projected(peer_table[i], pkt, data);
 			}
 		}
 		if ((pkt->hdr.selection & DEST_POLLERS) == DEST_POLLERS) {
 			for (i = 0; i < num_pollers; i++) {
-				net_sendto(poller_table[i], pkt);
+				send_projected(poller_table[i], pkt, data);
 			}
 		}
 
@@ -239,35 +253,49 @@ static int send_generic(merlin_event *pkt, void *data)
 		ntable_stop = num_nodes;
 	}
 
-	/* Send this to all who should have it */
-	for (i = 0; i < ntable_stop; i++) {
-		net_sendto(node_table[i], pkt);
+	/*
+	 * Send this to all who should have it. Relayed events go out
+	 * in full, since the relay passes on what it gets to others.
+	 */
+	if (relay_to_masters && ntable_stop != num_nodes) {
+		net_sendto_masters(pkt);
+		i = num_masters;
+	} else {
+		i = 0;
+	}
+	for (; i < ntable_stop; i++) {
+		send_projected(node_table[i], pkt, data);
 	}
 
 	/* if we've already sent to everyone we return early */
 	if (ntable_stop == num_nodes || !num_pollers)
 		return 0;
 
-	li = nodes_by_sel_id(pkt->hdr.selection);
-	if (!li) {
+	sel = node_selection_by_id(pkt->hdr.selection);
+	if (!sel) {
 		lerr("No matching selection for id %d", pkt->hdr.selection);
 		return -1;
 	}
 
-	for (; li; li = li->next_item) {
-		net_sendto((merlin_node *)li->item, pkt);
+	for (i = 0; i < sel->node_count; i++) {
+		send_projected(sel->node_ary[i], pkt, data);
 	}
 
 	return result;
 }
 
-static int get_selection(const char *key)
+static int get_host_selection(const host *h)
 {
-	node_selection *sel = node_selection_by_hostname(key);
+	node_selection *sel = node_selection_by_host(h);
 
 	return sel ? sel->id & 0xffff : DEST_PEERS_MASTERS;
 }
 
+static int get_selection(const char *key)
+{
+	return get_host_selection(find_host(key));
+}
+
 static int get_hostgroup_selection(const char *key)
 {
 	node_selection *sel = node_selection_by_name(key);
@@ -278,7 +306,6 @@ static int get_hostgroup_selection(const char *key)
 static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 {
 	merlin_host_status st_obj;
-	static host *last_obj = NULL;
 
 	if (obj == merlin_recv_host)
 		return 0;
@@ -288,12 +315,8 @@ static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 		return -1;
 	}
 	memset(&st_obj, 0, sizeof(st_obj));
-	if (obj == last_obj) {
-		check_dupes = 1;
-	} else {
-		check_dupes = 0;
-		last_obj = obj;
-	}
+	if (host_pkt_hash)
+		dedup_slot = &host_pkt_hash[obj->id];
 
 	st_obj.nebattr = nebattr;
 	st_obj.name = obj->name;
@@ -307,19 +330,14 @@ static int send_host_status(merlin_event *pkt, int nebattr, host *obj)
 static int send_service_status(merlin_event *pkt, int nebattr, service *obj)
 {
 	merlin_service_status st_obj;
-	static service *last_obj = NULL;
 
 	if (!obj) {
 		lerr("send_service_status() called with NULL obj");
 		return -1;
 	}
 	memset(&st_obj, 0, sizeof(st_obj));
-	if (obj == last_obj) {
-		check_dupes = 1;
-	} else {
-		check_dupes = 0;
-		last_obj = obj;
-	}
+	if (service_pkt_hash)
+		dedup_slot = &service_pkt_hash[obj->id];
 	st_obj.nebattr = nebattr;
 	st_obj.host_name = obj->host_name;
 	st_obj.service_description = obj->description;
@@ -695,14 +713,10 @@ static int hook_external_command(merlin_event *pkt, void *data)
 		break;
 
 	case CMD_PROCESS_HOST_CHECK_RESULT:
-		if (!merlin_sender) {
-			/* Send to correct node */
-			pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
-		}
 		/*
 		 * Processing check results should only be done by the node owning the
 		 * object. Thus, forward to all nodes, but execute it only on the node
-		 * owning the object.
+		 * owning the object. We look the host up once and use it for both.
 		 */
 		{
 			merlin_node *node;
@@ -715,10 +729,16 @@ static int hook_external_command(merlin_event *pkt, void *data)
 				 * invalid arguments, we shouldn't do anything, but naemon can
 				 * result in error later
 				 */
+				if (!merlin_sender)
+					pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
 				break;
 			}
 
 			this_host = find_host(strndupa(ds->command_args, delim - ds->command_args));
+			if (!merlin_sender) {
+				/* Send to correct node */
+				pkt->hdr.selection = get_host_selection(this_host);
+			}
 			if(this_host == NULL) {
 				/*
 				 * Unknown host. Thus, nothing we know that we should handle.
@@ -737,10 +757,6 @@ static int hook_external_command(merlin_event *pkt, void *data)
 		}
 
 	case CMD_PROCESS_SERVICE_CHECK_RESULT:
-		if (!merlin_sender) {
-			/* Send to correct node */
-			pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
-		}
 		/*
 		 * Processing check results should only be done by the node owning the
 		 * object. Thus, forward to all nodes, but execute it only on the node
@@ -756,17 +772,28 @@ static int hook_external_command(merlin_event *pkt, void *data)
 
 			delim_host = strchr(ds->command_args, ';');
 			if(delim_host == NULL) {
+				if (!merlin_sender)
+					pkt->hdr.selection = get_cmd_selection(ds->command_args, 0);
 				break;
 			}
 			host_name = strndupa(ds->command_args, delim_host - ds->command_args);
 
 			delim_service = strchr(delim_host+1, ';');
 			if(delim_service == NULL) {
+				if (!merlin_sender)
+					pkt->hdr.selection = get_selection(host_name);
 				break;
 			}
 			service_description = strndupa(delim_host+1, delim_service - (delim_host+1));
 
 			this_service = find_service(host_name, service_description);
+			if (!merlin_sender) {
+				/* Send to correct node */
+				if (this_service)
+					pkt->hdr.selection = get_host_selection(this_service->host_ptr);
+				else
+					pkt->hdr.selection = get_selection(host_name);
+			}
 			if(this_service == NULL) {
 				/*
 				 * Unknown service. Thus, nothing we know that we should handle.
@@ -1044,8 +1071,9 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 	merlin_event pkt;
 	int result = 0;
 	neb_cb_result *neb_result = NULL;
-	static time_t last_pulse = 0, last_flood_warning = 0;
+	static time_t last_pulse = 0;
 	time_t now;
+	uint64_t timer;
 
 	if (!data) {
 		lerr("eventbroker module called with NULL data");
@@ -1055,11 +1083,13 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 		return neb_cb_result_create(-1);
 	}
 
+	timer = cbtiming_start();
+
 	/*
 	 * must reset this here so events we don't check for
 	 * dupes are always sent properly
 	 */
-	check_dupes = 0;
+	dedup_slot = NULL;
 
 	/* self-heal nodes that have missed out on the fact that we're up */
 	now = time(NULL);
@@ -1133,13 +1163,10 @@ neb_cb_result * merlin_mod_hook(int cb, void *data)
 		neb_result = neb_cb_result_create_full(result, "No callback result description available");
 	}
 
-	if (result < 0 && now - last_flood_warning > 30) {
-		/* log a warning every 30 seconds */
-		last_flood_warning = now;
-		lwarn("Daemon is flooded and backlogging failed");
-	}
-
+	if (result < 0)
+		lwarn_ratelimit(30, "Daemon is flooded and backlogging failed");
 
+	cbtiming_stop(CBTIMING_OUT, cb, timer);
 	return neb_result;
 }
 
@@ -1180,6 +1207,13 @@ int merlin_hooks_init(uint32_t mask)
 	uint i;
 	ev_mask = mask;
 
+	free(host_pkt_hash);
+	free(service_pkt_hash);
+	host_pkt_hash = calloc(num_objects.hosts, sizeof(*host_pkt_hash));
+	service_pkt_hash = calloc(num_objects.services, sizeof(*service_pkt_hash));
+	if (!host_pkt_hash || !service_pkt_hash)
+		lwarn("Failed to allocate packet hash tables. Duplicate suppression disabled");
+
 	if (!use_database && !num_nodes) {
 		ldebug("Not using database and no nodes configured. Ignoring all events");
 		return 0;
@@ -1222,6 +1256,10 @@ int merlin_hooks_deinit(void)
 		neb_deregister_callback(cb->type, merlin_mod_hook);
 	}
 
+	dedup_slot = NULL;
+	safe_free(host_pkt_hash);
+	safe_free(service_pkt_hash);
+
 	return 0;
 }
 
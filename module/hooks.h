@@ -9,5 +9,11 @@ extern void *neb_handle;
 extern int merlin_hooks_init(uint32_t mask);
 extern int merlin_hooks_deinit(void);
 extern void merlin_set_block_comment(nebstruct_comment_data *cmnt);
+extern int dump_dedup_stats(int sd);
+
+struct merlin_dedup_stats {
+	unsigned long long checked, dupes, dupe_bytes;
+};
+extern struct merlin_dedup_stats dedup_stats[NEBCALLBACK_NUMITEMS];
 
 #endif
@@ -0,0 +1,277 @@
+#include "shared.h"
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <naemon/naemon.h>
+#include "inbound.h"
+#include "module.h"
+#include "logging.h"
+
+/*
+ * Both rings are single-producer, single-consumer. "head" is only
+ * written by the producer and "tail" only by the consumer, same as
+ * in shmring.c, so all we need are barriers between touching a slot
+ * and publishing the new position.
+ */
+#define INBOUND_RING_SIZE 4096 /* must be a power of 2 */
+
+struct inbound_rec {
+	merlin_node *node;
+	merlin_event *pkt;
+	void *obj;              /* the host or service the event is about */
+	unsigned int epoch;     /* node->inbound.epoch when we read it */
+};
+
+struct inbound_ring {
+	struct inbound_rec slot[INBOUND_RING_SIZE];
+	volatile unsigned long head;
+	char pad1[64 - sizeof(unsigned long)];
+	volatile unsigned long tail;
+	volatile int waiting;   /* the consumer is about to go to sleep */
+	char pad2[64 - sizeof(unsigned long) - sizeof(int)];
+};
+
+int inbound_worker = 1;
+static struct inbound_ring *to_worker, *to_main;
+static int worker_efd = -1, ready_efd = -1;
+static volatile int stopping;
+static pthread_t worker_thread;
+static int running;
+
+static int ring_push(struct inbound_ring *r, const struct inbound_rec *rec)
+{
+	if (r->head - r->tail >= INBOUND_RING_SIZE)
+		return -1;
+
+	r->slot[r->head & (INBOUND_RING_SIZE - 1)] = *rec;
+	__sync_synchronize();
+	r->head++;
+	return 0;
+}
+
+static int ring_pop(struct inbound_ring *r, struct inbound_rec *rec)
+{
+	if (r->tail == r->head)
+		return 0;
+
+	__sync_synchronize();
+	*rec = r->slot[r->tail & (INBOUND_RING_SIZE - 1)];
+	__sync_synchronize();
+	r->tail++;
+	return 1;
+}
+
+static void efd_signal(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0) {
+		/* the counter can't overflow in practice, so nothing to do */
+	}
+}
+
+/*
+ * Look up the object an event is about. Naemon's object tables
+ * don't change while we're loaded, so this is safe to do off the
+ * main thread as long as we only read from them.
+ */
+static void resolve(struct inbound_rec *rec)
+{
+	const merlin_event *pkt = rec->pkt;
+	const char *name, *desc;
+
+	rec->obj = NULL;
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		name = peek_string(pkt, offsetof(merlin_host_status, name));
+		if (name)
+			rec->obj = find_host(name);
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		name = peek_string(pkt, offsetof(merlin_service_status, host_name));
+		desc = peek_string(pkt, offsetof(merlin_service_status, service_description));
+		if (name && desc)
+			rec->obj = find_service(name, desc);
+		break;
+	}
+}
+
+static void *worker_main(__attribute__((unused)) void *arg)
+{
+	struct inbound_rec rec;
+	uint64_t val;
+
+	while (!stopping) {
+		unsigned int done = 0;
+
+		while (ring_pop(to_worker, &rec)) {
+			resolve(&rec);
+
+			/* the Naemon thread is behind, so give it a moment */
+			while (ring_push(to_main, &rec) < 0) {
+				struct timespec ts = { 0, 200000 };
+
+				if (stopping) {
+					free(rec.pkt);
+					return NULL;
+				}
+				efd_signal(ready_efd);
+				nanosleep(&ts, NULL);
+			}
+
+			/* let the Naemon thread get going on large batches */
+			if (!(++done % 64))
+				efd_signal(ready_efd);
+		}
+		if (done % 64)
+			efd_signal(ready_efd);
+
+		/* announce that we're going to sleep, then check again */
+		to_worker->waiting = 1;
+		__sync_synchronize();
+		if (to_worker->head == to_worker->tail && !stopping) {
+			if (read(worker_efd, &val, sizeof(val)) < 0) {
+				/* interrupted. Just check again */
+			}
+		}
+		to_worker->waiting = 0;
+	}
+
+	return NULL;
+}
+
+int inbound_init(void)
+{
+	int ret;
+
+	if (!inbound_worker || running)
+		return 0;
+
+	to_worker = calloc(1, sizeof(*to_worker));
+	to_main = calloc(1, sizeof(*to_main));
+	worker_efd = eventfd(0, EFD_CLOEXEC);
+	ready_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (!to_worker || !to_main || worker_efd < 0 || ready_efd < 0) {
+		lerr("Failed to set up inbound event pipeline: %s", strerror(errno));
+		inbound_deinit();
+		return -1;
+	}
+
+	stopping = 0;
+	ret = pthread_create(&worker_thread, NULL, worker_main, NULL);
+	if (ret) {
+		lerr("Failed to start inbound event worker: %s", strerror(ret));
+		inbound_deinit();
+		return -1;
+	}
+	running = 1;
+
+	return 0;
+}
+
+void inbound_deinit(void)
+{
+	struct inbound_rec rec;
+
+	if (running) {
+		stopping = 1;
+		efd_signal(worker_efd);
+		pthread_join(worker_thread, NULL);
+		running = 0;
+	}
+
+	if (to_worker) {
+		while (ring_pop(to_worker, &rec))
+			free(rec.pkt);
+	}
+	if (to_main) {
+		while (ring_pop(to_main, &rec))
+			free(rec.pkt);
+	}
+	safe_free(to_worker);
+	safe_free(to_main);
+
+	if (worker_efd >= 0)
+		close(worker_efd);
+	if (ready_efd >= 0)
+		close(ready_efd);
+	worker_efd = ready_efd = -1;
+}
+
+int inbound_running(void)
+{
+	return running;
+}
+
+int inbound_ready_fd(void)
+{
+	return ready_efd;
+}
+
+void inbound_ack(void)
+{
+	uint64_t val;
+
+	if (read(ready_efd, &val, sizeof(val)) < 0) {
+		/* nothing to ack. That's fine */
+	}
+}
+
+int inbound_full(void)
+{
+	return to_worker->head - to_worker->tail >= INBOUND_RING_SIZE;
+}
+
+int inbound_submit(merlin_node *node, merlin_event *pkt)
+{
+	struct inbound_rec rec;
+
+	rec.node = node;
+	rec.pkt = pkt;
+	rec.obj = NULL;
+	rec.epoch = node->inbound.epoch;
+
+	return ring_push(to_worker, &rec);
+}
+
+void inbound_kick(void)
+{
+	__sync_synchronize();
+	if (to_worker->waiting)
+		efd_signal(worker_efd);
+}
+
+int inbound_idle(void)
+{
+	return to_main->tail == to_worker->head;
+}
+
+int inbound_get(merlin_node **node, merlin_event **pkt, void **obj)
+{
+	struct inbound_rec rec;
+
+	while (ring_pop(to_main, &rec)) {
+		/*
+		 * node_disconnect() has us apply everything we have from
+		 * a node before it bumps the epoch, so this only catches
+		 * packets that somehow outlived their connection
+		 */
+		if (rec.epoch != rec.node->inbound.epoch) {
+			free(rec.pkt);
+			continue;
+		}
+
+		*node = rec.node;
+		*pkt = rec.pkt;
+		*obj = rec.obj;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_inbound_h__
+#define INCLUDE_inbound_h__
+
+#include "node.h"
+
+/*
+ * Inbound event pipeline. Packets read from other nodes are handed
+ * to a worker thread which looks up the objects they concern, so the
+ * Naemon thread only has to apply them. Packets and results travel
+ * through two single-producer, single-consumer rings, so neither
+ * thread ever waits for a lock.
+ */
+
+/* use a worker thread for inbound events */
+extern int inbound_worker;
+
+/**
+ * Start the worker thread
+ * @return 0 on success, < 0 on errors
+ */
+extern int inbound_init(void);
+
+/**
+ * Stop the worker thread and free everything still in the pipeline
+ */
+extern void inbound_deinit(void);
+
+/** @return 1 if the worker thread is running */
+extern int inbound_running(void);
+
+/**
+ * The eventfd the worker uses to tell the Naemon thread it has
+ * results. Must be read with inbound_ack() when it fires.
+ */
+extern int inbound_ready_fd(void);
+extern void inbound_ack(void);
+
+/** @return 1 if the worker can't take any more packets right now */
+extern int inbound_full(void);
+
+/**
+ * Pass a packet to the worker thread
+ * @param node The node the packet came from
+ * @param pkt The packet. The pipeline owns it from now on
+ * @return 0 on success, -1 if the pipeline is full
+ */
+extern int inbound_submit(merlin_node *node, merlin_event *pkt);
+
+/**
+ * Wake the worker if it's sleeping. Called after a batch of
+ * inbound_submit() calls.
+ */
+extern void inbound_kick(void);
+
+/** @return 1 if the worker has passed back every packet submitted */
+extern int inbound_idle(void);
+
+/**
+ * Get the next packet the worker is done with. Packets from
+ * connections that have been closed since are silently dropped,
+ * so drain the pipeline before bumping a node's epoch.
+ * @param node Where to store the node the packet came from
+ * @param pkt Where to store the packet. The caller must free it
+ * @param obj Where to store the host or service it's about, or NULL
+ * @return 1 if a packet was returned, 0 if there are none ready
+ */
+extern int inbound_get(merlin_node **node, merlin_event **pkt, void **obj);
+
+#endif
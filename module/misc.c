@@ -1,6 +1,7 @@
 #include "shared.h"
 #include "misc.h"
 #include "sha1.h"
+#include "logging.h"
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -10,6 +11,9 @@
 #include <naemon/naemon.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 /* does a deep free of a file_list struct */
 void file_list_free(struct file_list *list)
@@ -200,26 +204,6 @@ static struct file_list *get_cfg_files(char *str, struct file_list *list)
 	return list;
 }
 
-/* returns the last timestamp of a configuration change */
-time_t get_last_cfg_change(void)
-{
-	time_t mt = 0;
-	struct file_list *flist, *base;
-
-	base = flist = get_cfg_files(config_file, NULL);
-
-	for (; flist; flist = flist->next) {
-		if (flist->st.st_mtime > mt)
-			mt = flist->st.st_mtime;
-	}
-
-	if (base)
-		file_list_free(base);
-
-	/* 0 if we for some reason failed */
-	return mt;
-}
-
 static int flist_cmp(const void *a_, const void *b_)
 {
 	const file_list *a = *(const file_list **)a_;
@@ -238,13 +222,21 @@ int hash_add_file(const char *path, blk_SHA_CTX *ctx)
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return -1;
-	fstat(fd, &st);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	/* mmap() refuses zero-length maps, and there's nothing to hash */
+	if (!st.st_size) {
+		close(fd);
+		return 0;
+	}
 	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!map)
+	close(fd);
+	if (map == MAP_FAILED)
 		return -1;
 	blk_SHA1_Update(ctx, map, st.st_size);
 	munmap(map, st.st_size);
-	close(fd);
 
 	return 0;
 }
@@ -277,28 +269,299 @@ file_list **get_sorted_oconf_files(unsigned int *n_files)
 	return sorted_flist;
 }
 
+static void free_sorted_flist(file_list **sorted_flist, unsigned int num_files)
+{
+	unsigned int i;
+
+	if (!sorted_flist)
+		return;
+
+	for (i = 0; i < num_files; i++) {
+		sorted_flist[i]->next = NULL;
+		file_list_free(sorted_flist[i]);
+	}
+	free(sorted_flist);
+}
+
 /*
- * calculate a sha1 hash of the contents of all config files
- * sorted by their full path.
+ * Digests of individual config files are cached on disk between runs,
+ * keyed on the path and the stat() info of the file, so we only have
+ * to read files that have actually changed since we last looked.
+ */
+#define CFG_HASH_CACHE_HEADER "# merlin config hash cache v1\n"
+#define CFG_HASH_MAX_THREADS 16
+const char *cfg_hash_cache = CACHEDIR "/config-hash.cache";
+
+struct cfg_digest {
+	unsigned long ino;
+	long long size;
+	long long mtime;
+	long mtime_ns;
+	unsigned char sha1[20];
+};
+
+static int cfg_digest_matches(const struct cfg_digest *d, const struct stat *st)
+{
+	return d->ino == (unsigned long)st->st_ino &&
+		d->size == (long long)st->st_size &&
+		d->mtime == (long long)st->st_mtim.tv_sec &&
+		d->mtime_ns == st->st_mtim.tv_nsec;
+}
+
+static int unhex(const char *str, unsigned char *out, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned int byte;
+		if (sscanf(str + (i * 2), "%2x", &byte) != 1)
+			return -1;
+		out[i] = byte;
+	}
+
+	return 0;
+}
+
+/* path -> struct cfg_digest. Bad lines are ignored and get re-hashed */
+static GHashTable *load_digest_cache(void)
+{
+	GHashTable *cache;
+	FILE *fp;
+	char *line = NULL;
+	size_t sz = 0;
+	ssize_t len;
+
+	cache = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	fp = fopen(cfg_hash_cache, "r");
+	if (!fp)
+		return cache;
+
+	if ((len = getline(&line, &sz, fp)) < 0 || strcmp(line, CFG_HASH_CACHE_HEADER)) {
+		ldebug("Ignoring config hash cache %s with unknown format", cfg_hash_cache);
+		free(line);
+		fclose(fp);
+		return cache;
+	}
+
+	while ((len = getline(&line, &sz, fp)) > 0) {
+		struct cfg_digest *d;
+		char hex[41];
+		int path_start = 0;
+
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+
+		d = malloc(sizeof(*d));
+		if (!d)
+			break;
+		if (sscanf(line, "%lu %lld %lld.%ld %40s %n", &d->ino, &d->size,
+		           &d->mtime, &d->mtime_ns, hex, &path_start) != 5 ||
+		    !path_start || !line[path_start] || unhex(hex, d->sha1, 20) < 0)
+		{
+			free(d);
+			continue;
+		}
+		g_hash_table_replace(cache, strdup(line + path_start), d);
+	}
+
+	free(line);
+	fclose(fp);
+	return cache;
+}
+
+static void save_digest_cache(file_list **files, unsigned int num_files,
+                              unsigned char (*digest)[20], const char *failed)
+{
+	FILE *fp;
+	unsigned int i;
+	char tmp[PATH_MAX];
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cfg_hash_cache);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ldebug("Failed to open %s for writing: %s", tmp, strerror(errno));
+		return;
+	}
+
+	fputs(CFG_HASH_CACHE_HEADER, fp);
+	for (i = 0; i < num_files; i++) {
+		const struct stat *st = &files[i]->st;
+
+		if (failed[i] || strchr(files[i]->name, '\n'))
+			continue;
+		fprintf(fp, "%lu %lld %lld.%ld %s %s\n",
+		        (unsigned long)st->st_ino, (long long)st->st_size,
+		        (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+		        tohex(digest[i], 20), files[i]->name);
+	}
+
+	if (fclose(fp) || rename(tmp, cfg_hash_cache) < 0) {
+		ldebug("Failed to write config hash cache %s: %s", cfg_hash_cache, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+struct hash_job {
+	file_list **files;
+	unsigned int *todo; /* indexes into files and digest */
+	unsigned int num_todo;
+	unsigned int next;
+	unsigned char (*digest)[20];
+	char *failed;
+};
+
+/* runs in several threads at once, so no logging in here */
+static void *hash_worker(void *arg)
+{
+	struct hash_job *job = (struct hash_job *)arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->num_todo) {
+		unsigned int idx = job->todo[i];
+		blk_SHA_CTX ctx;
+
+		blk_SHA1_Init(&ctx);
+		if (hash_add_file(job->files[idx]->name, &ctx) < 0)
+			job->failed[idx] = 1;
+		else
+			blk_SHA1_Final(job->digest[idx], &ctx);
+	}
+
+	return NULL;
+}
+
+static void hash_files(struct hash_job *job)
+{
+	pthread_t tid[CFG_HASH_MAX_THREADS];
+	long cpus;
+	unsigned int i, threads = 0, wanted;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	wanted = cpus > 1 ? cpus - 1 : 0;
+	if (wanted > CFG_HASH_MAX_THREADS)
+		wanted = CFG_HASH_MAX_THREADS;
+	/* not worth spawning threads for a handful of files */
+	if (wanted > job->num_todo / 8)
+		wanted = job->num_todo / 8;
+
+	for (i = 0; i < wanted; i++) {
+		if (pthread_create(&tid[threads], NULL, hash_worker, job))
+			break;
+		threads++;
+	}
+
+	/* we do our share too, and everything if we got no threads */
+	hash_worker(job);
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+}
+
+/*
+ * calculate a sha1 hash of all object config files, and find the
+ * last time any of them changed, while walking the tree only once.
+ *
+ * The hash is a sha1 of the sha1 digests of each file, sorted by
+ * their full path, so a changed file only means re-hashing that
+ * file. If there's only one file the hash is the digest of that
+ * file, which is what oconfsplit expects pollers to have.
  * *hash must hold at least 20 bytes
  */
-int get_config_hash(unsigned char *hash)
+int get_config_info(unsigned char *hash, time_t *last_change)
 {
 	struct file_list **sorted_flist;
-	unsigned int num_files = 0, i = 0;
+	unsigned int num_files = 0, i;
+	unsigned char (*digest)[20] = NULL;
+	char *failed = NULL;
+	struct hash_job job;
+	GHashTable *cache;
 	blk_SHA_CTX ctx;
+	time_t mt = 0;
 
-	blk_SHA1_Init(&ctx);
-
+	memset(&job, 0, sizeof(job));
 	sorted_flist = get_sorted_oconf_files(&num_files);
+	if (num_files) {
+		digest = calloc(num_files, sizeof(*digest));
+		failed = calloc(num_files, 1);
+		job.todo = calloc(num_files, sizeof(*job.todo));
+		if (!digest || !failed || !job.todo) {
+			lerr("Failed to allocate memory for config hashing");
+			free_sorted_flist(sorted_flist, num_files);
+			free(digest);
+			free(failed);
+			free(job.todo);
+			return -1;
+		}
+	}
 
+	cache = load_digest_cache();
 	for (i = 0; i < num_files; i++) {
-		hash_add_file(sorted_flist[i]->name, &ctx);
-		sorted_flist[i]->next = NULL;
-		file_list_free(sorted_flist[i]);
+		const struct stat *st = &sorted_flist[i]->st;
+		struct cfg_digest *d;
+
+		if (st->st_mtime > mt)
+			mt = st->st_mtime;
+
+		d = g_hash_table_lookup(cache, sorted_flist[i]->name);
+		if (d && cfg_digest_matches(d, st))
+			memcpy(digest[i], d->sha1, 20);
+		else
+			job.todo[job.num_todo++] = i;
 	}
-	blk_SHA1_Final(hash, &ctx);
-	free(sorted_flist);
+
+	if (job.num_todo) {
+		job.files = sorted_flist;
+		job.digest = digest;
+		job.failed = failed;
+		hash_files(&job);
+		ldebug("Hashed %u of %u config files (%u cached)",
+		       job.num_todo, num_files, num_files - job.num_todo);
+	}
+	if (job.num_todo || g_hash_table_size(cache) != num_files)
+		save_digest_cache(sorted_flist, num_files, digest, failed);
+	g_hash_table_destroy(cache);
+
+	if (num_files == 1 && !failed[0]) {
+		memcpy(hash, digest[0], 20);
+	} else {
+		/* unreadable files don't count, same as always */
+		blk_SHA1_Init(&ctx);
+		for (i = 0; i < num_files; i++) {
+			if (!failed[i])
+				blk_SHA1_Update(&ctx, digest[i], 20);
+		}
+		blk_SHA1_Final(hash, &ctx);
+	}
+	if (last_change)
+		*last_change = mt;
+
+	free_sorted_flist(sorted_flist, num_files);
+	free(digest);
+	free(failed);
+	free(job.todo);
 
 	return 0;
 }
+
+int get_config_hash(unsigned char *hash)
+{
+	return get_config_info(hash, NULL);
+}
+
+/* returns the last timestamp of a configuration change */
+time_t get_last_cfg_change(void)
+{
+	struct file_list **sorted_flist;
+	unsigned int num_files = 0, i;
+	time_t mt = 0;
+
+	sorted_flist = get_sorted_oconf_files(&num_files);
+	for (i = 0; i < num_files; i++) {
+		if (sorted_flist[i]->st.st_mtime > mt)
+			mt = sorted_flist[i]->st.st_mtime;
+	}
+	free_sorted_flist(sorted_flist, num_files);
+
+	/* 0 if we for some reason failed */
+	return mt;
+}
@@ -15,6 +15,10 @@
 #include "oconfsplit.h"
 #include "script-helpers.h"
 #include "net.h"
+#include "cbtiming.h"
+#include "snapshot.h"
+#include "handover.h"
+#include "inbound.h"
 
 merlin_node **host_check_node = NULL;
 merlin_node **service_check_node = NULL;
@@ -36,6 +40,7 @@ static struct dlist_entry **expired_services;
 
 struct host *merlin_recv_host;
 struct service *merlin_recv_service;
+void *merlin_recv_object;
 
 /** code start **/
 
@@ -385,26 +390,88 @@ void handle_control(merlin_node *node, merlin_event *pkt)
 		}
 
 		/* node sent info we can use, so do that */
-		memcpy(&node->info, pkt->body, sizeof(node->info));
+		memset(&node->info, 0, sizeof(node->info));
+		memcpy(&node->info, pkt->body, pkt->hdr.len < sizeof(node->info) ? pkt->hdr.len : sizeof(node->info));
 		if (prev_state != STATE_CONNECTED) {
 
 			node_set_state(node, STATE_CONNECTED, "Received CTRL_ACTIVE");
 			ldebug("NODESTATE: %s node %s just marked as connected after CTRL_ACTIVE",
 				   node_type(node), node->name);
+			node_credit_grant(node);
+			node->resync |= RESYNC_CHECK;
 		}
 		break;
 	case CTRL_STALL:
 	case CTRL_RESUME:
 		linfo("Received (and ignoring) CTRL_{STALL,RESUME} event.");
 		break;
+	case CTRL_CREDIT:
+		if (node) {
+			node_credit_handle(node, pkt);
+			snapshot_check(node);
+		}
+		break;
+	case CTRL_SNAPSHOT:
+		if (node)
+			snapshot_apply(node, pkt);
+		break;
+	case CTRL_HANDOVER:
+		if (node)
+			handover_handle(node, pkt);
+		break;
+	case CTRL_PULSE:
+		if (node)
+			node_pulse_handle(node, pkt);
+		break;
 	case CTRL_STOP:
 		linfo("Received (and ignoring) CTRL_STOP event. What voodoo is this?");
 		break;
 	default:
-		lwarn("Unknown control code: %d", pkt->hdr.code);
+		lwarn_ratelimit(10, "Unknown control code: %d", pkt->hdr.code);
 	}
 }
 
+struct merlin_output_stats merlin_output_stats;
+
+/*
+ * Returns the string to replace "cur" with when we receive "str".
+ * Most checks return the same output time after time, so if it hasn't
+ * changed we hand back "cur" itself and save a malloc(), a copy and a
+ * free(). Naemon frees these strings on its own, so they can't be
+ * shared between objects.
+ */
+char *net2mod_strdup(char *cur, const char *str)
+{
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str);
+	if (cur && !strcmp(cur, str)) {
+		merlin_output_stats.reused++;
+		merlin_output_stats.bytes_reused += len + 1;
+		return cur;
+	}
+
+	merlin_output_stats.copied++;
+	merlin_output_stats.bytes_copied += len + 1;
+	return strdup(str);
+}
+
+/*
+ * Naemon's parsing of check results escapes long_plugin_output, so we
+ * set it again from what we received once the result is processed
+ */
+static void set_long_output(char **long_output, const char *str)
+{
+	char *new_output = net2mod_strdup(*long_output, str);
+
+	if (new_output != *long_output)
+		free(*long_output);
+	*long_output = new_output;
+}
+
 /* currently only called from "handle_{host,service}_status" */
 static int handle_checkresult(struct check_result *cr, monitored_object_state *st)
 {
@@ -438,7 +505,7 @@ static int handle_host_result(merlin_node *node, merlin_header *hdr, void *buf)
 	merlin_host_status *st_obj = (merlin_host_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_host(st_obj->name);
+	obj = merlin_recv_object ? merlin_recv_object : find_host(st_obj->name);
 	if (!obj) {
 		lerr("Host '%s' not found. Ignoring %s event",
 		     st_obj->name, callback_name(hdr->type));
@@ -470,12 +537,7 @@ static int handle_host_result(merlin_node *node, merlin_header *hdr, void *buf)
 		cr.return_code = st_obj->state.current_state == 0 ? 0 : 2;
 		merlin_recv_host = obj;
 		ret = handle_checkresult(&cr, &st_obj->state);
-		free(obj->long_plugin_output);
-		if (st_obj->state.long_plugin_output) {
-			obj->long_plugin_output = strdup(st_obj->state.long_plugin_output);
-		} else {
-			obj->long_plugin_output = NULL;
-		}
+		set_long_output(&obj->long_plugin_output, st_obj->state.long_plugin_output);
 		merlin_recv_host = NULL;
 		return ret;
 	} else {
@@ -491,7 +553,9 @@ static int handle_service_result(merlin_node *node, merlin_header *hdr, void *bu
 	merlin_service_status *st_obj = (merlin_service_status *)buf;
 	struct tmp_net2mod_data tmp;
 
-	obj = find_service(st_obj->host_name, st_obj->service_description);
+	obj = merlin_recv_object;
+	if (!obj)
+		obj = find_service(st_obj->host_name, st_obj->service_description);
 	if (!obj) {
 		lerr("Service '%s' on host '%s' not found. Ignoring %s event",
 		     st_obj->service_description, st_obj->host_name,
@@ -522,12 +586,7 @@ static int handle_service_result(merlin_node *node, merlin_header *hdr, void *bu
 		cr.source = node->source_name;
 		merlin_recv_service = obj;
 		ret = handle_checkresult(&cr, &st_obj->state);
-		free(obj->long_plugin_output);
-		if (st_obj->state.long_plugin_output) {
-			obj->long_plugin_output = strdup(st_obj->state.long_plugin_output);
-		} else {
-			obj->long_plugin_output = NULL;
-		}
+		set_long_output(&obj->long_plugin_output, st_obj->state.long_plugin_output);
 		merlin_recv_service = NULL;
 		return ret;
 	} else {
@@ -772,9 +831,114 @@ static int handle_flapping_data(merlin_node *node, void *buf)
 
 
 /* Handles an event received from another node */
+/*
+ * Get a string from an event we haven't decoded yet. We can't decode
+ * events we forward before forwarding them, so this is how we find
+ * out what they're about. "off" is the offset of the string pointer
+ * in the struct making up the body.
+ */
+const char *peek_string(const merlin_event *pkt, size_t off)
+{
+	const char *str;
+	unsigned long pos;
+
+	if (off + sizeof(str) > pkt->hdr.len)
+		return NULL;
+
+	memcpy(&str, pkt->body + off, sizeof(str));
+	pos = (unsigned long)str;
+	if (!pos || pos >= pkt->hdr.len)
+		return NULL;
+
+	/* it must be nul-terminated inside the packet */
+	if (!memchr(pkt->body + pos, 0, pkt->hdr.len - pos))
+		return NULL;
+
+	return pkt->body + pos;
+}
+
+/*
+ * Returns the host an event from a master is about. NULL with
+ * *global set means everyone should have it, and NULL without
+ * it means it's about a host we (and thus our pollers) don't have.
+ */
+static host *forward_host(const merlin_event *pkt, int *global)
+{
+	const char *name;
+
+	*global = 0;
+
+	/* the inbound worker may already have looked it up */
+	if (merlin_recv_object) {
+		if (pkt->hdr.type == NEBCALLBACK_SERVICE_CHECK_DATA ||
+		    pkt->hdr.type == NEBCALLBACK_SERVICE_STATUS_DATA)
+		{
+			return ((service *)merlin_recv_object)->host_ptr;
+		}
+		return merlin_recv_object;
+	}
+
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+		name = peek_string(pkt, offsetof(merlin_host_status, name));
+		break;
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		name = peek_string(pkt, offsetof(merlin_service_status, host_name));
+		break;
+	case NEBCALLBACK_NOTIFICATION_DATA:
+		name = peek_string(pkt, offsetof(nebstruct_notification_data, host_name));
+		break;
+	case NEBCALLBACK_COMMENT_DATA:
+		name = peek_string(pkt, offsetof(nebstruct_comment_data, host_name));
+		break;
+	case NEBCALLBACK_DOWNTIME_DATA:
+		name = peek_string(pkt, offsetof(nebstruct_downtime_data, host_name));
+		break;
+	case NEBCALLBACK_FLAPPING_DATA:
+		name = peek_string(pkt, offsetof(nebstruct_flapping_data, host_name));
+		break;
+	default:
+		/* external commands may be for groups, or nothing at all */
+		name = NULL;
+		break;
+	}
+
+	if (!name) {
+		*global = 1;
+		return NULL;
+	}
+
+	return find_host(name);
+}
+
+/*
+ * Pass an event from a master on to the pollers that monitor the
+ * host it concerns, so pollers don't have to decode and discard
+ * events for objects they don't have.
+ */
+static void forward_to_pollers(merlin_event *pkt)
+{
+	unsigned int i;
+	int global;
+	host *h;
+
+	h = forward_host(pkt, &global);
+	for (i = 0; i < num_pollers; i++) {
+		merlin_node *n = poller_table[i];
+
+		if (!global && (!h || (n->pgroup && !bitmap_isset(n->pgroup->host_map, h->id)))) {
+			n->stats.events.filtered++;
+			n->stats.bytes.filtered += packet_size(pkt);
+			continue;
+		}
+		net_sendto(n, pkt);
+	}
+}
+
 int handle_event(merlin_node *node, merlin_event *pkt)
 {
-	uint i;
 	int ret = 0;
 
 	if (!pkt) {
@@ -801,13 +965,24 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 
 	if (node->state != STATE_CONNECTED) {
 		/* the f*ck did that happen? An unconnected node talking to us */
-		lerr("Received data from not connected node '%s'. State is %s\n",
+		lerr_ratelimit(10, "Received data from not connected node '%s'. State is %s\n",
 			 node->name, node_state(node));
 		return 0;
-	} else if (node->type == MODE_POLLER && num_masters) {
-		ldebug("Passing on event from poller %s to %d masters",
-		       node->name, num_masters);
-		net_sendto_many(noc_table, num_masters, pkt);
+	} else if (pkt->hdr.hops && node->type == MODE_PEER) {
+		/* relayed by a peer, which has already sent it everywhere */
+		node = net_relay_origin(node, pkt);
+	} else if (node->type == MODE_POLLER && (num_masters || pkt->hdr.relay)) {
+		/* the poller's relay request is for us, not our masters */
+		int relay = pkt->hdr.relay;
+
+		pkt->hdr.relay = 0;
+		if (num_masters) {
+			ldebug("Passing on event from poller %s to %d masters",
+			       node->name, num_masters);
+			net_sendto_masters(pkt);
+		}
+		if (relay)
+			net_relay_to_peers(node, pkt);
 	} else if (node->type == MODE_MASTER && num_pollers) {
 		/*
 		 * @todo maybe we should also check if self.peer_id == 0
@@ -816,10 +991,7 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 		if (pkt->hdr.type != NEBCALLBACK_PROGRAM_STATUS_DATA &&
 		    pkt->hdr.type != NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA)
 		{
-			for (i = 0; i < num_pollers; i++) {
-				merlin_node *n = poller_table[i];
-				net_sendto(n, pkt);
-			}
+			forward_to_pollers(pkt);
 		}
 	}
 
@@ -859,7 +1031,7 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 	case NEBCALLBACK_PROGRAM_STATUS_DATA:
 	case NEBCALLBACK_PROCESS_DATA:
 		/* These make no sense to transfer, so warn about them */
-		lwarn("EVTERR: %s %s transferred %s event", node_type(node), node->name, callback_name(pkt->hdr.type));
+		lwarn_ratelimit(10, "EVTERR: %s %s transferred %s event", node_type(node), node->name, callback_name(pkt->hdr.type));
 		return 0;
 	}
 
@@ -912,50 +1084,49 @@ int handle_event(merlin_node *node, merlin_event *pkt)
 }
 
 
-static int ipc_reaper(int sd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
+static int ipc_reaper(__attribute__((unused)) int sd, __attribute__((unused)) int events, __attribute__((unused)) void *arg)
 {
 	/*
-	 * this function doesn't really do anything anymore,
-	 * but in case we want to handle pingbacks from the daemon,
-	 * this is where they'll end up.
-	 * For now we just empty the socket
+	 * The daemon doesn't send us much. The only thing we
+	 * care about is its answer to our shared memory offer.
+	 * Everything else is just read and thrown away.
 	 */
-	char buf[4096];
-	int ret;
+	merlin_event *pkt;
 
-	do {
-		ret = read(sd, buf, sizeof(buf));
-		if (!ret) {
-			node_disconnect(&ipc, "read() returned zero");
-		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-			/* ignored. if this happens, the iobroker is busted */
-			return 0;
-		} else {
-			node_disconnect(&ipc, "read() failed with error %d: %s", errno, strerror(errno));
-			return 0;
-		}
-	} while (ret > 0);
+	if (node_recv(&ipc) < 0)
+		return 0;
+
+	while ((pkt = node_get_event(&ipc))) {
+		if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_SHMRING)
+			ipc_shm_ctrl(pkt);
+		free(pkt);
+	}
 
 	return 0;
 }
 
-GHashTable *host_hash_table;
-node_selection *node_selection_by_hostname(const char *name)
+/* the selection (poller group) each host belongs to, by host id */
+static node_selection **host_selection;
+
+node_selection *node_selection_by_host(const host *h)
 {
-	return g_hash_table_lookup(host_hash_table, name);
+	if (!h || !host_selection)
+		return NULL;
+
+	return host_selection[h->id];
 }
 
-struct host_hash_table_add_parameters
+struct host_selection_add_parameters
 {
 	node_selection *sel;
 	int *num_ents;
 };
 
-static gboolean host_hash_table_add_host(gpointer _name, gpointer _hst, gpointer user_data)
+static gboolean host_selection_add_host(gpointer _name, gpointer _hst, gpointer user_data)
 {
-	struct host_hash_table_add_parameters *params = (struct host_hash_table_add_parameters *)user_data;
+	struct host_selection_add_parameters *params = (struct host_selection_add_parameters *)user_data;
 	host *hst = (host *)_hst;
-	node_selection *cur = node_selection_by_hostname(hst->name);
+	node_selection *cur = host_selection[hst->id];
 
 	/*
 	 * this should never happen, but if it does
@@ -971,11 +1142,11 @@ static gboolean host_hash_table_add_host(gpointer _name, gpointer _hst, gpointer
 	}
 	params->num_ents[params->sel->id]++;
 
-	g_hash_table_insert(host_hash_table, hst->name, params->sel);
+	host_selection[hst->id] = params->sel;
 	return FALSE;
 }
 
-static void setup_host_hash_tables(void)
+static void setup_host_selections(void)
 {
 	hostgroup *hg;
 	int i, nsel;
@@ -983,8 +1154,6 @@ static void setup_host_hash_tables(void)
 
 	nsel = get_num_selections();
 
-	host_hash_table = g_hash_table_new(g_str_hash, g_str_equal);
-
 	/*
 	 * only bother if we've got hostgroups, pollers and selections.
 	 * Otherwise we'll just be wasting perfectly good memory
@@ -993,21 +1162,28 @@ static void setup_host_hash_tables(void)
 	if (!hostgroup_list || !num_pollers || !nsel)
 		return;
 
+	host_selection = calloc(num_objects.hosts, sizeof(*host_selection));
 	num_ents = calloc(nsel, sizeof(int));
+	if (!host_selection || !num_ents) {
+		lerr("Failed to allocate memory for poller routing tables");
+		safe_free(host_selection);
+		free(num_ents);
+		return;
+	}
 
 	/*
 	 * we must loop each hostgroup once, or we'll log a lot of
 	 * spurious warnings that aren't exactly accurate
 	 */
 	for (hg = hostgroup_list; hg; hg = hg->next) {
-		struct host_hash_table_add_parameters params;
+		struct host_selection_add_parameters params;
 		params.sel = node_selection_by_name(hg->group_name);
 		params.num_ents = num_ents;
 
 		if (!params.sel)
 			continue;
 
-		g_tree_foreach(hg->members, host_hash_table_add_host, &params);
+		g_tree_foreach(hg->members, host_selection_add_host, &params);
 	}
 
 	for (i = 0; i < nsel; i++) {
@@ -1097,6 +1273,58 @@ static void grok_module_compound(struct cfg_comp *comp)
 				cfg_error(comp, v, "Illegal value for %s", v->key);
 			continue;
 		}
+		if (!strcmp(v->key, "relay_to_masters")) {
+			relay_to_masters = strtobool(v->value);
+			continue;
+		}
+		/* microseconds per event loop iteration for inbound events. 0 = no limit */
+		if (!strcmp(v->key, "inbound_budget")) {
+			char *endp;
+
+			inbound_budget = (unsigned int)strtoul(v->value, &endp, 10);
+			if (*endp)
+				cfg_error(comp, v, "Illegal value for %s", v->key);
+			continue;
+		}
+		/* look up the objects of inbound events in a separate thread */
+		if (!strcmp(v->key, "inbound_worker")) {
+			inbound_worker = strtobool(v->value);
+			continue;
+		}
+		/* how sure we must be that a node is dead to act on it */
+		if (!strcmp(v->key, "phi_suspect")) {
+			char *endp;
+
+			phi_suspect = strtod(v->value, &endp);
+			if (*endp || phi_suspect <= 0)
+				cfg_error(comp, v, "Illegal value for %s", v->key);
+			continue;
+		}
+		if (!strcmp(v->key, "phi_dead")) {
+			char *endp;
+
+			phi_dead = strtod(v->value, &endp);
+			if (*endp || phi_dead <= 0)
+				cfg_error(comp, v, "Illegal value for %s", v->key);
+			continue;
+		}
+		if (!strcmp(v->key, "handover_timeout")) {
+			char *endp;
+
+			handover_timeout = (unsigned int)strtoul(v->value, &endp, 10);
+			if (*endp)
+				cfg_error(comp, v, "Illegal value for %s", v->key);
+			continue;
+		}
+		/* time every n'th event. 0 disables timing */
+		if (!strcmp(v->key, "timing_sample_rate")) {
+			char *endp;
+
+			cbtiming_sample_rate = (unsigned int)strtoul(v->value, &endp, 10);
+			if (*endp)
+				cfg_error(comp, v, "Illegal value for %s", v->key);
+			continue;
+		}
 		if (!strcmp(v->key, "notifies")) {
 			if (!strtobool(v->value)) {
 				ipc.flags &= ~(MERLIN_NODE_NOTIFIES);
@@ -1233,6 +1461,47 @@ static void connect_to_all(struct nm_event_execution_properties *evprop)
 	}
 }
 
+/*
+ * Backlogs are normally drained a bit at a time as new events are
+ * sent to a node. This makes sure nodes we're not currently sending
+ * anything to get theirs drained too, without hogging the main loop.
+ * The daemon's backlog is moved into the shared memory ring, if we
+ * use one, for the same reason. All nodes share the same 100ms. Nodes that have been granted
+ * credit since last time go first, and the rest start with a
+ * different node each time so the first one can't use it all up
+ * every time.
+ */
+static void drain_backlogs(struct nm_event_execution_properties *evprop)
+{
+	static unsigned int first;
+	struct timeval deadline;
+	unsigned int i;
+
+	if (evprop->execution_type != EVENT_EXEC_NORMAL)
+		return;
+
+	schedule_event(1, drain_backlogs, NULL);
+
+	for (i = 0; i < num_nodes; i++)
+		net_check_activity(node_table[i]);
+
+	ipc_shm_flush();
+	if (!num_nodes)
+		return;
+	node_drain_deadline(&deadline, 100);
+	for (i = 0; i < num_nodes; i++) {
+		merlin_node *node = node_table[i];
+
+		if (node->flow.unblocked) {
+			node->flow.unblocked = 0;
+			node_drain_backlog_until(node, &deadline);
+		}
+	}
+	for (i = 0; i < num_nodes; i++)
+		node_drain_backlog_until(node_table[(first + i) % num_nodes], &deadline);
+	first = (first + 1) % num_nodes;
+}
+
 /*
  * we send this every 15 seconds, just in case our nodes forget
  * about us. It shouldn't happen, but there are stranger things
@@ -1251,6 +1520,7 @@ static void send_pulse(struct nm_event_execution_properties *evprop)
 		merlin_node *node = noc_table[i];
 		if (node->state == STATE_CONNECTED) {
 			node_send_ctrl_active(node, CTRL_GENERIC, &ipc.info);
+			node_send_pulse(node);
 		}
 	}
 }
@@ -1292,7 +1562,7 @@ static int post_config_init(int cb, void *ds)
 		linfo("Object configuration parsed.");
 		if (pgroup_init() < 0)
 			return -1;
-		setup_host_hash_tables();
+		setup_host_selections();
 		pgroup_assign_peer_ids(ipc.pgroup);
 
 		expired_hosts = calloc(num_objects.hosts, sizeof(void *));
@@ -1310,6 +1580,7 @@ static int post_config_init(int cb, void *ds)
 		 */
 		schedule_event(0, connect_to_all, NULL);
 		schedule_event(0, send_pulse, NULL);
+		schedule_event(1, drain_backlogs, NULL);
 
 		/*
 	 	* now we register the hooks we're interested in, avoiding
@@ -1371,6 +1642,9 @@ static int ipc_action_handler(merlin_node *node, int prev_state)
 	 */
 	node_send_ctrl_active(&ipc, CTRL_GENERIC, &ipc.info);
 
+	/* switch to the shared memory transport, if configured */
+	ipc_shm_offer();
+
 	return 0;
 }
 
@@ -1405,6 +1679,7 @@ static void post_process_nodes(void)
 		merlin_node *node = node_table[i];
 
 		node->action = node_action_handler;
+		node->drain = net_drain_input;
 		node->expected.last_cfg_change = ipc.info.last_cfg_change;
 
 		if (node->type == MODE_PEER) {
@@ -1544,10 +1819,10 @@ int nebmodule_init(__attribute__((unused)) int flags, char *arg, nebmodule *hand
 	ipc.info.word_size = COMPAT_WORDSIZE;
 	ipc.info.byte_order = endianness();
 	ipc.info.monitored_object_state_size = sizeof(monitored_object_state);
+	ipc.info.capabilities = MERLIN_CAP_HANDOVER;
 	ipc.info.object_structure_version = CURRENT_OBJECT_STRUCTURE_VERSION;
 	gettimeofday(&ipc.info.start, NULL);
-	ipc.info.last_cfg_change = get_last_cfg_change();
-	get_config_hash(ipc.info.config_hash);
+	get_config_info(ipc.info.config_hash, &ipc.info.last_cfg_change);
 
 	/* make sure we can catch whatever we want */
 	event_broker_options = BROKER_EVERYTHING;
@@ -1572,12 +1847,19 @@ int nebmodule_init(__attribute__((unused)) int flags, char *arg, nebmodule *hand
  * and make sure we reset it to a state where we can initialize it
  * later.
  */
-int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused)) int reason)
+int nebmodule_deinit(__attribute__((unused)) int flags, int reason)
 {
 	unsigned int i;
 
 	linfo("Unloading Merlin module");
 
+	/*
+	 * let our peers take over while we can still talk to them. We're
+	 * unloaded on every reload too, but then we'll be right back
+	 */
+	if (reason == NEBMODULE_NEB_SHUTDOWN)
+		handover_leave();
+
 	ipc_deinit();
 	log_deinit();
 	net_deinit();
@@ -1600,7 +1882,8 @@ int nebmodule_deinit(__attribute__((unused)) int flags, __attribute__((unused))
 	}
 	safe_free(node_table);
 
-	g_hash_table_destroy(host_hash_table);
+	safe_free(host_selection);
+	handover_deinit();
 
 	binlog_wipe(ipc.binlog, BINLOG_UNLINK);
 
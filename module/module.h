@@ -42,6 +42,8 @@ extern struct dlist_entry *expired_events;
 
 extern struct host *merlin_recv_host;
 extern struct service *merlin_recv_service;
+/* the host or service the event being handled is about, if known */
+extern void *merlin_recv_object;
 
 extern bitmap *poller_handled_hosts;
 extern bitmap *poller_handled_services;
@@ -51,8 +53,7 @@ extern merlin_node **host_check_node;
 extern merlin_node **service_check_node;
 extern merlin_node *merlin_sender;
 
-extern GHashTable *host_hash_table;
-extern node_selection *node_selection_by_hostname(const char *name);
+extern node_selection *node_selection_by_host(const host *h);
 
 /** global variables exported by Nagios **/
 extern int __nagios_object_structure_version;
@@ -61,6 +62,7 @@ extern int __nagios_object_structure_version;
 extern void schedule_expiration_event(int type, merlin_node *node, void *obj);
 extern int handle_ipc_event(merlin_node *node, merlin_event *pkt);
 extern int handle_event(merlin_node *node, merlin_event *pkt);
+extern const char *peek_string(const merlin_event *pkt, size_t off);
 
 int unexpire_service(struct service *s);
 int unexpire_host(struct host *h);
@@ -121,6 +123,19 @@ extern void set_service_check_node(merlin_node *node, service *s, int flags);
 	mrln.obsess = nag->obsess
 
 
+/*
+ * Outputs we receive that are identical to what the object already
+ * has are kept rather than copied. These count how often that works.
+ */
+struct merlin_output_stats {
+	unsigned long long reused;       /* strings we didn't have to copy */
+	unsigned long long copied;       /* strings that had changed */
+	unsigned long long bytes_reused; /* bytes we didn't have to copy */
+	unsigned long long bytes_copied;
+};
+extern struct merlin_output_stats merlin_output_stats;
+extern char *net2mod_strdup(char *cur, const char *str);
+
 /*
  * Updating data inside the running Nagios is a bit trickier and
  * some care must be taken for this to work
@@ -135,9 +150,9 @@ struct tmp_net2mod_data {
 };
 #define NET2MOD_STATE_VARS(tmp, nag, mrln) \
 	/* generate new strings before we even start assignments */ \
-	tmp.new_plugin_output = safe_strdup(mrln.plugin_output); \
-	tmp.new_long_plugin_output = safe_strdup(mrln.long_plugin_output); \
-	tmp.new_perf_data = safe_strdup(mrln.perf_data); \
+	tmp.new_plugin_output = net2mod_strdup(nag->plugin_output, mrln.plugin_output); \
+	tmp.new_long_plugin_output = net2mod_strdup(nag->long_plugin_output, mrln.long_plugin_output); \
+	tmp.new_perf_data = net2mod_strdup(nag->perf_data, mrln.perf_data); \
 	/* then we must copy the variables so we don't overwrite them */ \
 	tmp.old_plugin_output = nag->plugin_output; \
 	tmp.old_long_plugin_output = nag->long_plugin_output; \
@@ -188,9 +203,12 @@ struct tmp_net2mod_data {
 	nag->accept_passive_checks = mrln.accept_passive_checks; \
 	nag->notified_on = mrln.notified_on; \
 	/* end Nagios 4 only */ \
-	/* when all is done, we free the old state variables */ \
-	safe_free(tmp.old_plugin_output); \
-	safe_free(tmp.old_long_plugin_output); \
-	safe_free(tmp.old_perf_data);
+	/* when all is done, we free the old state variables we replaced */ \
+	if (tmp.old_plugin_output != tmp.new_plugin_output) \
+		free(tmp.old_plugin_output); \
+	if (tmp.old_long_plugin_output != tmp.new_long_plugin_output) \
+		free(tmp.old_long_plugin_output); \
+	if (tmp.old_perf_data != tmp.new_perf_data) \
+		free(tmp.old_perf_data);
 
 #endif /* MRM_MOD_H */
@@ -5,11 +5,16 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
 #include "module.h"
 #include "logging.h"
 #include "io.h"
 #include "ipc.h"
 #include "net.h"
+#include "cbtiming.h"
+#include "inbound.h"
 
 #define MERLIN_CONNECT_TIMEOUT 20 /* the (hardcoded) connect timeout we use */
 #define MERLIN_CONNECT_INTERVAL 5 /* connect interval */
@@ -134,11 +139,279 @@ int net_is_connected(merlin_node *node)
  * Reads input from a particular node and ships it off to
  * the "handle_event()"
  */
-int net_input(int sd, int io_evt, void *node_)
+/*
+ * Inbound events are applied in round-robin order across all nodes,
+ * for at most inbound_budget microseconds per event loop iteration.
+ * Whatever's left stays in the nodes' buffer queues. While there is
+ * any, we keep a byte in inbound_pipe so the I/O broker calls us again
+ * on its next pass, after Naemon has had a chance to run its own
+ * events. Since credit is only granted for events we've handled, a
+ * node that keeps sending can't make its queue grow much beyond the
+ * flow control window.
+ */
+unsigned int inbound_budget = 20000;
+unsigned long long inbound_budget_exhausted;
+static int inbound_pipe[2] = { -1, -1 };
+static int inbound_armed;
+static unsigned int inbound_next;
+
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int has_input(merlin_node *node)
+{
+	return node->sock >= 0 && nm_bufferqueue_get_available(node->bq) >= HDR_SIZE;
+}
+
+static void handle_inbound(merlin_node *node, merlin_event *pkt)
+{
+	uint64_t timer;
+
+	if (pkt->hdr.type != CTRL_PACKET)
+		node_event_age(node, pkt);
+	timer = cbtiming_start();
+	handle_event(node, pkt);
+	cbtiming_stop(CBTIMING_IN, pkt->hdr.type, timer);
+	free(pkt);
+}
+
+static void apply_event(merlin_node *node, merlin_event *pkt)
+{
+	node_credit_consume(node, pkt);
+	handle_inbound(node, pkt);
+}
+
+/*
+ * Events taken off a node as it disconnects, waiting to be applied.
+ * See net_drain_input().
+ */
+struct parked_event {
+	merlin_node *node;
+	merlin_event *pkt;
+	void *obj;
+	unsigned int epoch;
+};
+static struct parked_event *parked;
+static unsigned int parked_num, parked_next, parked_size;
+
+static void park_event(merlin_node *node, merlin_event *pkt, void *obj)
+{
+	if (parked_num >= parked_size) {
+		unsigned int size = parked_size ? parked_size * 2 : 256;
+		struct parked_event *ary = realloc(parked, size * sizeof(*ary));
+
+		if (!ary) {
+			lerr("Failed to park event from %s: %s", node->name, strerror(errno));
+			free(pkt);
+			return;
+		}
+		parked = ary;
+		parked_size = size;
+	}
+	parked[parked_num].node = node;
+	parked[parked_num].pkt = pkt;
+	parked[parked_num].obj = obj;
+	parked[parked_num].epoch = node->inbound.epoch;
+	parked_num++;
+}
+
+/*
+ * Control packets from a connection that's gone would only confuse
+ * the node's state, and its credit was reset along with the
+ * connection, but the events it sent before going away are still
+ * worth having.
+ */
+static void apply_parked_event(struct parked_event *p)
+{
+	merlin_recv_object = p->obj;
+	if (p->epoch == p->node->inbound.epoch)
+		apply_event(p->node, p->pkt);
+	else if (p->pkt->hdr.type != CTRL_PACKET)
+		handle_inbound(p->node, p->pkt);
+	else
+		free(p->pkt);
+	merlin_recv_object = NULL;
+}
+
+/* returns 1 if we ran out of time before we ran out of parked events */
+static int apply_parked(uint64_t start)
+{
+	while (parked_next < parked_num) {
+		/* applying it may park more events and move the array */
+		struct parked_event p = parked[parked_next++];
+
+		apply_parked_event(&p);
+		if (inbound_budget && usec_now() - start >= inbound_budget)
+			return parked_next < parked_num;
+	}
+	parked_num = parked_next = 0;
+	return 0;
+}
+
+static void free_parked(void)
+{
+	while (parked_next < parked_num)
+		free(parked[parked_next++].pkt);
+	free(parked);
+	parked = NULL;
+	parked_num = parked_next = parked_size = 0;
+}
+
+/*
+ * With the inbound worker running, packets are framed here and then
+ * queued to the worker in the same round-robin order we'd otherwise
+ * apply them in. The worker looks up the objects they're about and
+ * wakes us through its eventfd when it has results for us.
+ */
+static void feed_worker(void)
+{
+	unsigned int idle = 0;
+
+	while (idle < num_nodes && !inbound_full()) {
+		merlin_node *node = node_table[inbound_next];
+		merlin_event *pkt;
+
+		inbound_next = (inbound_next + 1) % num_nodes;
+		if (node->sock < 0 || !(pkt = node_get_event(node))) {
+			idle++;
+			continue;
+		}
+		idle = 0;
+		inbound_submit(node, pkt);
+	}
+	inbound_kick();
+}
+
+/* returns 1 if we ran out of time before we ran out of events */
+static int apply_inbound(void)
+{
+	uint64_t start = inbound_budget ? usec_now() : 0;
+	unsigned int i, idle = 0;
+	merlin_node *node;
+	merlin_event *pkt;
+
+	if (apply_parked(start))
+		goto exhausted;
+
+	if (inbound_running()) {
+		feed_worker();
+		while (inbound_get(&node, &pkt, &merlin_recv_object)) {
+			apply_event(node, pkt);
+			merlin_recv_object = NULL;
+			if (inbound_budget && usec_now() - start >= inbound_budget) {
+				feed_worker();
+				goto exhausted;
+			}
+		}
+		feed_worker();
+		return parked_next < parked_num;
+	}
+
+	/* one full round without any events means we're done */
+	while (idle < num_nodes) {
+		node = node_table[inbound_next];
+		inbound_next = (inbound_next + 1) % num_nodes;
+		if (node->sock < 0 || !(pkt = node_get_event(node))) {
+			idle++;
+			continue;
+		}
+		idle = 0;
+		apply_event(node, pkt);
+
+		if (inbound_budget && usec_now() - start >= inbound_budget)
+			break;
+	}
+
+	if (idle >= num_nodes)
+		return parked_next < parked_num;
+
+exhausted:
+	inbound_budget_exhausted++;
+	for (i = 0; i < num_nodes; i++) {
+		if (has_input(node_table[i]))
+			node_table[i]->inbound.deferred++;
+	}
+	return 1;
+}
+
+static void inbound_arm(int pending)
+{
+	char c = 0;
+
+	if (pending == inbound_armed || inbound_pipe[0] < 0)
+		return;
+
+	if (pending) {
+		if (write(inbound_pipe[1], &c, 1) != 1)
+			return;
+	} else {
+		if (read(inbound_pipe[0], &c, 1) != 1)
+			return;
+	}
+	inbound_armed = pending;
+}
+
+static int inbound_pending(__attribute__((unused)) int sd,
+                           __attribute__((unused)) int io_evt,
+                           __attribute__((unused)) void *arg)
+{
+	inbound_arm(apply_inbound());
+	return 0;
+}
+
+static int inbound_ready(__attribute__((unused)) int sd,
+                         __attribute__((unused)) int io_evt,
+                         __attribute__((unused)) void *arg)
+{
+	inbound_ack();
+	inbound_arm(apply_inbound());
+	return 0;
+}
+
+/*
+ * node_disconnect() calls this before it throws away the node's
+ * buffer queue and bumps its epoch. That may well happen while we're
+ * applying another node's event, so nothing is applied here. Instead
+ * we take everything out of the worker's hands, along with whatever
+ * is left in the node's buffer queue, and park it to be applied first
+ * thing on our next pass. The worker has the node's oldest events, so
+ * those go first. Other nodes' events come along in the order they
+ * were read, so nobody's events are reordered.
+ */
+void net_drain_input(merlin_node *node)
 {
+	merlin_node *owner;
 	merlin_event *pkt;
+	void *obj;
+
+	if (inbound_running()) {
+		inbound_kick();
+		while (!inbound_idle()) {
+			if (!inbound_get(&owner, &pkt, &obj)) {
+				struct timespec ts = { 0, 200000 };
+
+				nanosleep(&ts, NULL);
+				continue;
+			}
+			park_event(owner, pkt, obj);
+		}
+	}
+	while ((pkt = node_get_event(node)))
+		park_event(node, pkt, NULL);
+	if (parked_num)
+		inbound_arm(1);
+}
+
+int net_input(int sd, int io_evt, void *node_)
+{
 	merlin_node *node = (merlin_node *)node_;
-	int len, events = 0;
+	unsigned long queued;
+	int len;
 
 	errno = 0;
 	ldebug("NETINPUT from %p (%s)", node, node ? node->name : "oops");
@@ -149,17 +422,16 @@ int net_input(int sd, int io_evt, void *node_)
 	node->stats.bytes.read += len;
 	node->last_recv = time(NULL);
 
-	while ((pkt = node_get_event(node))) {
-		events++;
-		handle_event(node, pkt);
-		free(pkt);
-	}
-	ldebug("Read %d events in %s from %s node %s",
-		   events, human_bytes(len), node_type(node), node->name);
+	queued = nm_bufferqueue_get_available(node->bq);
+	if (queued > node->inbound.peak)
+		node->inbound.peak = queued;
+	ldebug("Read %s from %s node %s. %s queued", human_bytes(len),
+	       node_type(node), node->name, human_bytes(queued));
 
-	return events;
-}
+	inbound_arm(apply_inbound());
 
+	return 0;
+}
 
 /*
  * Negotiate which socket to use for communication when the remote
@@ -518,6 +790,19 @@ int net_deinit(void)
 	close(net_sock);
 	net_sock = -1;
 
+	if (inbound_pipe[0] >= 0) {
+		iobroker_close(nagios_iobs, inbound_pipe[0]);
+		close(inbound_pipe[1]);
+		inbound_pipe[0] = inbound_pipe[1] = -1;
+		inbound_armed = 0;
+	}
+
+	if (inbound_running()) {
+		iobroker_close(nagios_iobs, inbound_ready_fd());
+		inbound_deinit();
+	}
+	free_parked();
+
 	return 0;
 }
 
@@ -534,6 +819,39 @@ int net_init(void)
 	if (!num_nodes)
 		return 0;
 
+	if (inbound_budget) {
+		if (pipe(inbound_pipe) < 0) {
+			lerr("Failed to create inbound event pipe: %s", strerror(errno));
+			inbound_pipe[0] = inbound_pipe[1] = -1;
+		} else {
+			fcntl(inbound_pipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(inbound_pipe[1], F_SETFL, O_NONBLOCK);
+			result = iobroker_register(nagios_iobs, inbound_pipe[0], NULL, inbound_pending);
+			if (result < 0) {
+				lerr("IOB: Failed to register inbound event pipe with I/O broker: %s",
+				     iobroker_strerror(result));
+				close(inbound_pipe[0]);
+				close(inbound_pipe[1]);
+				inbound_pipe[0] = inbound_pipe[1] = -1;
+			}
+		}
+		if (inbound_pipe[0] < 0) {
+			lwarn("Applying all inbound events as soon as they arrive");
+			inbound_budget = 0;
+		}
+	}
+
+	if (inbound_worker && !inbound_init()) {
+		result = iobroker_register(nagios_iobs, inbound_ready_fd(), NULL, inbound_ready);
+		if (result < 0) {
+			lerr("IOB: Failed to register inbound worker eventfd with I/O broker: %s",
+			     iobroker_strerror(result));
+			inbound_deinit();
+		}
+	}
+	if (inbound_worker && !inbound_running())
+		lwarn("Looking up objects for inbound events in the main thread");
+
 	sain.sin_addr.s_addr = default_addr;
 	sain.sin_port = htons(default_port);
 	sain.sin_family = AF_INET;
@@ -591,15 +909,140 @@ int net_sendto_many(merlin_node **ntable, uint num, merlin_event *pkt)
 	return 0;
 }
 
+int relay_to_masters;
+double phi_suspect = 3, phi_dead = 8;
+
+/*
+ * With relay_to_masters, events for our masters are sent to only one
+ * of them, which passes them on to its peers (our other masters).
+ * The relay is the first connected master in config order, so if it
+ * goes away the next one takes over with the next event. Masters we
+ * aren't connected to binlog events either way, so if none of them
+ * are connected we send to all of them.
+ */
+int net_sendto_masters(merlin_event *pkt)
+{
+	merlin_node *relay = NULL;
+	uint i;
+	int ret;
+
+	if (!num_masters)
+		return 0;
+
+	if (relay_to_masters && num_masters > 1 && pkt->hdr.type != CTRL_PACKET) {
+		for (i = 0; i < num_masters; i++) {
+			if (noc_table[i]->state == STATE_CONNECTED) {
+				relay = noc_table[i];
+				break;
+			}
+		}
+	}
+
+	if (!relay)
+		return net_sendto_many(noc_table, num_masters, pkt);
+
+	pkt->hdr.relay = 1;
+	pkt->hdr.hops = 0;
+	pkt->hdr.origin = 0;
+	pkt->hdr.origin_port = 0;
+	ret = net_sendto(relay, pkt);
+	pkt->hdr.relay = 0;
+
+	return ret;
+}
+
+/* pass an event a poller asked us to relay on to our peers */
+int net_relay_to_peers(merlin_node *node, merlin_event *pkt)
+{
+	if (!num_peers)
+		return 0;
+
+	pkt->hdr.relay = 0;
+	pkt->hdr.hops = 1;
+	pkt->hdr.origin = node->sain.sin_addr.s_addr;
+	pkt->hdr.origin_port = node->sain.sin_port;
+	return net_sendto_many(peer_table, num_peers, pkt);
+}
+
+/*
+ * Find the poller a peer relayed an event from, so it's handled as
+ * if the poller had sent it to us directly. Several pollers can run
+ * on one address with different ports, so we match on both. If we
+ * can't find it, the peer gets the blame.
+ */
+merlin_node *net_relay_origin(merlin_node *node, merlin_event *pkt)
+{
+	uint i;
+
+	for (i = 0; i < num_pollers; i++) {
+		if (poller_table[i]->sain.sin_addr.s_addr == pkt->hdr.origin &&
+		    poller_table[i]->sain.sin_port == pkt->hdr.origin_port)
+		{
+			return poller_table[i];
+		}
+	}
+
+	lwarn_ratelimit(60, "RELAY: %s relayed an event from %s:%u, which isn't one of our pollers",
+	                node->name, inet_ntoa(*(struct in_addr *)&pkt->hdr.origin),
+	                ntohs(pkt->hdr.origin_port));
+	return node;
+}
+
+
+/*
+ * Phi of the node, as in the phi accrual failure detector. We assume
+ * pulse intervals are normally distributed and use the logistic
+ * approximation of the normal CDF, like most implementations do.
+ * The standard deviation is never allowed below a quarter of the
+ * mean, or a very steady link would make us jump at the first
+ * pulse that's a little late.
+ */
+double node_phi(const merlin_node *node, const struct timeval *now)
+{
+	const struct merlin_liveness *l = &node->liveness;
+	double mean = 0, var = 0, sd, elapsed, y, e, p_later;
+	unsigned int i;
+
+	for (i = 0; i < l->count; i++)
+		mean += l->interval[i];
+	mean /= l->count;
+	for (i = 0; i < l->count; i++)
+		var += (l->interval[i] - mean) * (l->interval[i] - mean);
+	sd = sqrt(var / l->count);
+	if (sd < mean / 4)
+		sd = mean / 4;
+	if (sd < 1)
+		sd = 1;
+
+	elapsed = (now->tv_sec - l->last.tv_sec) * 1000.0 +
+		(now->tv_usec - l->last.tv_usec) / 1000.0;
+	y = (elapsed - mean) / sd;
+	e = exp(-y * (1.5976 + 0.070566 * y * y));
+	p_later = elapsed > mean ? e / (1.0 + e) : 1.0 - 1.0 / (1.0 + e);
+	if (p_later < 1e-300)
+		return 300;
+
+	return -log10(p_later);
+}
 
 /*
  * If a node hasn't been heard from in too long, we mark it as no
  * longer connected, signalling that we should, potentially, take
- * over checks for the AWOL node
+ * over checks for the AWOL node. Once we've seen a few pulses from
+ * it, "too long" is decided by how regular its pulses have been.
+ * Before it's considered dead, it's considered suspect, which we
+ * only warn about. Every peer sees the node's pulses a little
+ * differently, so only disconnecting it (which the node will notice
+ * too) is sure to make all of us agree on who runs which checks.
+ * A node that has sent us anything within the last pulse interval
+ * is alive either way. Its pulse may just be stuck behind a large
+ * backlog we haven't gotten around to parsing yet.
  */
-static void check_node_activity(merlin_node *node)
+void net_check_activity(merlin_node *node)
 {
-	time_t now = time(NULL);
+	struct merlin_liveness *l = &node->liveness;
+	struct timeval now;
+	int quiet;
 
 	if (node->sock == -1 || node->state != STATE_CONNECTED)
 		return;
@@ -608,6 +1051,27 @@ static void check_node_activity(merlin_node *node)
 	if (!node->data_timeout)
 		return;
 
-	if (node->last_recv < now - node->data_timeout)
-		node_disconnect(node, "Too long since last action");
+	if (l->count < LIVENESS_MIN_SAMPLES) {
+		if (node->last_recv < time(NULL) - node->data_timeout)
+			node_disconnect(node, "Too long since last action");
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	l->phi = node_phi(node, &now);
+	quiet = now.tv_sec - node->last_recv >= pulse_interval;
+	if (quiet && l->phi >= phi_dead) {
+		node_disconnect(node, "No pulse in %lu seconds (phi %.1f)",
+		                (unsigned long)(now.tv_sec - l->last.tv_sec), l->phi);
+		return;
+	}
+
+	if (quiet && !l->suspect && l->phi >= phi_suspect) {
+		lwarn("%s node %s is late with its pulse (phi %.1f)",
+		      node_type(node), node->name, l->phi);
+		l->suspect = 1;
+	} else if (l->suspect && l->phi < phi_suspect) {
+		linfo("%s node %s is pulsing again (phi %.1f)", node_type(node), node->name, l->phi);
+		l->suspect = 0;
+	}
 }
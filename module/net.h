@@ -14,5 +14,15 @@ extern int net_is_connected(merlin_node *node);
 extern int net_try_connect(merlin_node *node);
 extern int net_sendto(merlin_node *node, merlin_event *pkt);
 extern int net_sendto_many(merlin_node **ntable, uint num, merlin_event *pkt);
+extern int net_sendto_masters(merlin_event *pkt);
+extern int net_relay_to_peers(merlin_node *node, merlin_event *pkt);
+extern merlin_node *net_relay_origin(merlin_node *node, merlin_event *pkt);
+extern int relay_to_masters;
+extern double phi_suspect, phi_dead;
+extern unsigned int inbound_budget;
+extern unsigned long long inbound_budget_exhausted;
+extern double node_phi(const merlin_node *node, const struct timeval *now);
+extern void net_check_activity(merlin_node *node);
 extern int net_input(int sd, int io_evt, void *node_);
+extern void net_drain_input(merlin_node *node);
 #endif /* INCLUDE_net_h__ */
@@ -8,6 +8,8 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <glib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static struct {
 	bitmap *hosts;
@@ -344,12 +346,150 @@ static int nsplit_cache_stuff(const char *orig_groups)
 	return 0;
 }
 
-int split_config(void)
+/*
+ * Write the config for one poller and work out its hash.
+ * Returns -1 on errors, 0 if the config didn't change and 1 if
+ * a new config file was written.
+ */
+static int split_one(merlin_node *node, unsigned char *hash)
+{
+	char *outfile = NULL, *temp_file = NULL;
+	unsigned char old_hash[20];
+	int fd, ret = -1;
+	struct timeval times[2] = {{0,0}, {0,0}};
+	blk_SHA_CTX ctx;
+
+	if (asprintf(&temp_file, "%s%s.cfg.XXXXXX", poller_config_dir, node->name) == -1) {
+		lerr("Cannot nodesplit: there was an error generating temporary file name: %s", strerror(errno));
+		return -1;
+	}
+	if (asprintf(&outfile, "%s%s.cfg", poller_config_dir, node->name) == -1) {
+		lerr("Cannot nodesplit: there was an error generating file name: %s", strerror(errno));
+		free(temp_file);
+		return -1;
+	}
+	fd = mkstemp(temp_file);
+	if (fd < 0) {
+		lerr("Cannot nodesplit: Failed to create temporary file '%s' for writing: %s", temp_file, strerror(errno));
+		goto out;
+	}
+	fp = fdopen(fd, "r+");
+	if (!fp) {
+		lerr("Cannot nodesplit: Failed to open '%s' for writing: %s", temp_file, strerror(errno));
+		close(fd);
+		unlink(temp_file);
+		goto out;
+	}
+	linfo("OCONFSPLIT: Writing config for poller %s to '%s'\n", node->name, outfile);
+
+	bitmap_clear(htrack);
+	bitmap_clear(map.hosts);
+	bitmap_clear(map.commands);
+	bitmap_clear(map.timeperiods);
+	bitmap_clear(map.contacts);
+	bitmap_clear(map.contactgroups);
+	bitmap_clear(map.hostgroups);
+
+	/* global commands are always included */
+	nsplit_cache_command(ochp_command_ptr);
+	nsplit_cache_command(ocsp_command_ptr);
+	nsplit_cache_command(global_host_event_handler_ptr);
+	nsplit_cache_command(global_service_event_handler_ptr);
+	if (host_perfdata_command)
+		nsplit_cache_command(find_command(host_perfdata_command));
+	if (service_perfdata_command)
+		nsplit_cache_command(find_command(service_perfdata_command));
+	if (host_perfdata_file_processing_command)
+		nsplit_cache_command(find_command(host_perfdata_file_processing_command));
+	if (service_perfdata_file_processing_command)
+		nsplit_cache_command(find_command(service_perfdata_file_processing_command));
+
+	if (nsplit_cache_stuff(node->hostgroups) < 0) {
+		lerr("Caching for %s failed. Skipping", node->name);
+		fclose(fp);
+		unlink(temp_file);
+		goto out;
+	}
+	nsplit_partial_groups();
+	fclose(fp);
+
+	blk_SHA1_Init(&ctx);
+	hash_add_file(temp_file, &ctx);
+	blk_SHA1_Final(hash, &ctx);
+
+	/*
+	 * if nothing changed we keep the old file, and its mtime, so
+	 * there's nothing new to push to the poller
+	 */
+	blk_SHA1_Init(&ctx);
+	if (!hash_add_file(outfile, &ctx)) {
+		blk_SHA1_Final(old_hash, &ctx);
+		if (!memcmp(hash, old_hash, sizeof(old_hash))) {
+			linfo("OCONFSPLIT: Config for poller %s is unchanged", node->name);
+			unlink(temp_file);
+			ret = 0;
+			goto out;
+		}
+	}
+
+	if (rename(temp_file, outfile)) {
+		lerr("Cannot nodesplit: Failed to create '%s' from temporary file %s: %s", outfile, temp_file, strerror(errno));
+		unlink(temp_file);
+		goto out;
+	}
+	times[0].tv_sec = times[1].tv_sec = ipc.info.last_cfg_change;
+	if (utimes(outfile, times) == -1) {
+		lerr("Error in nodesplit: Failed to set mtime of '%s': %s", outfile, strerror(errno));
+		goto out;
+	}
+	ret = 1;
+
+out:
+	free(temp_file);
+	free(outfile);
+	return ret;
+}
+
+/* what split workers tell the parent about each poller */
+struct split_result {
+	unsigned int idx;
+	int status;
+	unsigned char hash[20];
+};
+
+static void split_worker(unsigned int first, unsigned int step, int wfd)
 {
 	unsigned int i;
 
-	char *groups = NULL;
-	merlin_node *node;
+	for (i = first; i < num_pollers; i += step) {
+		struct split_result r;
+
+		memset(&r, 0, sizeof(r));
+		r.idx = i;
+		r.status = split_one(poller_table[i], r.hash);
+		/* small enough for pipe writes to be atomic */
+		if (write(wfd, &r, sizeof(r)) != sizeof(r))
+			break;
+	}
+}
+
+/*
+ * Splitting is done by forked worker processes, since neither we
+ * nor Naemon's object functions are thread-safe. Each worker gets
+ * its own copy of the tracker maps for free. Pollers a worker failed
+ * to report on, because it couldn't be started or crashed, are split
+ * by us afterwards.
+ */
+int split_config(void)
+{
+	unsigned int i, w, workers;
+	long cpus;
+	char *done;
+	int *rfd;
+	pid_t *pid;
+
+	if (!num_pollers)
+		return OK;
 
 	/* create our tracker maps */
 	htrack = bitmap_create(num_objects.hosts);
@@ -360,78 +500,81 @@ int split_config(void)
 	map.contactgroups = bitmap_create(num_objects.contactgroups);
 	map.hostgroups = bitmap_create(num_objects.hostgroups);
 
-	for (i = 0; i < num_pollers; i++) {
-		char *outfile, *temp_file;
-		int fd;
-		struct timeval times[2] = {{0,0}, {0,0}};
-		blk_SHA_CTX ctx;
-
-		node = poller_table[i];
-		if (asprintf(&temp_file, "%s%s.cfg.XXXXXX", poller_config_dir, node->name) == -1) {
-			lerr("Cannot nodesplit: there was an error generating temporary file name: %s", strerror(errno));
-			continue;
-		}
-		if (asprintf(&outfile, "%s%s.cfg", poller_config_dir, node->name) == -1) {
-			lerr("Cannot nodesplit: there was an error generating file name: %s", strerror(errno));
-			continue;
-		}
-		fd = mkstemp(temp_file);
-		if (fd < 0) {
-			lerr("Cannot nodesplit: Failed to create temporary file '%s' for writing: %s", temp_file, strerror(errno));
-			continue;
-		}
-		fp = fdopen(fd, "r+");
-		if (!fp) {
-			lerr("Cannot nodesplit: Failed to open '%s' for writing: %s", temp_file, strerror(errno));
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	workers = cpus > 1 ? cpus : 1;
+	if (workers > num_pollers)
+		workers = num_pollers;
+
+	done = calloc(num_pollers, 1);
+	rfd = calloc(workers, sizeof(*rfd));
+	pid = calloc(workers, sizeof(*pid));
+	if (!done || !rfd || !pid) {
+		lerr("Cannot nodesplit: Failed to allocate memory: %s", strerror(errno));
+		goto out;
+	}
+
+	for (w = 0; workers > 1 && w < workers; w++) {
+		int pfd[2];
+
+		rfd[w] = -1;
+		pid[w] = -1;
+		if (pipe(pfd) < 0) {
+			lerr("OCONFSPLIT: Failed to create pipe for worker: %s", strerror(errno));
 			continue;
 		}
-		linfo("OCONFSPLIT: Writing config for poller %s to '%s'\n", node->name, outfile);
-
-		groups = node->hostgroups;
-
-		bitmap_clear(htrack);
-		bitmap_clear(map.hosts);
-		bitmap_clear(map.commands);
-		bitmap_clear(map.timeperiods);
-		bitmap_clear(map.contacts);
-		bitmap_clear(map.contactgroups);
-		bitmap_clear(map.hostgroups);
-
-		/* global commands are always included */
-		nsplit_cache_command(ochp_command_ptr);
-		nsplit_cache_command(ocsp_command_ptr);
-		nsplit_cache_command(global_host_event_handler_ptr);
-		nsplit_cache_command(global_service_event_handler_ptr);
-		if (host_perfdata_command)
-			nsplit_cache_command(find_command(host_perfdata_command));
-		if (service_perfdata_command)
-			nsplit_cache_command(find_command(service_perfdata_command));
-		if (host_perfdata_file_processing_command)
-			nsplit_cache_command(find_command(host_perfdata_file_processing_command));
-		if (service_perfdata_file_processing_command)
-			nsplit_cache_command(find_command(service_perfdata_file_processing_command));
-
-		if (nsplit_cache_stuff(groups) < 0) {
-			lerr("Caching for %s failed. Skipping", node->name);
+		pid[w] = fork();
+		if (pid[w] < 0) {
+			lerr("OCONFSPLIT: Failed to fork worker: %s", strerror(errno));
+			close(pfd[0]);
+			close(pfd[1]);
 			continue;
 		}
-		nsplit_partial_groups();
-		fclose(fp);
-		if (rename(temp_file, outfile)) {
-			lerr("Cannot nodesplit: Failed to create '%s' from temporary file %s: %s", outfile, temp_file, strerror(errno));
-			continue;
+		if (!pid[w]) {
+			log_forked();
+			/* don't let the parent wait for EOF on our siblings' pipes */
+			for (i = 0; i < w; i++) {
+				if (rfd[i] >= 0)
+					close(rfd[i]);
+			}
+			close(pfd[0]);
+			split_worker(w, workers, pfd[1]);
+			close(pfd[1]);
+			_exit(0);
 		}
-		times[0].tv_sec = times[1].tv_sec = ipc.info.last_cfg_change;
-		if (utimes(outfile, times) == -1) {
-			lerr("Error in nodesplit: Failed to set mtime of '%s': %s", outfile, strerror(errno));
+		close(pfd[1]);
+		rfd[w] = pfd[0];
+	}
+
+	for (w = 0; workers > 1 && w < workers; w++) {
+		struct split_result r;
+
+		if (rfd[w] < 0)
 			continue;
+		while (read(rfd[w], &r, sizeof(r)) == sizeof(r)) {
+			if (r.idx >= num_pollers)
+				continue;
+			done[r.idx] = 1;
+			if (r.status >= 0)
+				memcpy(poller_table[r.idx]->expected.config_hash, r.hash, sizeof(r.hash));
 		}
+		close(rfd[w]);
+		waitpid(pid[w], NULL, 0);
+	}
 
-		blk_SHA1_Init(&ctx);
-		hash_add_file(outfile, &ctx);
-		blk_SHA1_Final(node->expected.config_hash, &ctx);
+	for (i = 0; i < num_pollers; i++) {
+		merlin_node *node = poller_table[i];
+		unsigned char hash[20];
+
+		if (done[i])
+			continue;
+		if (split_one(node, hash) >= 0)
+			memcpy(node->expected.config_hash, hash, sizeof(hash));
 	}
 
+out:
+	free(done);
+	free(rfd);
+	free(pid);
 	bitmap_destroy(htrack);
 	bitmap_destroy(map.hosts);
 	bitmap_destroy(map.commands);
@@ -4,8 +4,12 @@
 #include "logging.h"
 #include "ipc.h"
 #include "testif_qh.h"
+#include "hooks.h"
+#include "cbtiming.h"
+#include "net.h"
 #include <naemon/naemon.h>
 #include <string.h>
+#include <stddef.h>
 
 static int dump_cbstats(merlin_node *n, int sd)
 {
@@ -15,11 +19,11 @@ static int dump_cbstats(merlin_node *n, int sd)
 	for (i = 0; i <= NEBCALLBACK_NUMITEMS; i++) {
 		const char *cb_name = callback_name(i);
 		/* don't print empty values */
-		if(!n->stats.cb_count[i].in && !n->stats.cb_count[i].in)
+		if(!n->stats.cb_count[i].in && !n->stats.cb_count[i].out)
 			continue;
 		nsock_printf(sd, "%s_IN=%u;%s_OUT=%u;",
 					 cb_name, n->stats.cb_count[i].in,
-					 cb_name, n->stats.cb_count[i].in);
+					 cb_name, n->stats.cb_count[i].out);
 	}
 	nsock_printf(sd, "\n");
 	return 0;
@@ -46,6 +50,246 @@ static int dump_notify_stats(int sd)
 	return 0;
 }
 
+/*
+ * The "metrics" output uses the Prometheus text exposition format,
+ * so it can be scraped without any custom parsing. Metric names and
+ * labels are part of the interface; don't change them lightly.
+ * Everything here is read straight from counters the event loop
+ * keeps anyway, so a scrape costs no more than formatting the text.
+ */
+static const struct node_metric {
+	const char *name, *help;
+	size_t offset;
+} node_counters[] = {
+	{ "merlin_node_events_sent_total", "Events sent to the node",
+	  offsetof(merlin_node_stats, events.sent) },
+	{ "merlin_node_events_read_total", "Events read from the node",
+	  offsetof(merlin_node_stats, events.read) },
+	{ "merlin_node_events_logged_total", "Events queued in the binlog for the node",
+	  offsetof(merlin_node_stats, events.logged) },
+	{ "merlin_node_events_dropped_total", "Events that couldn't be sent to the node",
+	  offsetof(merlin_node_stats, events.dropped) },
+	{ "merlin_node_bytes_sent_total", "Bytes sent to the node",
+	  offsetof(merlin_node_stats, bytes.sent) },
+	{ "merlin_node_bytes_read_total", "Bytes read from the node",
+	  offsetof(merlin_node_stats, bytes.read) },
+	{ "merlin_node_bytes_logged_total", "Bytes queued in the binlog for the node",
+	  offsetof(merlin_node_stats, bytes.logged) },
+	{ "merlin_node_bytes_dropped_total", "Bytes that couldn't be sent to the node",
+	  offsetof(merlin_node_stats, bytes.dropped) },
+	{ "merlin_node_events_filtered_total", "Events not forwarded since the node doesn't monitor the object",
+	  offsetof(merlin_node_stats, events.filtered) },
+	{ "merlin_node_bytes_filtered_total", "Bytes not forwarded since the node doesn't monitor the object",
+	  offsetof(merlin_node_stats, bytes.filtered) },
+};
+
+static merlin_node *metrics_node(unsigned int i)
+{
+	return i ? node_table[i - 1] : &ipc;
+}
+
+static void metric_header(int sd, const char *name, const char *type, const char *help)
+{
+	nsock_printf(sd, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void node_summary(int sd, const char *name, merlin_node *n, const histogram *h)
+{
+	static const double q[] = { 50, 90, 99 };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(q); i++) {
+		nsock_printf(sd, "%s{node=\"%s\",quantile=\"%g\"} %llu\n",
+		             name, n->name, q[i] / 100,
+		             (unsigned long long)histogram_percentile(h, q[i]));
+	}
+	nsock_printf(sd, "%s_sum{node=\"%s\"} %llu\n", name, n->name, (unsigned long long)h->sum);
+	nsock_printf(sd, "%s_count{node=\"%s\"} %llu\n", name, n->name, (unsigned long long)h->count);
+}
+
+static int dump_metrics(int sd)
+{
+	unsigned int i, k;
+	struct dlist_entry *it;
+	unsigned long long expired = 0;
+
+	metric_header(sd, "merlin_node_info", "gauge", "Configured nodes. Always 1");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_info{node=\"%s\",type=\"%s\"} 1\n",
+		             n->name, node_type(n));
+	}
+
+	metric_header(sd, "merlin_node_connected", "gauge", "1 if the node is connected");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_connected{node=\"%s\"} %d\n",
+		             n->name, n->state == STATE_CONNECTED);
+	}
+
+	for (k = 0; k < ARRAY_SIZE(node_counters); k++) {
+		const struct node_metric *m = &node_counters[k];
+		metric_header(sd, m->name, "counter", m->help);
+		for (i = 0; i <= num_nodes; i++) {
+			merlin_node *n = metrics_node(i);
+			nsock_printf(sd, "%s{node=\"%s\"} %llu\n", m->name, n->name,
+			             *(unsigned long long *)((char *)&n->stats + m->offset));
+		}
+	}
+
+	metric_header(sd, "merlin_node_binlog_entries", "gauge", "Events waiting in the binlog");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_binlog_entries{node=\"%s\"} %u\n",
+		             n->name, binlog_num_entries(n->binlog));
+	}
+	metric_header(sd, "merlin_node_binlog_memory_bytes", "gauge", "Memory used by the binlog");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_binlog_memory_bytes{node=\"%s\"} %u\n",
+		             n->name, binlog_msize(n->binlog));
+	}
+	metric_header(sd, "merlin_node_binlog_file_bytes", "gauge", "Size of the on-disk binlog");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_binlog_file_bytes{node=\"%s\"} %u\n",
+		             n->name, binlog_fsize(n->binlog));
+	}
+	metric_header(sd, "merlin_node_input_queue_bytes", "gauge", "Bytes read from the node but not yet handled");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_input_queue_bytes{node=\"%s\"} %lu\n",
+		             n->name, n->bq ? (unsigned long)nm_bufferqueue_get_available(n->bq) : 0UL);
+	}
+	metric_header(sd, "merlin_node_input_queue_peak_bytes", "gauge", "Most bytes we've had queued from the node");
+	for (i = 1; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_input_queue_peak_bytes{node=\"%s\"} %lu\n",
+		             n->name, n->inbound.peak);
+	}
+	metric_header(sd, "merlin_node_input_deferred_total", "counter", "Times we ran out of time with events from the node queued");
+	for (i = 1; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_input_deferred_total{node=\"%s\"} %llu\n",
+		             n->name, n->inbound.deferred);
+	}
+	metric_header(sd, "merlin_inbound_budget_exhausted_total", "counter", "Times we ran out of time applying inbound events");
+	nsock_printf(sd, "merlin_inbound_budget_exhausted_total %llu\n", inbound_budget_exhausted);
+	metric_header(sd, "merlin_received_outputs_reused_total", "counter", "Received plugin outputs identical to the ones we had");
+	nsock_printf(sd, "merlin_received_outputs_reused_total %llu\n", merlin_output_stats.reused);
+	metric_header(sd, "merlin_received_outputs_copied_total", "counter", "Received plugin outputs that had changed");
+	nsock_printf(sd, "merlin_received_outputs_copied_total %llu\n", merlin_output_stats.copied);
+	metric_header(sd, "merlin_received_output_bytes_reused_total", "counter", "Bytes of received plugin output we didn't have to copy");
+	nsock_printf(sd, "merlin_received_output_bytes_reused_total %llu\n", merlin_output_stats.bytes_reused);
+	metric_header(sd, "merlin_received_output_bytes_copied_total", "counter", "Bytes of received plugin output we had to copy");
+	nsock_printf(sd, "merlin_received_output_bytes_copied_total %llu\n", merlin_output_stats.bytes_copied);
+	metric_header(sd, "merlin_node_flow_stalls_total", "counter", "Times we ran out of credit for the node");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_flow_stalls_total{node=\"%s\"} %u\n",
+		             n->name, n->flow.stalls);
+	}
+	metric_header(sd, "merlin_node_expired_checks", "gauge", "Checks the node is responsible for that have expired");
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_expired_checks{node=\"%s\",object=\"host\"} %u\n",
+		             n->name, n->assigned.expired.hosts);
+		nsock_printf(sd, "merlin_node_expired_checks{node=\"%s\",object=\"service\"} %u\n",
+		             n->name, n->assigned.expired.services);
+	}
+
+	metric_header(sd, "merlin_node_phi", "gauge", "How sure we are that the node is dead, on a log10 scale");
+	for (i = 1; i <= num_nodes; i++) {
+		merlin_node *n = metrics_node(i);
+		nsock_printf(sd, "merlin_node_phi{node=\"%s\"} %.2f\n", n->name, n->liveness.phi);
+	}
+	metric_header(sd, "merlin_node_rtt_microseconds", "summary", "Round-trip time of pulses to the node");
+	for (i = 1; i <= num_nodes; i++)
+		node_summary(sd, "merlin_node_rtt_microseconds", metrics_node(i), &metrics_node(i)->link.rtt_hist);
+	metric_header(sd, "merlin_node_event_age_microseconds", "summary", "Age of events from the node when we got them");
+	for (i = 1; i <= num_nodes; i++)
+		node_summary(sd, "merlin_node_event_age_microseconds", metrics_node(i), &metrics_node(i)->link.age_hist);
+
+	metric_header(sd, "merlin_dedup_checked_total", "counter", "Status events checked for duplicates");
+	for (i = 0; i < NEBCALLBACK_NUMITEMS; i++) {
+		if (dedup_stats[i].checked)
+			nsock_printf(sd, "merlin_dedup_checked_total{event=\"%s\"} %llu\n",
+			             callback_name(i), dedup_stats[i].checked);
+	}
+	metric_header(sd, "merlin_dedup_dupes_total", "counter", "Duplicate status events not sent");
+	for (i = 0; i < NEBCALLBACK_NUMITEMS; i++) {
+		if (dedup_stats[i].checked)
+			nsock_printf(sd, "merlin_dedup_dupes_total{event=\"%s\"} %llu\n",
+			             callback_name(i), dedup_stats[i].dupes);
+	}
+	metric_header(sd, "merlin_dedup_bytes_total", "counter", "Bytes saved by not sending duplicates");
+	for (i = 0; i < NEBCALLBACK_NUMITEMS; i++) {
+		if (dedup_stats[i].checked)
+			nsock_printf(sd, "merlin_dedup_bytes_total{event=\"%s\"} %llu\n",
+			             callback_name(i), dedup_stats[i].dupe_bytes);
+	}
+
+	metric_header(sd, "merlin_event_duration_nanoseconds", "summary", "Time spent handling events (sampled)");
+	for (k = CBTIMING_OUT; k <= CBTIMING_IN; k++) {
+		for (i = 0; i <= NEBCALLBACK_NUMITEMS; i++) {
+			static const double q[] = { 50, 90, 99 };
+			const struct cb_timing *t = &cb_timing[k][i];
+			const char *dir = k == CBTIMING_OUT ? "out" : "in";
+			const char *type = i == NEBCALLBACK_NUMITEMS ? "CTRL_PACKET" : callback_name(i);
+			unsigned int j;
+
+			if (!t->calls)
+				continue;
+			for (j = 0; j < ARRAY_SIZE(q); j++) {
+				nsock_printf(sd, "merlin_event_duration_nanoseconds{direction=\"%s\",event=\"%s\",quantile=\"%g\"} %llu\n",
+				             dir, type, q[j] / 100, (unsigned long long)histogram_percentile(&t->ns, q[j]));
+			}
+			nsock_printf(sd, "merlin_event_duration_nanoseconds_sum{direction=\"%s\",event=\"%s\"} %llu\n",
+			             dir, type, (unsigned long long)t->ns.sum);
+			nsock_printf(sd, "merlin_event_duration_nanoseconds_count{direction=\"%s\",event=\"%s\"} %llu\n",
+			             dir, type, (unsigned long long)t->ns.count);
+		}
+	}
+	metric_header(sd, "merlin_events_total", "counter", "Events handled, including those not timed");
+	for (k = CBTIMING_OUT; k <= CBTIMING_IN; k++) {
+		for (i = 0; i <= NEBCALLBACK_NUMITEMS; i++) {
+			const struct cb_timing *t = &cb_timing[k][i];
+			if (!t->calls)
+				continue;
+			nsock_printf(sd, "merlin_events_total{direction=\"%s\",event=\"%s\"} %llu\n",
+			             k == CBTIMING_OUT ? "out" : "in",
+			             i == NEBCALLBACK_NUMITEMS ? "CTRL_PACKET" : callback_name(i),
+			             (unsigned long long)t->calls);
+		}
+	}
+
+	dlist_foreach(expired_events, it) {
+		expired++;
+	}
+	metric_header(sd, "merlin_expired_events", "gauge", "Checks currently considered expired");
+	nsock_printf(sd, "merlin_expired_events %llu\n", expired);
+
+	return 0;
+}
+
+/* with no name, dump all of them */
+static int dump_flightrec(int sd, const char *name)
+{
+	unsigned int i;
+	int found = 0;
+
+	for (i = 0; i <= num_nodes; i++) {
+		merlin_node *n = i ? node_table[i - 1] : &ipc;
+
+		if (*name && strcmp(name, n->name))
+			continue;
+		found = 1;
+		flightrec_dump(&n->flightrec, n->name, sd);
+	}
+
+	return found ? 0 : 404;
+}
+
 static int help(int sd)
 {
 	nsock_printf_nul(sd,
@@ -54,6 +298,13 @@ static int help(int sd)
 		"cbstats       Print callback statistics for each node\n"
 		"notify-stats  Print notification statistics\n"
 		"expired       Print information regarding expired events\n"
+		"dedup-stats   Print duplicate suppression statistics per event type\n"
+		"cbtiming      Print time spent handling each event type, and the\n"
+		"              share of wall time spent inside merlin\n"
+		"flightrec [<node>]  Print the last packets sent to, queued for and\n"
+		"              received from a node, or from all nodes\n"
+		"metrics       Print counters, gauges and latency summaries in\n"
+		"              Prometheus text format\n"
 	);
 	return 0;
 }
@@ -110,6 +361,22 @@ int merlin_qh(int sd, char *buf, unsigned int len)
 		dump_expired(sd);
 		return 0;
 	}
+	if (0 == strcmp(buf, "flightrec"))
+		return dump_flightrec(sd, "");
+	if (0 == prefixcmp(buf, "flightrec "))
+		return dump_flightrec(sd, buf + 10);
+	if (0 == strcmp(buf, "cbtiming")) {
+		dump_cbtiming(sd);
+		return 0;
+	}
+	if (0 == strcmp(buf, "metrics")) {
+		dump_metrics(sd);
+		return 0;
+	}
+	if (0 == strcmp(buf, "dedup-stats")) {
+		dump_dedup_stats(sd);
+		return 0;
+	}
 	if (0 == strcmp(buf, "notify-stats")) {
 		dump_notify_stats(sd);
 		return 0;
@@ -0,0 +1,364 @@
+#include <string.h>
+#include <naemon/naemon.h>
+#include "snapshot.h"
+#include "module.h"
+#include "logging.h"
+#include "ipc.h"
+#include "codec.h"
+
+/* bytes per object, not counting its plugin output */
+#define SNAPSHOT_FIXED (3 * sizeof(int64_t) + sizeof(uint32_t) + 4)
+
+/* longer outputs are truncated, so every object fits in a packet */
+#define SNAPSHOT_MAX_OUTPUT 4095
+
+/* the parts of an object's state we send */
+struct snap_obj {
+	time_t last_check, last_state_change, last_hard_state_change;
+	int current_state, last_hard_state, state_type, current_attempt;
+	const char *output;
+};
+
+/*
+ * fills in "o" and returns 1 if host "id" should be in the snapshot.
+ * That's every host we have a state for, and not just the ones we own
+ * now, since the backlog the snapshot replaces also has results for
+ * hosts we checked while the node was away. The node ignores anything
+ * older than what it already has.
+ */
+static int snap_host(unsigned int id, struct snap_obj *o)
+{
+	host *h = host_ary[id];
+
+	if (!h->has_been_checked)
+		return 0;
+
+	o->last_check = h->last_check;
+	o->last_state_change = h->last_state_change;
+	o->last_hard_state_change = h->last_hard_state_change;
+	o->current_state = h->current_state;
+	o->last_hard_state = h->last_hard_state;
+	o->state_type = h->state_type;
+	o->current_attempt = h->current_attempt;
+	o->output = h->plugin_output ? h->plugin_output : "";
+	return 1;
+}
+
+static int snap_service(unsigned int id, struct snap_obj *o)
+{
+	service *s = service_ary[id];
+
+	if (!s->has_been_checked)
+		return 0;
+
+	o->last_check = s->last_check;
+	o->last_state_change = s->last_state_change;
+	o->last_hard_state_change = s->last_hard_state_change;
+	o->current_state = s->current_state;
+	o->last_hard_state = s->last_hard_state;
+	o->state_type = s->state_type;
+	o->current_attempt = s->current_attempt;
+	o->output = s->plugin_output ? s->plugin_output : "";
+	return 1;
+}
+
+static size_t output_len(const struct snap_obj *o)
+{
+	size_t len = strlen(o->output);
+	return len > SNAPSHOT_MAX_OUTPUT ? SNAPSHOT_MAX_OUTPUT : len;
+}
+
+static unsigned int count_objects(unsigned int total, int (*get)(unsigned int, struct snap_obj *))
+{
+	struct snap_obj o;
+	unsigned int i, count = 0;
+
+	for (i = 0; i < total; i++)
+		count += get(i, &o);
+
+	return count;
+}
+
+/*
+ * Sends all objects "get" wants to in as few packets as possible.
+ * Each packet is built in two passes; one to see how many objects
+ * fit, and one to lay out the columns once we know their sizes.
+ */
+static int send_objects(merlin_node *node, uint32_t what, unsigned int total,
+                        int (*get)(unsigned int, struct snap_obj *))
+{
+	static merlin_event pkt;
+	struct merlin_snapshot *snap = (struct merlin_snapshot *)pkt.body;
+	unsigned int i = 0, end, sent = 0;
+
+	while (i < total) {
+		struct snap_obj o;
+		int64_t *last_check, *last_state_change, *last_hard_state_change;
+		uint32_t *id;
+		uint8_t *current_state, *last_hard_state, *state_type, *current_attempt;
+		char *out;
+		size_t size = sizeof(*snap);
+		unsigned int count = 0, n = 0;
+
+		for (end = i; end < total; end++) {
+			size_t need;
+
+			if (!get(end, &o))
+				continue;
+			need = SNAPSHOT_FIXED + output_len(&o) + 1;
+			if (size + need > sizeof(pkt.body))
+				break;
+			size += need;
+			count++;
+		}
+		if (!count) {
+			i = end;
+			continue;
+		}
+
+		last_check = (int64_t *)(pkt.body + sizeof(*snap));
+		last_state_change = last_check + count;
+		last_hard_state_change = last_state_change + count;
+		id = (uint32_t *)(last_hard_state_change + count);
+		current_state = (uint8_t *)(id + count);
+		last_hard_state = current_state + count;
+		state_type = last_hard_state + count;
+		current_attempt = state_type + count;
+		out = (char *)(current_attempt + count);
+
+		for (; i < end; i++) {
+			size_t len;
+
+			if (!get(i, &o))
+				continue;
+			last_check[n] = o.last_check;
+			last_state_change[n] = o.last_state_change;
+			last_hard_state_change[n] = o.last_hard_state_change;
+			id[n] = i;
+			current_state[n] = o.current_state;
+			last_hard_state[n] = o.last_hard_state;
+			state_type[n] = o.state_type;
+			current_attempt[n] = o.current_attempt;
+			len = output_len(&o);
+			memcpy(out, o.output, len);
+			out[len] = 0;
+			out += len + 1;
+			n++;
+		}
+
+		snap->what = what;
+		snap->count = count;
+		memset(&pkt.hdr, 0, HDR_SIZE);
+		pkt.hdr.sig.id = MERLIN_SIGNATURE;
+		pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+		gettimeofday(&pkt.hdr.sent, NULL);
+		pkt.hdr.type = CTRL_PACKET;
+		pkt.hdr.code = CTRL_SNAPSHOT;
+		pkt.hdr.selection = CTRL_GENERIC;
+		pkt.hdr.len = size;
+		if (node_send_event(node, &pkt, 0) < 0)
+			return -1;
+		sent += count;
+	}
+
+	return sent;
+}
+
+int snapshot_send(merlin_node *node)
+{
+	unsigned int backlog;
+	int hosts, services;
+
+	/*
+	 * Everything that's in the backlog right now is older than the
+	 * snapshot, so whatever state events it holds are redundant.
+	 * Events we add from now on are newer and must still be sent.
+	 */
+	backlog = binlog_num_entries(node->binlog);
+
+	hosts = send_objects(node, SNAPSHOT_HOSTS, num_objects.hosts, snap_host);
+	if (hosts < 0)
+		return -1;
+	services = send_objects(node, SNAPSHOT_SERVICES, num_objects.services, snap_service);
+	if (services < 0)
+		return -1;
+
+	node->resync_skip = backlog;
+	node->resync = 0;
+	linfo("RESYNC: Sent state of %d hosts and %d services to %s. Skipping state events among %u backlogged events",
+	      hosts, services, node->name, backlog);
+	return 0;
+}
+
+void snapshot_check(merlin_node *node)
+{
+	unsigned int objects;
+
+	if (!(node->resync & RESYNC_CHECK))
+		return;
+	node->resync &= ~RESYNC_CHECK;
+
+	/*
+	 * Only peers have the same objects as we do. They also have
+	 * to understand CTRL_SNAPSHOT, and nodes that grant credit do.
+	 */
+	if (node->type != MODE_PEER || !node->flow.limit)
+		return;
+
+	if (!(node->resync & RESYNC_LOST)) {
+		objects = count_objects(num_objects.hosts, snap_host) +
+			count_objects(num_objects.services, snap_service);
+		if (binlog_num_entries(node->binlog) <= objects)
+			return;
+	}
+
+	snapshot_send(node);
+}
+
+/* when an object's current state and state type began */
+static time_t state_began(time_t last_state_change, time_t last_hard_state_change)
+{
+	return last_state_change > last_hard_state_change ? last_state_change : last_hard_state_change;
+}
+
+static void report_event(merlin_node *node, int type, void *data)
+{
+	static merlin_event pkt;
+
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.type = type;
+	pkt.hdr.selection = node->id;
+	pkt.hdr.len = merlin_encode_event(&pkt, data);
+	ipc_send_event(&pkt);
+}
+
+/*
+ * The state events the node skipped on account of the snapshot would
+ * have reached our daemon through handle_event(), so we report state
+ * changes to it ourselves. Otherwise report_data gets a hole for the
+ * whole time we were apart. Intermediate states are gone for good,
+ * so the change is reported as of when the current state began.
+ */
+static void report_host(merlin_node *node, host *h)
+{
+	merlin_host_status st_obj;
+
+	memset(&st_obj, 0, sizeof(st_obj));
+	st_obj.name = h->name;
+	st_obj.nebattr = NEBATTR_CHECK_ALERT;
+	MOD2NET_STATE_VARS(st_obj.state, h);
+	st_obj.state.last_check = state_began(h->last_state_change, h->last_hard_state_change);
+	st_obj.state.long_plugin_output = st_obj.state.perf_data = NULL;
+	report_event(node, NEBCALLBACK_HOST_CHECK_DATA, &st_obj);
+}
+
+static void report_service(merlin_node *node, service *s)
+{
+	merlin_service_status st_obj;
+
+	memset(&st_obj, 0, sizeof(st_obj));
+	st_obj.host_name = s->host_name;
+	st_obj.service_description = s->description;
+	st_obj.nebattr = NEBATTR_CHECK_ALERT;
+	MOD2NET_STATE_VARS(st_obj.state, s);
+	st_obj.state.last_check = state_began(s->last_state_change, s->last_hard_state_change);
+	st_obj.state.long_plugin_output = st_obj.state.perf_data = NULL;
+	report_event(node, NEBCALLBACK_SERVICE_CHECK_DATA, &st_obj);
+}
+
+int snapshot_apply(merlin_node *node, merlin_event *pkt)
+{
+	struct merlin_snapshot *snap = (struct merlin_snapshot *)pkt->body;
+	int64_t *last_check, *last_state_change, *last_hard_state_change;
+	uint32_t *id;
+	uint8_t *current_state, *last_hard_state, *state_type, *current_attempt;
+	const char *out, *end = pkt->body + pkt->hdr.len;
+	unsigned int i, count, total, updated = 0;
+
+	if (pkt->hdr.len < sizeof(*snap) ||
+	    (pkt->hdr.len - sizeof(*snap)) / SNAPSHOT_FIXED < snap->count)
+	{
+		lerr("RESYNC: Snapshot from %s is truncated", node->name);
+		return -1;
+	}
+	if (snap->what == SNAPSHOT_HOSTS)
+		total = num_objects.hosts;
+	else if (snap->what == SNAPSHOT_SERVICES)
+		total = num_objects.services;
+	else {
+		lwarn("RESYNC: Unknown snapshot type %u from %s", snap->what, node->name);
+		return -1;
+	}
+
+	count = snap->count;
+	last_check = (int64_t *)(pkt->body + sizeof(*snap));
+	last_state_change = last_check + count;
+	last_hard_state_change = last_state_change + count;
+	id = (uint32_t *)(last_hard_state_change + count);
+	current_state = (uint8_t *)(id + count);
+	last_hard_state = current_state + count;
+	state_type = last_hard_state + count;
+	current_attempt = state_type + count;
+	out = (const char *)(current_attempt + count);
+
+	for (i = 0; i < count; i++) {
+		const char *next = memchr(out, 0, end - out);
+		char **output;
+		int changed;
+
+		if (!next) {
+			lerr("RESYNC: Snapshot from %s has unterminated output", node->name);
+			break;
+		}
+		if (id[i] >= total)
+			goto next;
+
+		/* we may have seen newer results while we were apart */
+		if (snap->what == SNAPSHOT_HOSTS) {
+			host *h = host_ary[id[i]];
+			if (h->has_been_checked && h->last_check >= last_check[i])
+				goto next;
+			changed = !h->has_been_checked || h->current_state != current_state[i] ||
+				h->state_type != state_type[i];
+			h->has_been_checked = 1;
+			h->last_check = last_check[i];
+			h->last_state_change = last_state_change[i];
+			h->last_hard_state_change = last_hard_state_change[i];
+			h->current_state = current_state[i];
+			h->last_hard_state = last_hard_state[i];
+			h->state_type = state_type[i];
+			h->current_attempt = current_attempt[i];
+			output = &h->plugin_output;
+		} else {
+			service *s = service_ary[id[i]];
+			if (s->has_been_checked && s->last_check >= last_check[i])
+				goto next;
+			changed = !s->has_been_checked || s->current_state != current_state[i] ||
+				s->state_type != state_type[i];
+			s->has_been_checked = 1;
+			s->last_check = last_check[i];
+			s->last_state_change = last_state_change[i];
+			s->last_hard_state_change = last_hard_state_change[i];
+			s->current_state = current_state[i];
+			s->last_hard_state = last_hard_state[i];
+			s->state_type = state_type[i];
+			s->current_attempt = current_attempt[i];
+			output = &s->plugin_output;
+		}
+		free(*output);
+		*output = strdup(out);
+		updated++;
+		if (changed) {
+			if (snap->what == SNAPSHOT_HOSTS)
+				report_host(node, host_ary[id[i]]);
+			else
+				report_service(node, service_ary[id[i]]);
+		}
+next:
+		out = next + 1;
+	}
+
+	linfo("RESYNC: Applied %u of %u %s states from %s", updated, count,
+	      snap->what == SNAPSHOT_HOSTS ? "host" : "service", node->name);
+	return updated;
+}
@@ -0,0 +1,36 @@
+#ifndef INCLUDE_snapshot_h__
+#define INCLUDE_snapshot_h__
+
+#include "node.h"
+
+/*
+ * State snapshots let a peer that has been away for a long time catch
+ * up on the current state of all our objects in one go, instead of
+ * having every intermediate state replayed from its backlog.
+ */
+
+/**
+ * Called when "node" has told us how much it's willing to receive
+ * after (re)connecting. Sends it a snapshot if its backlog has been
+ * lost or has grown larger than the snapshot would be.
+ * @param node The node that just granted us credit
+ */
+extern void snapshot_check(merlin_node *node);
+
+/**
+ * Send a snapshot of all objects we've checked to a node, and arrange for
+ * the state events in its backlog to be skipped
+ * @param node The node to send to
+ * @return 0 on success, < 0 on errors
+ */
+extern int snapshot_send(merlin_node *node);
+
+/**
+ * Apply a CTRL_SNAPSHOT packet received from a node
+ * @param node The node that sent the snapshot
+ * @param pkt The packet
+ * @return The number of objects updated, or < 0 on errors
+ */
+extern int snapshot_apply(merlin_node *node, merlin_event *pkt);
+
+#endif
@@ -8,6 +8,7 @@
 
 int db_log_reports = 1;
 int db_log_notifications = 1;
+int db_log_rollups = 0;
 merlin_confsync global_csync;
 
 /* This lets the module build without database stuff linked in */
@@ -32,6 +33,8 @@ void grok_db_compound(struct cfg_comp *c)
 		struct cfg_var *v = c->vlist[vi];
 		if (!strcmp(v->key, "log_report_data")) {
 			db_log_reports = strtobool(v->value);
+		} else if (!strcmp(v->key, "log_report_rollups")) {
+			db_log_rollups = strtobool(v->value);
 		} else if (!prefixcmp(v->key, "log_notification")) {
 			db_log_notifications = strtobool(v->value);
 		} else if (!prefixcmp(v->key, "track_current")) {
@@ -92,6 +95,12 @@ static int grok_binlog_var(const char *key, const char *value)
 		return 1;
 	}
 
+	/* backlogged events sent for every new event while draining */
+	if (!strcmp(key, "binlog_drain_ratio")) {
+		binlog_drain_ratio = (unsigned int)strtoul(value, NULL, 10);
+		return 1;
+	}
+
 	return 0;
 }
 
@@ -108,6 +117,29 @@ int grok_common_var(struct cfg_comp *config, struct cfg_var *v)
 		return 1;
 	}
 
+	/*
+	 * how many bytes of events a peer may send us before it has to
+	 * wait for us to catch up. 0 disables flow control
+	 */
+	if (!strcmp(v->key, "flow_control_window")) {
+		char *endp;
+
+		flow_control_window = (unsigned)strtoul(v->value, &endp, 10);
+		if (*endp == 'k' || *endp == 'K')
+			flow_control_window <<= 10;
+		else if (*endp == 'm' || *endp == 'M')
+			flow_control_window <<= 20;
+		else if (*endp)
+			cfg_error(config, v, "Illegal flow_control_window");
+
+		/* anything smaller than two packets could stall us forever */
+		if (flow_control_window && flow_control_window < 2 * PKT_SIZE) {
+			flow_control_window = 2 * PKT_SIZE;
+			cfg_warn(config, v, "flow_control_window too small. Using %u", flow_control_window);
+		}
+		return 1;
+	}
+
 	expires = config_key_expires(v->key);
 	if (expires) {
 		cfg_warn(config, v, "'%s' is a deprecated variable, scheduled for "
@@ -10,6 +10,7 @@
 
 extern int db_log_reports;
 extern int db_log_notifications;
+extern int db_log_rollups;
 extern merlin_confsync global_csync;
 
 int grok_confsync_compound(struct cfg_comp *comp, merlin_confsync *csync);
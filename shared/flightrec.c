@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include "flightrec.h"
+#include "shared.h"
+#include "node.h"
+
+static const char *fr_outcome[] = { "sent", "binlogged", "dropped", "received" };
+
+void flightrec_add(struct flightrec *fr, const merlin_event *pkt, int dir, int outcome)
+{
+	struct flightrec_entry *e = &fr->entry[fr->pos & (FLIGHTREC_SIZE - 1)];
+
+	gettimeofday(&e->when, NULL);
+	e->sent = pkt->hdr.sent;
+	e->len = pkt->hdr.len;
+	e->type = pkt->hdr.type;
+	e->code = pkt->hdr.code;
+	e->selection = pkt->hdr.selection;
+	e->dir = dir;
+	e->outcome = outcome;
+
+	/* the entry must be complete before a reader can see it */
+	__sync_synchronize();
+	fr->pos++;
+}
+
+int flightrec_dump(const struct flightrec *fr, const char *name, int fd)
+{
+	uint64_t i, end = fr->pos;
+	char buf[256];
+
+	i = end > FLIGHTREC_SIZE ? end - FLIGHTREC_SIZE : 0;
+	for (; i < end; i++) {
+		const struct flightrec_entry *e = &fr->entry[i & (FLIGHTREC_SIZE - 1)];
+		const char *type;
+		int len;
+
+		if (e->type == CTRL_PACKET)
+			type = ctrl_name(e->code);
+		else
+			type = callback_name(e->type);
+
+		len = snprintf(buf, sizeof(buf),
+		               "node=%s;seq=%llu;when=%lu.%06lu;dir=%s;type=%s;code=%u;"
+		               "selection=%u;len=%u;sent=%lu.%06lu;outcome=%s\n",
+		               name, (unsigned long long)i,
+		               (unsigned long)e->when.tv_sec, (unsigned long)e->when.tv_usec,
+		               e->dir == FR_IN ? "in" : "out", type, e->code,
+		               e->selection, e->len,
+		               (unsigned long)e->sent.tv_sec, (unsigned long)e->sent.tv_usec,
+		               e->outcome < ARRAY_SIZE(fr_outcome) ? fr_outcome[e->outcome] : "unknown");
+		if (len < 0)
+			continue;
+		if (len >= (int)sizeof(buf))
+			len = sizeof(buf) - 1;
+		if (write(fd, buf, len) != len)
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef INCLUDE_flightrec_h__
+#define INCLUDE_flightrec_h__
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/**
+ * @file flightrec.h
+ * @brief per-node packet flight recorder
+ *
+ * Every packet we send, queue, drop or receive for a node leaves a
+ * small record in a fixed-size ring attached to the node. The ring
+ * only has one writer (the thread that owns the node) and readers
+ * never modify it, so recording is a handful of stores and dumping
+ * it is safe from anywhere, including a crash handler.
+ * @{
+ */
+
+#define FLIGHTREC_SIZE 256 /* must be a power of 2 */
+
+/* directions */
+#define FR_OUT 0
+#define FR_IN  1
+
+/* outcomes */
+#define FR_SENT      0
+#define FR_BINLOGGED 1
+#define FR_DROPPED   2
+#define FR_RECEIVED  3
+
+struct flightrec_entry {
+	struct timeval when;    /* when we recorded it */
+	struct timeval sent;    /* hdr.sent of the packet */
+	uint32_t len;
+	uint16_t type;
+	uint16_t code;
+	uint16_t selection;
+	uint8_t dir;
+	uint8_t outcome;
+};
+
+struct flightrec {
+	volatile uint64_t pos;  /* total number of records written */
+	struct flightrec_entry entry[FLIGHTREC_SIZE];
+};
+
+struct merlin_event;
+
+/**
+ * Record a packet in a flight recorder
+ * @param fr The flight recorder
+ * @param pkt The packet
+ * @param dir FR_OUT or FR_IN
+ * @param outcome What happened to the packet
+ */
+extern void flightrec_add(struct flightrec *fr, const struct merlin_event *pkt, int dir, int outcome);
+
+/**
+ * Write the contents of a flight recorder to a file descriptor,
+ * oldest record first. Only uses snprintf() and write(), so it's
+ * usable from a signal handler in a pinch.
+ * @param fr The flight recorder
+ * @param name Name of the node it belongs to
+ * @param fd Where to write it
+ * @return 0 on success, -1 on write errors
+ */
+extern int flightrec_dump(const struct flightrec *fr, const char *name, int fd);
+
+/** @} */
+#endif
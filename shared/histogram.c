@@ -0,0 +1,75 @@
+#include <string.h>
+#include "histogram.h"
+
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+static unsigned int bucket_index(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < HIST_SUB_COUNT)
+		return (unsigned int)value;
+
+	if (value >> HIST_MAX_BITS)
+		value = (1ULL << HIST_MAX_BITS) - 1;
+
+	msb = 63 - __builtin_clzll(value);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+		((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+/* the highest value that would end up in bucket "idx" */
+static uint64_t bucket_limit(unsigned int idx)
+{
+	unsigned int msb;
+	uint64_t lower;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+
+	msb = (idx >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	lower = (1ULL << msb) | ((uint64_t)(idx & (HIST_SUB_COUNT - 1)) << (msb - HIST_SUB_BITS));
+	return lower + (1ULL << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void histogram_add(histogram *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->bucket[bucket_index(value)]++;
+}
+
+uint64_t histogram_percentile(const histogram *h, double pct)
+{
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (uint64_t)((h->count * pct) / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= target) {
+			uint64_t limit = bucket_limit(i);
+			return limit < h->max ? limit : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+uint64_t histogram_mean(const histogram *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+void histogram_reset(histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,60 @@
+#ifndef INCLUDE_histogram_h__
+#define INCLUDE_histogram_h__
+
+#include <stdint.h>
+
+/**
+ * @file histogram.h
+ * @brief fixed-size log-linear histograms
+ *
+ * Values are sorted into buckets by their most significant bit,
+ * and each power of two is split into 1 << HIST_SUB_BITS linear
+ * sub-buckets. That keeps the relative error of any percentile
+ * below 25% while the whole thing fits in a couple of kilobytes,
+ * so histograms can be embedded in other structures without any
+ * allocations and updated from the hot path.
+ * @{
+ */
+
+#define HIST_SUB_BITS 2
+#define HIST_MAX_BITS 40 /* in microseconds, that's about 12 days */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t bucket[HIST_BUCKETS];
+};
+typedef struct histogram histogram;
+
+/**
+ * Record one value in a histogram
+ * @param h The histogram
+ * @param value The value to record
+ */
+extern void histogram_add(histogram *h, uint64_t value);
+
+/**
+ * Get (an upper bound of) the given percentile of recorded values
+ * @param h The histogram
+ * @param pct Percentile to get, 0 - 100
+ * @return The value at the given percentile, or 0 if h is empty
+ */
+extern uint64_t histogram_percentile(const histogram *h, double pct);
+
+/**
+ * Get the mean of recorded values
+ * @param h The histogram
+ * @return The mean, or 0 if h is empty
+ */
+extern uint64_t histogram_mean(const histogram *h);
+
+/**
+ * Forget all recorded values
+ * @param h The histogram to reset
+ */
+extern void histogram_reset(histogram *h);
+
+/** @} */
+#endif
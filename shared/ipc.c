@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <libgen.h>
 
@@ -7,11 +8,39 @@
 #include "ipc.h"
 #include "io.h"
 #include "node.h"
+#include "shmring.h"
 
 static int listen_sock = -1; /* for bind() and such */
 static char *ipc_sock_path;
 merlin_node ipc; /* the ipc node */
 
+/*
+ * Optional shared memory transport for module->daemon events.
+ * Negotiation happens over the ipc socket with CTRL_SHMRING packets:
+ *   module -> daemon: OFFER, with the ring's fds attached
+ *   daemon -> module: ACK, with size 0 if the daemon refuses
+ *   module -> daemon: COMMIT, the last event sent over the socket
+ * The daemon doesn't read from the ring until it has seen COMMIT,
+ * so events are always processed in the order they were sent.
+ * Traffic from the daemon to the module stays on the socket.
+ */
+#define IPC_SHM_OFF     0
+#define IPC_SHM_OFFERED 1
+#define IPC_SHM_ACTIVE  2
+
+#define IPC_SHM_STAGE_OFFER  1
+#define IPC_SHM_STAGE_ACK    2
+#define IPC_SHM_STAGE_COMMIT 3
+struct ipc_shm_msg {
+	uint32_t stage;
+	uint32_t size;
+};
+
+static unsigned int ipc_shm_size; /* 0 means the ring is disabled */
+static int ipc_shm_state = IPC_SHM_OFF;
+static shmring *ipc_ring;
+static int ipc_shm_fds[2] = { -1, -1 }; /* received, but not yet attached */
+
 /*
  * this lives here since both daemon and module needs it, but
  * none of the apps should have it
@@ -57,7 +86,16 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 "csync_num_attempts=%d;csync_max_attempts=%d;"
 				 "csync_last_attempt=%lu;"
 				 "csync_push_cmd=%s;csync_push_is_running=%d;"
-				 "csync_fetch_cmd=%s;csync_fetch_is_running=%d"
+				 "csync_fetch_cmd=%s;csync_fetch_is_running=%d;"
+				 "flow_sent=%llu;flow_limit=%llu;flow_consumed=%llu;"
+				 "flow_granted=%llu;flow_stalls=%u;"
+				 "rtt=%lld;clock_offset=%lld;rtt_samples=%llu;"
+				 "rtt_p50=%llu;rtt_p99=%llu;rtt_max=%llu;"
+				 "event_age_samples=%llu;event_age_p50=%llu;"
+				 "event_age_p99=%llu;event_age_max=%llu;"
+				 "events_filtered=%llu;bytes_filtered=%llu;"
+				 "phi=%.2f;suspect=%d;pulse_samples=%u;"
+				 "inbound_peak=%lu;inbound_deferred=%llu"
 				 "\n",
 				 instance_id,
 				 n->name, n->source_name, n->sock, node_type(n),
@@ -90,7 +128,22 @@ int dump_nodeinfo(merlin_node *n, int sd, int instance_id)
 				 n->csync_num_attempts, n->csync_max_attempts,
 				 n->csync_last_attempt,
 				 n->csync.push.cmd ? n->csync.push.cmd : "", n->csync.push.is_running,
-				 n->csync.fetch.cmd ? n->csync.fetch.cmd : "", n->csync.fetch.is_running
+				 n->csync.fetch.cmd ? n->csync.fetch.cmd : "", n->csync.fetch.is_running,
+				 (unsigned long long)n->flow.sent, (unsigned long long)n->flow.limit,
+				 (unsigned long long)n->flow.consumed, (unsigned long long)n->flow.granted,
+				 n->flow.stalls,
+				 (long long)n->link.rtt, (long long)n->link.clock_offset,
+				 (unsigned long long)n->link.rtt_hist.count,
+				 (unsigned long long)histogram_percentile(&n->link.rtt_hist, 50),
+				 (unsigned long long)histogram_percentile(&n->link.rtt_hist, 99),
+				 (unsigned long long)n->link.rtt_hist.max,
+				 (unsigned long long)n->link.age_hist.count,
+				 (unsigned long long)histogram_percentile(&n->link.age_hist, 50),
+				 (unsigned long long)histogram_percentile(&n->link.age_hist, 99),
+				 (unsigned long long)n->link.age_hist.max,
+				 s->events.filtered, s->bytes.filtered,
+				 n->liveness.phi, n->liveness.suspect, n->liveness.count,
+				 n->inbound.peak, n->inbound.deferred
 				);
 	return 0;
 }
@@ -136,6 +189,7 @@ int ipc_accept(void)
 	if (ipc.sock != -1) {
 		lwarn("New connection inbound when one already exists. Dropping old");
 		close(ipc.sock);
+		ipc_shm_close();
 	}
 
 	ipc.sock = accept(listen_sock, (struct sockaddr *)&saun, &slen);
@@ -190,6 +244,25 @@ int ipc_grok_var(char *var, char *val)
 	if (!strcmp(var, "ipc_socket"))
 		return !ipc_set_sock_path(val);
 
+	if (!strcmp(var, "ipc_shm_size")) {
+		char *endp;
+
+		ipc_shm_size = strtoul(val, &endp, 0);
+		switch (*endp) {
+		case 'k': case 'K':
+			ipc_shm_size <<= 10;
+			break;
+		case 'm': case 'M':
+			ipc_shm_size <<= 20;
+			break;
+		case 0:
+			break;
+		default:
+			return 0;
+		}
+		return 1;
+	}
+
 	if (!strcmp(var, "ipc_binlog")) {
 		lwarn("%s is deprecated. The name will always be computed.", var);
 		lwarn("   Set binlog_dir to control where the file will be created");
@@ -344,6 +417,326 @@ int ipc_listen_sock_desc(void)
 	return listen_sock;
 }
 
+void ipc_shm_close(void)
+{
+	if (ipc_ring) {
+		linfo("ipc: Closing shared memory transport");
+		shmring_destroy(ipc_ring);
+		ipc_ring = NULL;
+	}
+	if (ipc_shm_fds[0] >= 0)
+		close(ipc_shm_fds[0]);
+	if (ipc_shm_fds[1] >= 0)
+		close(ipc_shm_fds[1]);
+	ipc_shm_fds[0] = ipc_shm_fds[1] = -1;
+	ipc_shm_state = IPC_SHM_OFF;
+}
+
+static int ipc_shm_msg_send(uint32_t stage, uint32_t size)
+{
+	struct ipc_shm_msg msg = { stage, size };
+
+	return node_ctrl(&ipc, CTRL_SHMRING, CTRL_GENERIC, &msg, sizeof(msg));
+}
+
+/*
+ * Offer the daemon a ring to read events from. The ring's file
+ * descriptors travel as ancillary data with the OFFER packet.
+ */
+int ipc_shm_offer(void)
+{
+	merlin_event pkt;
+	struct ipc_shm_msg *msg = (struct ipc_shm_msg *)pkt.body;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	int fds[2], sent;
+
+	if (!is_module || !ipc_shm_size || ipc.sock < 0 || ipc_shm_state != IPC_SHM_OFF)
+		return 0;
+
+	if (!(ipc_ring = shmring_create(ipc_shm_size))) {
+		lwarn("ipc: Failed to create shared memory ring. Using the socket");
+		return -1;
+	}
+
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.sig.id = MERLIN_SIGNATURE;
+	pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	gettimeofday(&pkt.hdr.sent, NULL);
+	pkt.hdr.type = CTRL_PACKET;
+	pkt.hdr.code = CTRL_SHMRING;
+	pkt.hdr.len = sizeof(*msg);
+	msg->stage = IPC_SHM_STAGE_OFFER;
+	msg->size = shmring_size(ipc_ring);
+
+	iov.iov_base = &pkt;
+	iov.iov_len = packet_size(&pkt);
+	memset(&mh, 0, sizeof(mh));
+	memset(&ctl, 0, sizeof(ctl));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	fds[0] = shmring_fd(ipc_ring);
+	fds[1] = shmring_event_fd(ipc_ring);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	sent = sendmsg(ipc.sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (sent != packet_size(&pkt)) {
+		node_disconnect(&ipc, "Failed to send shared memory offer (sent=%d): %s",
+		                sent, strerror(errno));
+		return -1;
+	}
+
+	ipc.stats.bytes.sent += sent;
+	ipc_shm_state = IPC_SHM_OFFERED;
+	ldebug("ipc: Offered %s shared memory ring", human_bytes(msg->size));
+	return 0;
+}
+
+/*
+ * Handle a CTRL_SHMRING packet. Called by both module and daemon.
+ */
+int ipc_shm_ctrl(merlin_event *pkt)
+{
+	struct ipc_shm_msg *msg = (struct ipc_shm_msg *)pkt->body;
+
+	if (pkt->hdr.len < sizeof(*msg)) {
+		lerr("ipc: Short CTRL_SHMRING packet (%u bytes)", pkt->hdr.len);
+		return -1;
+	}
+
+	switch (msg->stage) {
+	case IPC_SHM_STAGE_OFFER:
+		if (is_module)
+			break;
+		if (ipc_ring) {
+			shmring_destroy(ipc_ring);
+			ipc_ring = NULL;
+		}
+		if (ipc_shm_fds[0] < 0) {
+			/* the fds got lost somewhere. refuse, but carry on */
+			lwarn("ipc: Shared memory offered without file descriptors");
+			return ipc_shm_msg_send(IPC_SHM_STAGE_ACK, 0);
+		}
+		/* the ring owns the fds from here on */
+		ipc_ring = shmring_attach(ipc_shm_fds[0], ipc_shm_fds[1]);
+		if (!ipc_ring) {
+			ipc_shm_close();
+			return ipc_shm_msg_send(IPC_SHM_STAGE_ACK, 0);
+		}
+		ipc_shm_fds[0] = ipc_shm_fds[1] = -1;
+		ipc_shm_state = IPC_SHM_OFFERED;
+		return ipc_shm_msg_send(IPC_SHM_STAGE_ACK, shmring_size(ipc_ring));
+
+	case IPC_SHM_STAGE_ACK:
+		if (!is_module || ipc_shm_state != IPC_SHM_OFFERED)
+			break;
+		if (!msg->size) {
+			lwarn("ipc: Daemon refused shared memory transport. Using the socket");
+			ipc_shm_close();
+			return 0;
+		}
+		if (ipc_shm_msg_send(IPC_SHM_STAGE_COMMIT, msg->size) < 0) {
+			ipc_shm_close();
+			return -1;
+		}
+		ipc_shm_state = IPC_SHM_ACTIVE;
+		linfo("ipc: Using %s shared memory ring for events to the daemon",
+		      human_bytes(shmring_size(ipc_ring)));
+		ipc_shm_flush();
+		return 0;
+
+	case IPC_SHM_STAGE_COMMIT:
+		if (is_module || ipc_shm_state != IPC_SHM_OFFERED)
+			break;
+		ipc_shm_state = IPC_SHM_ACTIVE;
+		linfo("ipc: Module switched to shared memory transport");
+		return 0;
+	}
+
+	lwarn("ipc: Unexpected CTRL_SHMRING stage %u in state %d", msg->stage, ipc_shm_state);
+	return -1;
+}
+
+/*
+ * Moves as much of the module's backlog into the ring as will fit.
+ * Called before each new event, right after the ring is committed
+ * and periodically, so a backlog left over from before a reconnect
+ * doesn't have to wait for new events to push it along. Returns the
+ * number of events still in the backlog.
+ */
+unsigned int ipc_shm_flush(void)
+{
+	merlin_event *temp_pkt;
+	unsigned int len;
+
+	if (ipc_shm_state != IPC_SHM_ACTIVE || !is_module)
+		return 0;
+
+	while (binlog_has_entries(ipc.binlog) && !binlog_read(ipc.binlog, (void **)&temp_pkt, &len)) {
+		if (shmring_push(ipc_ring, temp_pkt, len) < 0) {
+			if (binlog_unread(ipc.binlog, temp_pkt, len))
+				free(temp_pkt);
+			break;
+		}
+		flightrec_add(&ipc.flightrec, temp_pkt, FR_OUT, FR_SENT);
+		ipc.stats.events.sent++;
+		ipc.stats.bytes.sent += len;
+		ipc.stats.events.logged--;
+		ipc.stats.bytes.logged -= len;
+		free(temp_pkt);
+	}
+
+	return binlog_num_entries(ipc.binlog);
+}
+
+/*
+ * Module side of the ring. Anything we can't fit goes to the binlog,
+ * and the binlog is emptied into the ring before new events are
+ * added so ordering is preserved.
+ */
+int ipc_shm_send(merlin_event *pkt)
+{
+	pkt->hdr.sig.id = MERLIN_SIGNATURE;
+	pkt->hdr.protocol = MERLIN_PROTOCOL_VERSION;
+
+	if (packet_size(pkt) > MAX_PKT_SIZE) {
+		lerr("Error in communication with %s: header is invalid, or packet is too large. aborting", ipc.name);
+		return -1;
+	}
+
+	if (ipc_shm_flush() || shmring_push(ipc_ring, pkt, packet_size(pkt)) < 0)
+		return node_binlog_add(&ipc, pkt) < 0 ? -1 : 0;
+
+	flightrec_add(&ipc.flightrec, pkt, FR_OUT, FR_SENT);
+	ipc.stats.events.sent++;
+	ipc.stats.bytes.sent += packet_size(pkt);
+	if (pkt->hdr.type < ARRAY_SIZE(ipc.stats.cb_count))
+		ipc.stats.cb_count[pkt->hdr.type].out++;
+	ipc.last_action = ipc.last_sent = pkt->hdr.sent.tv_sec;
+
+	return 0;
+}
+
+/*
+ * Daemon side. We use recvmsg() rather than read() so we can pick up
+ * the file descriptors that come along with a CTRL_SHMRING offer.
+ */
+int ipc_recv(void)
+{
+	char buf[64 << 10];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	int len;
+
+	if (ipc.sock < 0)
+		return -1;
+
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+
+	len = recvmsg(ipc.sock, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (len > 0) {
+		for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			if (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+				continue;
+			ipc_shm_close();
+			memcpy(ipc_shm_fds, CMSG_DATA(cmsg), sizeof(ipc_shm_fds));
+		}
+		if (nm_bufferqueue_push(ipc.bq, buf, len)) {
+			lerr("ipc: Failed to queue %d bytes of input", len);
+			return -1;
+		}
+		ipc.last_action = ipc.last_recv = time(NULL);
+		ipc.stats.bytes.read += len;
+		return len;
+	}
+
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	if (len < 0)
+		lerr("Failed to read from ipc socket %d: %s", ipc.sock, strerror(errno));
+	node_disconnect(&ipc, "recvmsg() returned %d", len);
+	return -1;
+}
+
+/*
+ * Daemon side. Moves whatever the module has put in the ring to the
+ * ipc bufferqueue, where node_get_event() will find it.
+ */
+int ipc_shm_drain(void)
+{
+	int len;
+
+	if (ipc_shm_state != IPC_SHM_ACTIVE || is_module)
+		return 0;
+
+	len = shmring_drain(ipc_ring, ipc.bq);
+	if (len < 0) {
+		node_disconnect(&ipc, "Shared memory ring is corrupt");
+		return -1;
+	}
+	if (len > 0) {
+		ipc.last_action = ipc.last_recv = time(NULL);
+		ipc.stats.bytes.read += len;
+	}
+
+	return len;
+}
+
+/* bytes the module has put in the ring that we haven't read yet */
+unsigned int ipc_shm_pending(void)
+{
+	if (ipc_shm_state != IPC_SHM_ACTIVE || is_module)
+		return 0;
+
+	return shmring_used(ipc_ring);
+}
+
+/*
+ * Returns the fd the daemon should poll for ring input, or -1 if
+ * there is none. If *pending is set on return, there's already data
+ * waiting and the caller mustn't block.
+ */
+int ipc_shm_wait_fd(int *pending)
+{
+	*pending = 0;
+	if (ipc_shm_state != IPC_SHM_ACTIVE || is_module)
+		return -1;
+
+	*pending = shmring_prepare_wait(ipc_ring) > 0;
+	return shmring_event_fd(ipc_ring);
+}
+
+void ipc_shm_wakeup(void)
+{
+	if (ipc_ring)
+		shmring_finish_wait(ipc_ring);
+}
+
 /*
  * Sends a control packet to ipc, making sure it's connected
  * first. If data isn't null, len bytes is copied from it to
@@ -363,6 +756,9 @@ int ipc_send_event(merlin_event *pkt)
 	if (is_module)
 		gettimeofday(&pkt->hdr.sent, NULL);
 
+	if (ipc_shm_state == IPC_SHM_ACTIVE && is_module)
+		return ipc_shm_send(pkt);
+
 	if (node_send_event(&ipc, pkt, 0) < 0) {
 		return -1;
 	}
@@ -21,6 +21,16 @@ extern int ipc_is_connected(int msec);
 extern int ipc_reinit(void);
 extern int ipc_accept(void);
 extern void ipc_log_event_count(void);
+extern int ipc_recv(void);
+extern int ipc_shm_offer(void);
+extern int ipc_shm_ctrl(merlin_event *pkt);
+extern int ipc_shm_send(merlin_event *pkt);
+extern unsigned int ipc_shm_flush(void);
+extern int ipc_shm_drain(void);
+extern unsigned int ipc_shm_pending(void);
+extern int ipc_shm_wait_fd(int *pending);
+extern void ipc_shm_wakeup(void);
+extern void ipc_shm_close(void);
 
 #define ipc_send_ctrl(code, sel) ipc_ctrl(code, sel, NULL, 0)
 #endif /* INCLUDE_ipc_h__ */
@@ -2,11 +2,40 @@
 #include "shared.h"
 
 #include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
 
 static FILE *merlin_log_fp;
 static char *merlin_log_file;
 static int log_to_syslog = 0;
-static int log_levels = (1 << LOG_ERR) | (1 << LOG_WARNING) | (1 << LOG_INFO);
+int log_levels = (1 << LOG_ERR) | (1 << LOG_WARNING) | (1 << LOG_INFO);
+
+/*
+ * With log_async enabled, formatted messages are put in a ring and a
+ * background thread writes them to the logfile, so a slow disk can't
+ * stall Naemon or the daemon's main loop. Producers reserve slots
+ * with a compare-and-swap on "head" and mark them ready when they're
+ * filled in, so the ring is safe to use from several threads without
+ * locking. If the writer can't keep up we drop messages rather than
+ * block, and say how many we dropped once there's room again.
+ */
+#define LOG_RING_SLOTS 1024
+#define LOG_MSG_MAX 4096 /* longest message we log, with the nul byte */
+struct log_slot {
+	volatile int ready;
+	int severity;
+	time_t when;
+	char msg[LOG_MSG_MAX];
+};
+static int log_async;
+static struct log_slot *log_ring;
+static volatile unsigned long log_head, log_tail;
+static volatile unsigned long log_dropped;
+static volatile int log_writer_stop;
+static pid_t log_writer_pid; /* threads don't survive fork() */
+static pthread_t log_writer;
+static sem_t log_sem;
 
 int log_grok_var(char *var, char *val)
 {
@@ -57,6 +86,11 @@ int log_grok_var(char *var, char *val)
 		return 1;
 	}
 
+	if (!strcmp(var, "log_async")) {
+		log_async = strtobool(val);
+		return 1;
+	}
+
 	if (!strcmp(var, "log_file")) {
 		merlin_log_file = strdup(val);
 		if (debug)
@@ -67,8 +101,134 @@ int log_grok_var(char *var, char *val)
 	return 0;
 }
 
+static void log_write(int severity, time_t when, const char *msg)
+{
+	fprintf(merlin_log_fp, "[%lu] %d: %s\n", when, severity, msg);
+	/*
+	 * systems where logging matters (a lot) can specify
+	 * MERLIN_FLUSH_LOGFILES as CPPFLAGS when building
+	 */
+	fflush(merlin_log_fp);
+#ifdef MERLIN_FLUSH_LOGFILES
+	fsync(fileno(merlin_log_fp));
+#endif
+}
+
+/* write out everything that's ready, in order */
+static void log_ring_flush(void)
+{
+	unsigned long dropped;
+
+	while (log_tail != log_head) {
+		struct log_slot *slot = &log_ring[log_tail % LOG_RING_SLOTS];
+
+		/* reserved, but the producer isn't done with it yet */
+		if (!slot->ready)
+			break;
+		__sync_synchronize();
+		log_write(slot->severity, slot->when, slot->msg);
+		slot->ready = 0;
+		__sync_synchronize();
+		log_tail++;
+	}
+
+	if ((dropped = log_dropped)) {
+		char msg[100];
+
+		__sync_fetch_and_sub(&log_dropped, dropped);
+		snprintf(msg, sizeof(msg), "Log writer fell behind. %lu messages dropped", dropped);
+		log_write(LOG_WARNING, time(NULL), msg);
+	}
+}
+
+static void *log_writer_main(void *discard)
+{
+	while (!log_writer_stop) {
+		sem_wait(&log_sem);
+		log_ring_flush();
+	}
+	log_ring_flush();
+	return NULL;
+}
+
+static int log_writer_start(void)
+{
+	if (!log_ring && !(log_ring = calloc(LOG_RING_SLOTS, sizeof(*log_ring))))
+		return -1;
+
+	log_head = log_tail = log_dropped = 0;
+	log_writer_stop = 0;
+	if (sem_init(&log_sem, 0, 0) < 0)
+		return -1;
+	if (pthread_create(&log_writer, NULL, log_writer_main, NULL)) {
+		sem_destroy(&log_sem);
+		return -1;
+	}
+	log_writer_pid = getpid();
+	return 0;
+}
+
+static void log_writer_shutdown(void)
+{
+	if (!log_writer_pid || log_writer_pid != getpid())
+		return;
+
+	log_writer_stop = 1;
+	sem_post(&log_sem);
+	pthread_join(log_writer, NULL);
+	sem_destroy(&log_sem);
+	log_writer_pid = 0;
+}
+
+/* returns 0 if the message was queued for the writer thread */
+static int log_ring_add(int severity, const char *msg)
+{
+	struct log_slot *slot;
+	unsigned long head;
+	size_t len;
+
+	if (log_writer_pid != getpid() && log_writer_start() < 0)
+		return -1;
+
+	do {
+		head = log_head;
+		if (head - log_tail >= LOG_RING_SLOTS) {
+			__sync_fetch_and_add(&log_dropped, 1);
+			return 0;
+		}
+	} while (!__sync_bool_compare_and_swap(&log_head, head, head + 1));
+
+	slot = &log_ring[head % LOG_RING_SLOTS];
+	slot->severity = severity;
+	slot->when = time(NULL);
+	/* strncpy() would pad every message to the full slot size */
+	len = strlen(msg);
+	if (len >= sizeof(slot->msg))
+		len = sizeof(slot->msg) - 1;
+	memcpy(slot->msg, msg, len);
+	slot->msg[len] = 0;
+	__sync_synchronize();
+	slot->ready = 1;
+	sem_post(&log_sem);
+	return 0;
+}
+
+/*
+ * Forked children that leave through _exit() never stop the writer,
+ * so whatever they queued would be lost, and a writer started on the
+ * ring copied from the parent would write the parent's pending
+ * messages a second time. They log synchronously instead.
+ */
+void log_forked(void)
+{
+	log_async = 0;
+}
+
 void log_deinit(void)
 {
+	log_writer_shutdown();
+	safe_free(log_ring);
+
 	if (log_to_syslog && !is_module)
 		closelog();
 
@@ -113,10 +273,14 @@ void log_msg(int severity, const char *fmt, ...)
 {
 	va_list ap;
 	int len;
-	char msg[4096];
+	char msg[LOG_MSG_MAX];
 
-	/* return early if we shouldn't log stuff of this severity */
-	if (!((1 << severity) & log_levels)) {
+	/*
+	 * return early if we shouldn't log stuff of this severity.
+	 * The logging macros check this already, but there may be
+	 * direct callers
+	 */
+	if (!log_enabled(severity)) {
 		return;
 	}
 
@@ -147,14 +311,8 @@ void log_msg(int severity, const char *fmt, ...)
 
 	/* only print to log if it's something else than 'stdout' */
 	if (merlin_log_fp) {
-		fprintf(merlin_log_fp, "[%lu] %d: %s\n", time(NULL), severity, msg);
-		/*
-		 * systems where logging matters (a lot) can specify
-		 * MERLIN_FLUSH_LOGFILES as CPPFLAGS when building
-		 */
-		fflush(merlin_log_fp);
-#ifdef MERLIN_FLUSH_LOGFILES
-		fsync(fileno(merlin_log_fp));
-#endif
+		if (log_async && !log_ring_add(severity, msg))
+			return;
+		log_write(severity, time(NULL), msg);
 	}
 }
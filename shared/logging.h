@@ -4,28 +4,66 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <time.h>
+
+/*
+ * The level check is done in the macros, so the arguments of messages
+ * we won't log are never evaluated. That means it's fine to use things
+ * like tohex() and human_bytes() in debug messages on hot paths.
+ */
+extern int log_levels;
+#define log_enabled(severity) ((1 << (severity)) & log_levels)
 
 #ifdef DEBUG_LOGGING
-# define ldebug(fmt, args...) \
-	log_msg(LOG_DEBUG, "%s:%s():%d: " fmt, __FILE__, __func__, __LINE__, ##args)
-# define linfo(fmt, args...) \
-	log_msg(LOG_INFO, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
-# define lmsg(fmt, args...) \
-	log_msg(LOG_NOTICE, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
-# define lwarn(fmt, args...) \
-	log_msg(LOG_WARNING, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
-# define lerr(fmt, args...) \
-	log_msg(LOG_ERR, "%s:%s():%d " fmt, __FILE__, __func__, __LINE__, ##args)
+# define log_at(severity, fmt, args...) \
+	do { \
+		if (log_enabled(severity)) \
+			log_msg(severity, "%s:%s():%d: " fmt, __FILE__, __func__, __LINE__, ##args); \
+	} while (0)
 #else
-# define ldebug(fmt, args...) log_msg(LOG_DEBUG, fmt, ##args)
-# define linfo(fmt, args...) log_msg(LOG_INFO, fmt, ##args)
-# define lmsg(fmt, args...) log_msg(LOG_NOTICE, fmt, ##args)
-# define lwarn(fmt, args...) log_msg(LOG_WARNING, fmt, ##args)
-# define lerr(fmt, args...) log_msg(LOG_ERR, fmt, ##args)
+# define log_at(severity, fmt, args...) \
+	do { \
+		if (log_enabled(severity)) \
+			log_msg(severity, fmt, ##args); \
+	} while (0)
 #endif
 
+#define ldebug(fmt, args...) log_at(LOG_DEBUG, fmt, ##args)
+#define linfo(fmt, args...) log_at(LOG_INFO, fmt, ##args)
+#define lmsg(fmt, args...) log_at(LOG_NOTICE, fmt, ##args)
+#define lwarn(fmt, args...) log_at(LOG_WARNING, fmt, ##args)
+#define lerr(fmt, args...) log_at(LOG_ERR, fmt, ##args)
+
+/*
+ * Log at most one message every "secs" seconds from this call site.
+ * The number of messages that were suppressed in between is logged
+ * along with the next one that gets through.
+ */
+#define log_ratelimit(severity, secs, fmt, args...) \
+	do { \
+		static time_t rl_last__; \
+		static unsigned int rl_suppressed__; \
+		time_t rl_now__; \
+		if (!log_enabled(severity)) \
+			break; \
+		rl_now__ = time(NULL); \
+		if (rl_now__ - rl_last__ < (secs)) { \
+			rl_suppressed__++; \
+			break; \
+		} \
+		if (rl_suppressed__) \
+			log_at(severity, "(%u similar messages suppressed)", rl_suppressed__); \
+		log_at(severity, fmt, ##args); \
+		rl_last__ = rl_now__; \
+		rl_suppressed__ = 0; \
+	} while (0)
+
+#define lwarn_ratelimit(secs, fmt, args...) log_ratelimit(LOG_WARNING, secs, fmt, ##args)
+#define lerr_ratelimit(secs, fmt, args...) log_ratelimit(LOG_ERR, secs, fmt, ##args)
+
 extern int log_init(void);
 extern void log_deinit(void);
+extern void log_forked(void);
 extern int log_grok_var(char *var, char *val);
 extern void log_msg(int severity, const char *fmt, ...)
 	__attribute__((__format__(__printf__, 2, 3)));
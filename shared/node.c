@@ -5,6 +5,7 @@
 #include "io.h"
 #include "compat.h"
 #include <arpa/inet.h>
+#include <stdint.h>
 #include <string.h>
 #include <netdb.h>
 
@@ -15,6 +16,9 @@ static node_selection *selection_table;
 
 static void node_log_info(const merlin_node *node, const merlin_nodeinfo *info)
 {
+	if (!log_enabled(LOG_DEBUG))
+		return;
+
 	ldebug("Node info for %s", node->name);
 	ldebug("      version: %u", info->version);
 	ldebug("    word_size: %u", info->word_size);
@@ -152,6 +156,14 @@ node_selection *node_selection_by_name(const char *name)
 	return NULL;
 }
 
+node_selection *node_selection_by_id(int sel)
+{
+	if (sel < 0 || sel >= num_selections)
+		return NULL;
+
+	return &selection_table[sel];
+}
+
 merlin_node *node_by_id(uint id)
 {
 	if (num_nodes && id < num_nodes)
@@ -219,6 +231,7 @@ static int add_one_selection(char *name, merlin_node *node)
 {
 	int i;
 	node_selection *sel = NULL;
+	merlin_node **node_ary;
 
 	/*
 	 * strip trailing spaces. leading ones are stripped in
@@ -243,9 +256,20 @@ static int add_one_selection(char *name, merlin_node *node)
 		sel->id = num_selections;
 		sel->name = strdup(name);
 		sel->nodes = NULL;
+		sel->node_ary = NULL;
+		sel->node_count = 0;
 		num_selections++;
 	}
+	/* grow the array first, so a failure leaves the node in neither */
+	node_ary = realloc(sel->node_ary, sizeof(sel->node_ary[0]) * (sel->node_count + 1));
+	if (!node_ary) {
+		lerr("Failed to realloc(%zu): %s",
+		     sizeof(sel->node_ary[0]) * (sel->node_count + 1), strerror(errno));
+		return -1;
+	}
+	sel->node_ary = node_ary;
 	sel->nodes = add_linked_item(sel->nodes, node);
+	sel->node_ary[sel->node_count++] = node;
 
 	return sel->id;
 }
@@ -258,7 +282,8 @@ static int add_selection(char *name, merlin_node *node)
 		if ((comma = strchr(name, ','))) {
 			*comma = 0;
 		}
-		add_one_selection(name, node);
+		if (add_one_selection(name, node) < 0)
+			return -1;
 		if (!comma)
 			break;
 		name = comma + 1;
@@ -433,6 +458,29 @@ static int grok_node_flag(int *flags, const char *key, const char *value)
 	return 0;
 }
 
+/* parses "perf_data, long_plugin_output" and the like */
+static int grok_strip(const char *value, int *strip)
+{
+	char *buf, *p, *save = NULL;
+	int ret = 0;
+
+	*strip = 0;
+	if (!(buf = strdup(value)))
+		return -1;
+
+	for (p = strtok_r(buf, ", \t", &save); p; p = strtok_r(NULL, ", \t", &save)) {
+		if (!strcmp(p, "perf_data") || !strcmp(p, "perfdata"))
+			*strip |= STRIP_PERF_DATA;
+		else if (!strcmp(p, "long_plugin_output") || !strcmp(p, "long_output"))
+			*strip |= STRIP_LONG_OUTPUT;
+		else if (strcmp(p, "none"))
+			ret = -1;
+	}
+
+	free(buf);
+	return ret;
+}
+
 static void grok_node(struct cfg_comp *c, merlin_node *node)
 {
 	unsigned int i;
@@ -466,7 +514,8 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 
 		if (node->type != MODE_NOC && (!strcmp(v->key, "hostgroup") || !strcmp(v->key, "hostgroups"))) {
 			node->hostgroups = strdup(v->value);
-			sel_id = add_selection(v->value, node);
+			if ((sel_id = add_selection(v->value, node)) < 0)
+				cfg_error(c, v, "Failed to add node to its hostgroups\n");
 		}
 		else if (!strcmp(v->key, "address") || !strcmp(v->key, "host")) {
 			address = v->value;
@@ -483,6 +532,10 @@ static void grok_node(struct cfg_comp *c, merlin_node *node)
 			if (*endptr != 0)
 				cfg_error(c, v, "Illegal value for data_timeout: %s\n", v->value);
 		}
+		else if (!strcmp(v->key, "strip")) {
+			if (grok_strip(v->value, &node->strip) < 0)
+				cfg_error(c, v, "Illegal value for strip: %s\n", v->value);
+		}
 		else if (!strcmp(v->key, "max_sync_attempts")) {
 			/* restricting max sync attempts is a terrible idea, don't do anything */
 		}
@@ -654,6 +707,7 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 {
 	va_list ap;
 	char *reason = NULL;
+	int drain = node->sock >= 0 && node->drain;
 
 	if (node->state == STATE_CONNECTED)
 		node_log_event_count(node, 1);
@@ -661,6 +715,19 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	iobroker_close(nagios_iobs, node->sock);
 	node->sock = -1;
 
+	/* the shared memory transport only lives as long as the socket */
+	if (node == &ipc)
+		ipc_shm_close();
+
+	/*
+	 * The node considers everything we've read in full as sent, so
+	 * it won't resend any of it. Apply it before we drop the buffer
+	 * queue. The socket is closed by now, so nothing we do while
+	 * applying it can get us back here through a failed send.
+	 */
+	if (drain)
+		node->drain(node);
+
 	if (fmt) {
 		va_start(ap, fmt);
 		if (vasprintf(&reason, fmt, ap) < 0) {
@@ -673,6 +740,24 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 		free(reason);
 	node->last_recv = 0;
 
+	/* credit is per connection */
+	node->flow.sent = node->flow.limit = 0;
+	node->flow.consumed = node->flow.granted = 0;
+	node->flow.unblocked = 0;
+	node->link.rtt = node->link.clock_offset = 0;
+	node->latency = 0;
+	memset(&node->liveness, 0, sizeof(node->liveness));
+	node->inbound.epoch++;
+
+	/*
+	 * we may have skipped backlogged events on account of a snapshot
+	 * the node never got, so it needs a new one when it comes back
+	 */
+	if (node->resync_skip) {
+		node->resync |= RESYNC_LOST;
+		node->resync_skip = 0;
+	}
+
 	/* csync checks only run on reconnect if node->info isn't "identical", so reset it */
 	if (node != &ipc)
 		memset(&(node->info), 0, sizeof(node->info));
@@ -681,7 +766,7 @@ void node_disconnect(merlin_node *node, const char *fmt, ...)
 	node->bq = nm_bufferqueue_create();
 }
 
-static int node_binlog_add(merlin_node *node, merlin_event *pkt)
+int node_binlog_add(merlin_node *node, merlin_event *pkt)
 {
 	int result;
 
@@ -692,8 +777,10 @@ static int node_binlog_add(merlin_node *node, merlin_event *pkt)
 	 * trigger a lot of unnecessary actions if stashed.
 	 */
 	if (pkt->hdr.type == CTRL_PACKET) {
-		if (pkt->hdr.code == CTRL_ACTIVE || pkt->hdr.code == CTRL_INACTIVE)
+		if (pkt->hdr.code == CTRL_ACTIVE || pkt->hdr.code == CTRL_INACTIVE) {
+			flightrec_add(&node->flightrec, pkt, FR_OUT, FR_DROPPED);
 			return 0;
+		}
 	}
 
 	if (!node->binlog) {
@@ -721,9 +808,11 @@ static int node_binlog_add(merlin_node *node, merlin_event *pkt)
 	}
 
 	result = binlog_add(node->binlog, pkt, packet_size(pkt));
+	flightrec_add(&node->flightrec, pkt, FR_OUT, result < 0 ? FR_DROPPED : FR_BINLOGGED);
 	if (result < 0) {
 		binlog_wipe(node->binlog, BINLOG_UNLINK);
-		/* XXX should mark node as unsynced here */
+		node->resync |= RESYNC_LOST;
+		node->resync_skip = 0;
 		node->stats.events.dropped += node->stats.events.logged + 1;
 		node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
 		node->stats.events.logged = 0;
@@ -765,8 +854,14 @@ int node_recv(merlin_node *node)
 	 * input as it sees fit
 	 */
 	if (bytes_read > 0) {
+		struct merlin_liveness *l = &node->liveness;
+
 		node->last_action = node->last_recv = time(NULL);
 		node->stats.bytes.read += bytes_read;
+		l->received += bytes_read;
+		l->reads[l->read_next].end = l->received;
+		gettimeofday(&l->reads[l->read_next].when, NULL);
+		l->read_next = (l->read_next + 1) % LIVENESS_READS;
 		return bytes_read;
 	}
 
@@ -806,7 +901,7 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 	if (!node || node->sock < 0)
 		return 0;
 
-	if (len >= HDR_SIZE && pkt->hdr.type == CTRL_PACKET) {
+	if (log_enabled(LOG_DEBUG) && len >= HDR_SIZE && pkt->hdr.type == CTRL_PACKET) {
 		ldebug("Sending %s to %s", ctrl_name(pkt->hdr.code), node->name);
 		if (pkt->hdr.code == CTRL_ACTIVE) {
 			merlin_nodeinfo *info = (merlin_nodeinfo *)&pkt->body;
@@ -820,6 +915,8 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 	sent = io_send_all(node->sock, data, len);
 	/* success. Should be the normal case */
 	if (sent == (int)len) {
+		if (len >= HDR_SIZE)
+			flightrec_add(&node->flightrec, pkt, FR_OUT, FR_SENT);
 		node->stats.bytes.sent += sent;
 		node->last_action = node->last_sent = time(NULL);
 		return sent;
@@ -850,6 +947,61 @@ int node_send(merlin_node *node, void *data, unsigned int len, int flags)
 	return -1;
 }
 
+static int64_t tv_usec_delta(const struct timeval *start, const struct timeval *stop)
+{
+	return ((int64_t)stop->tv_sec - start->tv_sec) * 1000000 +
+		(stop->tv_usec - start->tv_usec);
+}
+
+/* when we read the packet we've parsed up to "parsed" bytes into */
+static void packet_arrival(const merlin_node *node, struct timeval *when)
+{
+	const struct merlin_liveness *l = &node->liveness;
+	unsigned int i;
+
+	/* oldest first. Reads we've forgotten about are just as late */
+	for (i = 0; i < LIVENESS_READS; i++) {
+		unsigned int slot = (l->read_next + i) % LIVENESS_READS;
+
+		if (l->reads[slot].when.tv_sec && l->reads[slot].end >= l->parsed) {
+			*when = l->reads[slot].when;
+			return;
+		}
+	}
+	gettimeofday(when, NULL);
+}
+
+/*
+ * Record the arrival of a periodic pulse from the node. Nodes only
+ * send pulses from their pulse timer, while CTRL_ACTIVE is also sent
+ * on (re)connects and whenever a node thinks we may have missed it,
+ * which would make the intervals look shorter than they are. The
+ * arrival time is when we read the pulse, since it may have had to
+ * wait behind lots of other events before we parsed it.
+ */
+static void node_heartbeat(merlin_node *node, merlin_event *pkt)
+{
+	struct merlin_liveness *l = &node->liveness;
+	struct merlin_pulse *pulse = (struct merlin_pulse *)pkt->body;
+	struct timeval when;
+
+	if (pkt->hdr.len < sizeof(*pulse) || pulse->echo)
+		return;
+
+	packet_arrival(node, &when);
+	if (l->last.tv_sec) {
+		int64_t delta = tv_usec_delta(&l->last, &when) / 1000;
+
+		if (delta >= 0) {
+			l->interval[l->next] = (uint32_t)delta;
+			l->next = (l->next + 1) % LIVENESS_SAMPLES;
+			if (l->count < LIVENESS_SAMPLES)
+				l->count++;
+		}
+	}
+	l->last = when;
+}
+
 /*
  * Fetch one event from the node's iocache. If the cache is
  * exhausted, we handle partial events and iocache resets and
@@ -887,6 +1039,11 @@ merlin_event *node_get_event(merlin_node *node)
 		return NULL;
 	}
 
+	flightrec_add(&node->flightrec, pkt, FR_IN, FR_RECEIVED);
+	node->liveness.parsed += HDR_SIZE + hdr.len;
+	if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_PULSE)
+		node_heartbeat(node, pkt);
+
 	/* debug log these transitions */
 	if (pkt->hdr.type == CTRL_PACKET && pkt->hdr.code == CTRL_ACTIVE) {
 		ldebug("CTRLEVENT: Received CTRL_ACTIVE from %s node %s", node_type(node), node->name);
@@ -896,6 +1053,21 @@ merlin_event *node_get_event(merlin_node *node)
 	return pkt;
 }
 
+/*
+ * Control packets are never subject to flow control, and neither is
+ * anything sent to a peer that hasn't granted us any credit, since
+ * it may be running an older version that doesn't know about it.
+ * We're allowed to overshoot the limit by one packet so a window
+ * smaller than the packet we're trying to send can't stall us.
+ */
+static int node_has_credit(merlin_node *node, merlin_event *pkt)
+{
+	if (pkt->hdr.type == CTRL_PACKET || !node->flow.limit)
+		return 1;
+
+	return node->flow.sent < node->flow.limit;
+}
+
 /*
  * Send the given event "pkt" to the node "node", or take appropriate
  * actions on the node itself in case sending fails.
@@ -927,20 +1099,35 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 		return node_binlog_add(node, pkt);
 	}
 
-	/* if binlog has entries, we must send those first */
-	if (binlog_has_entries(node->binlog)) {
+	/*
+	 * Control packets go in the priority lane and are sent right
+	 * away. Pulses must not wait behind a huge backlog, or the
+	 * peer will consider us dead long before the backlog is sent.
+	 * Everything else must be sent in order, so if the binlog
+	 * has entries we drain a bounded batch of those first and
+	 * queue this event behind whatever is left.
+	 */
+	if (pkt->hdr.type != CTRL_PACKET && binlog_has_entries(node->binlog)) {
 		node_send_binlog(node, pkt);
+
+		/* binlog may still have entries. If so, add to it and return */
+		if (binlog_has_entries(node->binlog))
+			return node_binlog_add(node, pkt);
 	}
 
-	/* binlog may still have entries. If so, add to it and return */
-	if (binlog_has_entries(node->binlog))
+	/* out of credit, so hold on to it until the peer catches up */
+	if (!node_has_credit(node, pkt)) {
+		node->flow.stalls++;
 		return node_binlog_add(node, pkt);
+	}
 
 	result = node_send(node, pkt, packet_size(pkt), MSG_DONTWAIT);
 
 	/* successfully sent, so add it to the counter and return 0 */
 	if (result == packet_size(pkt)) {
 		node->stats.events.sent++;
+		if (pkt->hdr.type != CTRL_PACKET)
+			node->flow.sent += result;
 		if (pkt->hdr.type < ARRAY_SIZE(node->stats.cb_count)) {
 			node->stats.cb_count[pkt->hdr.type].out++;
 		}
@@ -958,14 +1145,57 @@ int node_send_event(merlin_node *node, merlin_event *pkt, int msec)
 	return -1;
 }
 
-int node_send_binlog(merlin_node *node, merlin_event *pkt)
+/* events that only carry the current state of an object */
+static int is_state_event(const merlin_event *pkt)
+{
+	switch (pkt->hdr.type) {
+	case NEBCALLBACK_HOST_CHECK_DATA:
+	case NEBCALLBACK_SERVICE_CHECK_DATA:
+	case NEBCALLBACK_HOST_STATUS_DATA:
+	case NEBCALLBACK_SERVICE_STATUS_DATA:
+		return 1;
+	}
+	return 0;
+}
+
+void node_drain_deadline(struct timeval *deadline, int msec)
+{
+	gettimeofday(deadline, NULL);
+	deadline->tv_sec += msec / 1000;
+	deadline->tv_usec += (msec % 1000) * 1000;
+	if (deadline->tv_usec >= 1000000) {
+		deadline->tv_sec++;
+		deadline->tv_usec -= 1000000;
+	}
+}
+
+static int deadline_passed(const struct timeval *deadline)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return now.tv_sec > deadline->tv_sec ||
+		(now.tv_sec == deadline->tv_sec && now.tv_usec >= deadline->tv_usec);
+}
+
+/*
+ * Send backlogged events to the node. When called on behalf of a new
+ * event "pkt", at most binlog_drain_ratio events are sent so the
+ * caller (and everything else in the event loop) gets to run while
+ * a large backlog is being drained. Without "pkt" we're draining an
+ * otherwise idle node, so we keep going until "deadline". A single
+ * event can be large, so the clock is checked after each one.
+ */
+static int node_drain_binlog(merlin_node *node, merlin_event *pkt, const struct timeval *deadline)
 {
 	merlin_event *temp_pkt;
-	unsigned int len;
+	unsigned int len, sent = 0;
 
 	ldebug("Emptying backlog for %s (%u entries, %s)", node->name,
 		   binlog_num_entries(node->binlog), human_bytes(binlog_available(node->binlog)));
-	while (io_write_ok(node->sock, 10) && !binlog_read(node->binlog, (void **)&temp_pkt, &len)) {
+	while ((!deadline || !deadline_passed(deadline)) &&
+	       io_write_ok(node->sock, 10) && !binlog_read(node->binlog, (void **)&temp_pkt, &len))
+	{
 		int result;
 		if (!temp_pkt || packet_size(temp_pkt) != (int)len ||
 		    !len || !packet_size(temp_pkt) || packet_size(temp_pkt) > MAX_PKT_SIZE)
@@ -978,22 +1208,52 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 			lerr("BACKLOG: binlog claims the data length is %u", len);
 			lerr("BACKLOG: wiping backlog. %s is now out of sync", node->name);
 			binlog_wipe(node->binlog, BINLOG_UNLINK);
+			node->resync |= RESYNC_LOST;
+			node->resync_skip = 0;
 			return -1;
 		}
+		if (node->resync_skip) {
+			/*
+			 * the node has already been sent a snapshot of the
+			 * state these events would have brought it to
+			 */
+			if (is_state_event(temp_pkt)) {
+				node->resync_skip--;
+				node->stats.events.logged--;
+				node->stats.bytes.logged -= packet_size(temp_pkt);
+				free(temp_pkt);
+				continue;
+			}
+		}
+		if (!node_has_credit(node, temp_pkt)) {
+			node->flow.stalls++;
+			if (binlog_unread(node->binlog, temp_pkt, len))
+				free(temp_pkt);
+			break;
+		}
+
 		errno = 0;
 		result = node_send(node, temp_pkt, packet_size(temp_pkt), MSG_DONTWAIT);
 
 		/* keep going while we successfully send something */
 		if (result == packet_size(temp_pkt)) {
 			node->stats.events.sent++;
+			if (temp_pkt->hdr.type != CTRL_PACKET)
+				node->flow.sent += result;
 			node->stats.events.logged--;
 			node->stats.bytes.logged -= packet_size(temp_pkt);
+			if (node->resync_skip)
+				node->resync_skip--;
 
 			/*
 			 * binlog duplicates the memory, so we must release it
 			 * when we've sent and counted it
 			 */
 			free(temp_pkt);
+
+			sent++;
+			if (pkt && binlog_drain_ratio && sent >= binlog_drain_ratio)
+				break;
 			continue;
 		}
 
@@ -1024,6 +1284,8 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 		 */
 		lerr("Wiping binlog for %s node %s", node_type(node), node->name);
 		binlog_wipe(node->binlog, BINLOG_UNLINK);
+		node->resync |= RESYNC_LOST;
+		node->resync_skip = 0;
 		if (pkt) {
 			node->stats.events.dropped += node->stats.events.logged + 1;
 			node->stats.bytes.dropped += node->stats.bytes.logged + packet_size(pkt);
@@ -1035,6 +1297,201 @@ int node_send_binlog(merlin_node *node, merlin_event *pkt)
 	return 0;
 }
 
+int node_send_binlog(merlin_node *node, merlin_event *pkt)
+{
+	return node_drain_binlog(node, pkt, NULL);
+}
+
+/*
+ * Drain the backlog of a node that isn't getting any new events,
+ * stopping at "deadline". Callers draining several nodes should
+ * give them all the same deadline, so the time spent doesn't grow
+ * with the number of nodes. Returns the number of events still in
+ * the backlog, or < 0 on errors.
+ */
+int node_drain_backlog_until(merlin_node *node, const struct timeval *deadline)
+{
+	if (!node || node->sock < 0 || node->state != STATE_CONNECTED)
+		return 0;
+	if (!binlog_has_entries(node->binlog))
+		return 0;
+
+	if (node_drain_binlog(node, NULL, deadline) < 0)
+		return -1;
+
+	return binlog_num_entries(node->binlog);
+}
+
+/* like node_drain_backlog_until(), spending at most "msec" milliseconds */
+int node_drain_backlog(merlin_node *node, int msec)
+{
+	struct timeval deadline;
+
+	node_drain_deadline(&deadline, msec);
+	return node_drain_backlog_until(node, &deadline);
+}
+
+
+/*
+ * Tell the node how much more it may send us. The window is counted
+ * from what we've actually handled, so a peer that sends faster than
+ * we can process ends up queueing in its own binlog instead of
+ * filling our socket buffers until one of us gives up.
+ */
+int node_credit_grant(merlin_node *node)
+{
+	struct merlin_credit credit;
+
+	if (node == &ipc)
+		return 0;
+
+	/*
+	 * with flow control disabled we still send a grant, so the
+	 * node knows we understand them. It just won't limit anything
+	 */
+	if (!flow_control_window)
+		credit.limit = UINT64_MAX;
+	else
+		credit.limit = node->flow.consumed + flow_control_window;
+	if (node_ctrl(node, CTRL_CREDIT, CTRL_GENERIC, &credit, sizeof(credit)) < 0)
+		return -1;
+
+	node->flow.granted = credit.limit;
+	return 0;
+}
+
+/*
+ * Account for an event we've handled from the node, and top up its
+ * credit once it has used up half of what we last granted it. We
+ * only bother once the node has shown it understands CTRL_CREDIT by
+ * sending us one of its own, so older versions don't get spammed.
+ */
+void node_credit_consume(merlin_node *node, merlin_event *pkt)
+{
+	if (pkt->hdr.type == CTRL_PACKET)
+		return;
+
+	node->flow.consumed += packet_size(pkt);
+	if (!flow_control_window || !node->flow.limit)
+		return;
+
+	if (node->flow.consumed + flow_control_window / 2 >= node->flow.granted)
+		node_credit_grant(node);
+}
+
+/* a CTRL_CREDIT packet arrived from the node */
+void node_credit_handle(merlin_node *node, merlin_event *pkt)
+{
+	struct merlin_credit *credit = (struct merlin_credit *)pkt->body;
+
+	if (pkt->hdr.len < sizeof(*credit)) {
+		lwarn("%s: CTRL_CREDIT packet too small (%u bytes)", node->name, pkt->hdr.len);
+		return;
+	}
+
+	/* grants can only ever grow during a connection */
+	if (credit->limit <= node->flow.limit)
+		return;
+
+	ldebug("%s: credit limit raised from %llu to %llu (%llu sent)", node->name,
+	       (unsigned long long)node->flow.limit, (unsigned long long)credit->limit,
+	       (unsigned long long)node->flow.sent);
+
+	/*
+	 * The first grant also means the peer wants grants from us,
+	 * but we may have sent ours before it could take part, so
+	 * send a fresh one.
+	 */
+	if (!node->flow.limit && !node->flow.granted)
+		node_credit_grant(node);
+	node->flow.limit = credit->limit;
+
+	/*
+	 * We may have been holding things back for lack of credit.
+	 * Sending it from here would hold up whatever the peer sent
+	 * after this, so the periodic backlog drain gets to it first
+	 * next time it runs.
+	 */
+	if (binlog_has_entries(node->binlog))
+		node->flow.unblocked = 1;
+}
+
+/*
+ * Send a CTRL_PULSE to the node so we can measure the link. Older
+ * versions don't know about those and would just log a warning each
+ * time, so we only ping nodes that have sent us a CTRL_CREDIT, since
+ * they're new enough to understand this as well.
+ */
+int node_send_pulse(merlin_node *node)
+{
+	struct merlin_pulse pulse;
+
+	if (node == &ipc || node->state != STATE_CONNECTED || !node->flow.limit)
+		return 0;
+
+	memset(&pulse, 0, sizeof(pulse));
+	gettimeofday(&pulse.origin, NULL);
+	return node_ctrl(node, CTRL_PULSE, CTRL_GENERIC, &pulse, sizeof(pulse));
+}
+
+/*
+ * Either echo a pulse back to where it came from, or use the echo
+ * of one of our own to update the link stats. The clock offset is
+ * the difference between the remote clock and the midpoint of the
+ * round trip, so it's only as good as the link is symmetric.
+ */
+void node_pulse_handle(merlin_node *node, merlin_event *pkt)
+{
+	struct merlin_pulse *pulse = (struct merlin_pulse *)pkt->body;
+	struct timeval now;
+	int64_t rtt;
+
+	if (pkt->hdr.len < sizeof(*pulse)) {
+		lwarn("%s: CTRL_PULSE packet too small (%u bytes)", node->name, pkt->hdr.len);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	if (!pulse->echo) {
+		pulse->echo = 1;
+		pulse->reflected = now;
+		node_ctrl(node, CTRL_PULSE, CTRL_GENERIC, pulse, sizeof(*pulse));
+		return;
+	}
+
+	rtt = tv_usec_delta(&pulse->origin, &now);
+	if (rtt < 0) {
+		lwarn("%s: Ignoring pulse echo from the future (rtt %lldus)", node->name, (long long)rtt);
+		return;
+	}
+
+	node->link.rtt = rtt;
+	node->link.clock_offset = tv_usec_delta(&pulse->origin, &pulse->reflected) - rtt / 2;
+	node->latency = (int)(rtt / 2000);
+	histogram_add(&node->link.rtt_hist, rtt);
+	ldebug("%s: rtt %lldus, clock offset %lldus", node->name,
+	       (long long)rtt, (long long)node->link.clock_offset);
+}
+
+/*
+ * Record how old an event from the node is when we get it, adjusted
+ * for the difference between our clocks when we know it. Events sent
+ * from the future (because we don't know the offset yet, or it has
+ * changed) are counted as brand new.
+ */
+void node_event_age(merlin_node *node, merlin_event *pkt)
+{
+	struct timeval now;
+	int64_t age;
+
+	if (!pkt->hdr.sent.tv_sec)
+		return;
+
+	gettimeofday(&now, NULL);
+	age = tv_usec_delta(&pkt->hdr.sent, &now) + node->link.clock_offset;
+	histogram_add(&node->link.age_hist, age < 0 ? 0 : age);
+}
+
 /*
  * Sends a control event with code "code" and selection "selection"
  * to node "node", packing pkt->body with "data" which must be of
@@ -1110,10 +1567,10 @@ int node_compat_cmp(const merlin_node *node, const merlin_event *pkt)
 		return ESYNC_EVERSION;
 	}
 
+	/* the fields we've added since are zeroed for older nodes */
 	if (len < sizeof(node->info)) {
-		lwarn("%s: info-size too small (%d < %d), incompatible version?",
-		      node->name, len, sizeof(node->info));
-		return ESYNC_EVERSION;
+		ldebug("%s: info-size smaller than ours (%d < %d). Older version?",
+		       node->name, len, sizeof(node->info));
 	}
 
 	if (info->word_size != COMPAT_WORDSIZE) {
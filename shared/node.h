@@ -2,11 +2,14 @@
 #define INCLUDE_node_h__
 
 #include <sys/types.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #include <naemon/naemon.h>
 #include "cfgfile.h"
 #include "binlog.h"
+#include "histogram.h"
+#include "flightrec.h"
 #include "pgroup.h"
 
 #if __BYTE_ORDER == __BIG_ENDIAN
@@ -52,9 +55,13 @@
 #define CTRL_INACTIVE 2 /* signals that a slave went offline */
 #define CTRL_ACTIVE   3 /* signals that a slave went online */
 #define CTRL_PATHS    4 /* body contains paths to import */
-#define CTRL_STALL    5 /* (deprecated) signal that we can't accept events for a while */
-#define CTRL_RESUME   6 /* (deprecated) now we can accept events again */
+#define CTRL_STALL    5 /* (deprecated, see CTRL_CREDIT) signal that we can't accept events for a while */
+#define CTRL_RESUME   6 /* (deprecated, see CTRL_CREDIT) now we can accept events again */
 #define CTRL_STOP     7 /* exit() immediately (only accepted via ipc) */
+#define CTRL_SHMRING  8 /* shared memory transport negotiation (only via ipc) */
+#define CTRL_CREDIT   9 /* flow control. body is a struct merlin_credit */
+#define CTRL_SNAPSHOT 10 /* current object state. body is a struct merlin_snapshot */
+#define CTRL_HANDOVER 11 /* planned leave. body is a struct merlin_handover */
 /* the following magic entries can be used for the "code" entry */
 #define MAGIC_NONET 0xffff /* don't forward to the network */
 
@@ -89,9 +96,13 @@ struct merlin_header {
 	uint16_t selection;  /* used when noc Nagios communicates with mrd */
 	uint32_t len;        /* size of body */
 	struct timeval sent;  /* when this message was sent */
+	uint8_t relay;       /* sender wants us to pass this on to our peers */
+	uint8_t hops;        /* how many times this event has been relayed */
+	uint16_t origin_port; /* port of the node a relayed event came from */
+	uint32_t origin;     /* address of the node a relayed event came from */
 
 	/* pad to 64 bytes for future extensions */
-	char padding[64 - sizeof(struct timeval) - (2 * 6) - 8];
+	char padding[64 - sizeof(struct timeval) - (2 * 6) - 8 - 8];
 } __attribute__((packed));
 typedef struct merlin_header merlin_header;
 
@@ -123,7 +134,7 @@ typedef struct merlin_node merlin_node;
 /* change this macro when nodeinfo is rearranged */
 #define MERLIN_NODEINFO_VERSION 1
  /* change this macro when the struct grows incompatibly */
-#define MERLIN_NODEINFO_MINSIZE sizeof(struct merlin_nodeinfo)
+#define MERLIN_NODEINFO_MINSIZE offsetof(struct merlin_nodeinfo, capabilities)
 struct merlin_nodeinfo {
 	uint32_t version;       /* version of this structure */
 	uint32_t word_size;     /* bits per register (sizeof(void *) * 8) */
@@ -142,10 +153,126 @@ struct merlin_nodeinfo {
 	uint32_t host_checks_handled;
 	uint32_t service_checks_handled;
 	uint32_t monitored_object_state_size;
+	uint32_t capabilities;  /* MERLIN_CAP_* bits. Older nodes don't send it */
 	/* new entries have to come LAST */
 } __attribute__((packed));
 typedef struct merlin_nodeinfo merlin_nodeinfo;
 
+/* capabilities a node announces in its CTRL_ACTIVE packets */
+#define MERLIN_CAP_HANDOVER (1 << 0) /* takes CTRL_HANDOVER packets from leaving peers */
+
+/*
+ * Body of a CTRL_CREDIT packet. The receiver of a stream grants the
+ * sender the right to send event data up to "limit" bytes, counted
+ * from the start of the connection. Control packets don't count.
+ * Senders that have never received a grant are not limited.
+ */
+struct merlin_credit {
+	uint64_t limit;
+} __attribute__((packed));
+
+/*
+ * Body of a CTRL_SNAPSHOT packet, sent to peers instead of replaying
+ * a backlog that has been wiped or holds more events than we have
+ * objects. The header is followed by "count" entries of each column,
+ * in this order (which keeps every column naturally aligned):
+ *   int64_t last_check[], last_state_change[], last_hard_state_change[]
+ *   uint32_t id[]
+ *   uint8_t current_state[], last_hard_state[], state_type[], current_attempt[]
+ * and then "count" nul-terminated plugin outputs. Peers have identical
+ * object configuration, so objects are identified by their id.
+ */
+#define SNAPSHOT_HOSTS    0
+#define SNAPSHOT_SERVICES 1
+struct merlin_snapshot {
+	uint32_t what;          /* SNAPSHOT_HOSTS or SNAPSHOT_SERVICES */
+	uint32_t count;         /* objects in this packet */
+} __attribute__((packed));
+
+/*
+ * Body of a CTRL_HANDOVER packet. A peer that is shutting down sends
+ * one or more of these with the next check times of the objects it
+ * owns, followed by "count" int64_t next_check[] and uint32_t id[].
+ * The last one has "what" set to HANDOVER_DONE and no objects, and
+ * means the node is leaving right away.
+ */
+#define HANDOVER_HOSTS    0
+#define HANDOVER_SERVICES 1
+#define HANDOVER_DONE     2
+struct merlin_handover {
+	uint32_t what;
+	uint32_t count;
+} __attribute__((packed));
+
+/* merlin_node->resync flags */
+#define RESYNC_LOST  1 /* events to the node have been dropped */
+#define RESYNC_CHECK 2 /* the node just (re)connected */
+
+/*
+ * Body of a CTRL_PULSE packet. A node that receives one with "echo"
+ * unset sends it right back with "echo" set and "reflected" filled
+ * in with its own clock, which lets the original sender work out
+ * the round-trip time and how far apart our clocks are.
+ */
+struct merlin_pulse {
+	struct timeval origin;    /* when the original sender sent it */
+	struct timeval reflected; /* when the echoing node sent it back */
+	uint32_t echo;
+} __attribute__((packed));
+
+/* link latency measurements, all in microseconds */
+struct merlin_link_stats {
+	int64_t rtt;            /* last measured round-trip time */
+	int64_t clock_offset;   /* their clock minus ours */
+	histogram rtt_hist;     /* round-trip times */
+	histogram age_hist;     /* age of events when we receive them */
+};
+
+/*
+ * Pulse arrival times, for failure detection. From the intervals
+ * we've seen, phi says how unlikely it is (on a -log10 scale) that
+ * we'd go as long as we have without a pulse if the node were alive.
+ */
+#define LIVENESS_SAMPLES 32
+#define LIVENESS_MIN_SAMPLES 3 /* until then, data_timeout is used */
+#define LIVENESS_READS 16
+struct merlin_liveness {
+	struct timeval last;    /* when the last pulse arrived */
+	uint32_t interval[LIVENESS_SAMPLES]; /* ms between pulses */
+	unsigned int next, count;
+	double phi;             /* suspicion level when we last checked */
+	int suspect;            /* phi has passed phi_suspect */
+	/*
+	 * Our last few reads from the socket, so a pulse we don't get
+	 * around to parsing until later still counts as arriving when
+	 * it was read. "end" is how many bytes we'd read in total after
+	 * each, and "parsed" how many we've taken packets out of.
+	 */
+	struct {
+		uint64_t end;
+		struct timeval when;
+	} reads[LIVENESS_READS];
+	unsigned int read_next;
+	uint64_t received, parsed;
+};
+
+/* inbound events waiting to be applied */
+struct merlin_inbound {
+	unsigned long peak;     /* most bytes we've had queued from the node */
+	unsigned long long deferred; /* times we ran out of time with its events queued */
+	unsigned int epoch;     /* bumped on disconnect, to drop stale events */
+};
+
+/* per-connection flow control state */
+struct merlin_flow {
+	uint64_t sent;          /* event bytes we've sent */
+	uint64_t limit;         /* how far the peer lets us send. 0 = no limit */
+	uint64_t consumed;      /* event bytes we've handled from the peer */
+	uint64_t granted;       /* the limit we last granted the peer */
+	unsigned int stalls;    /* times we ran out of credit */
+	int unblocked;          /* got credit with a backlog waiting for it */
+};
+
 struct merlin_child {
 	char *cmd;
 	int is_running;
@@ -165,6 +292,7 @@ typedef struct merlin_confsync merlin_confsync;
 
 struct statistics_vars {
 	unsigned long long sent, read, logged, dropped;
+	unsigned long long filtered; /* not forwarded, since the node doesn't need it */
 };
 struct callback_count {
 	unsigned int in, out;
@@ -176,6 +304,11 @@ struct merlin_node_stats {
 };
 typedef struct merlin_node_stats merlin_node_stats;
 
+/* for node->strip; fields of status events we don't send to a node */
+#define STRIP_PERF_DATA   (1 << 0)
+#define STRIP_LONG_OUTPUT (1 << 1)
+#define STRIP_ALL         (STRIP_PERF_DATA | STRIP_LONG_OUTPUT)
+
 /* used for various objects which we build linked lists for */
 typedef struct linked_item {
 	void *item;
@@ -186,6 +319,8 @@ struct node_selection {
 	int id;
 	char *name;
 	linked_item *nodes;
+	struct merlin_node **node_ary; /* same nodes, for quick iteration */
+	unsigned int node_count;
 };
 typedef struct node_selection node_selection;
 
@@ -219,6 +354,7 @@ struct merlin_node {
 	int state;              /* state of this node (down, pending, active) */
 	uint32_t peer_id;       /* peer id, used to distribute checks */
 	int flags;              /* flags for this node */
+	int strip;              /* STRIP_* fields this node doesn't want */
 	struct sockaddr *sa;    /* should always point to sain */
 	struct sockaddr_in sain;
 	unsigned int data_timeout; /* send gracetime before we disconnect */
@@ -241,13 +377,21 @@ struct merlin_node {
 	merlin_nodeinfo expected; /* what we expect from this node (incomplete) */
 	int last_action;        /* LA_CONNECT | LA_DISCONNECT | LA_HANDLED */
 	binlog *binlog;         /* binary backlog for this node */
+	int resync;             /* RESYNC_* flags */
+	unsigned int resync_skip; /* backlogged events a snapshot made redundant */
 	merlin_node_stats stats; /* event/data statistics */
+	struct merlin_flow flow; /* credit-based flow control */
+	struct merlin_link_stats link; /* link latency measurements */
+	struct merlin_liveness liveness; /* failure detection */
+	struct merlin_inbound inbound; /* queued inbound events */
+	struct flightrec flightrec; /* recent packets to and from this node */
 	nm_bufferqueue *bq;     /* I/O cache for bulk reads */
 	merlin_confsync csync; /* config synchronization configuration */
 	unsigned int csync_num_attempts;
 	unsigned int csync_max_attempts;
 	time_t csync_last_attempt;
 	int (*action)(struct merlin_node *, int); /* (daemon) action handler */
+	void (*drain)(struct merlin_node *); /* (module) applies what's left in bq on disconnect */
 };
 
 #define node_table noc_table
@@ -264,6 +408,7 @@ extern merlin_nodeinfo *self;
 #define online_nodes (online_masters + online_pollers + online_peers)
 
 extern node_selection *node_selection_by_name(const char *name);
+extern node_selection *node_selection_by_id(int sel);
 extern char *get_sel_name(int index);
 extern int get_sel_id(const char *name);
 extern int get_num_selections(void);
@@ -277,6 +422,16 @@ extern int node_send_event(merlin_node *node, merlin_event *pkt, int msec);
 extern int node_recv(merlin_node *node);
 extern merlin_event *node_get_event(merlin_node *node);
 extern int node_send_binlog(merlin_node *node, merlin_event *pkt);
+extern int node_drain_backlog(merlin_node *node, int msec);
+extern int node_drain_backlog_until(merlin_node *node, const struct timeval *deadline);
+extern void node_drain_deadline(struct timeval *deadline, int msec);
+extern int node_credit_grant(merlin_node *node);
+extern void node_credit_consume(merlin_node *node, merlin_event *pkt);
+extern void node_credit_handle(merlin_node *node, merlin_event *pkt);
+extern int node_send_pulse(merlin_node *node);
+extern void node_pulse_handle(merlin_node *node, merlin_event *pkt);
+extern void node_event_age(merlin_node *node, merlin_event *pkt);
+extern int node_binlog_add(merlin_node *node, merlin_event *pkt);
 extern const char *node_state(const merlin_node *node);
 extern const char *node_type(const merlin_node *node);
 extern void node_set_state(merlin_node *node, int state, const char *reason);
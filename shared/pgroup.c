@@ -16,6 +16,16 @@ static unsigned int num_peer_groups;
 bitmap *poller_handled_hosts = NULL;
 bitmap *poller_handled_services = NULL;
 
+/*
+ * Nodes we hand checks to. We're obviously alive. Whether a node is
+ * only late with its pulse is up to each of its peers to decide, so
+ * it doesn't count here, or we'd disagree on who runs what.
+ */
+static int assignable(const merlin_node *node)
+{
+	return node == &ipc || node->state == STATE_CONNECTED;
+}
+
 static void pgroup_reassign_checks(void)
 {
 	unsigned int i, x;
@@ -68,7 +78,7 @@ static void pgroup_reassign_checks(void)
 		for (x = 0; x < pg->total_nodes; x++) {
 			merlin_node *node = pg->nodes[x];
 
-			if (node->state != STATE_CONNECTED) {
+			if (!assignable(node)) {
 				node->assigned.current.hosts = 0;
 				node->assigned.current.services = 0;
 				continue;
@@ -94,19 +104,11 @@ static int cmp_peer(const void *a_, const void *b_)
 {
 	const merlin_node *a = *(const merlin_node **)a_;
 	const merlin_node *b = *(const merlin_node **)b_;
-	int a_state, b_state;
-
-	/* we're obviously alive, so we count ourselves as connected */
-	a_state = a == &ipc ? STATE_CONNECTED : a->state;
-	b_state = b == &ipc ? STATE_CONNECTED : b->state;
+	int a_active = assignable(a), b_active = assignable(b);
 
 	/* make sure disconnected nodes are sorted last */
-	if (a_state != b_state) {
-		if (a_state == STATE_CONNECTED)
-			return -1;
-		if (b_state == STATE_CONNECTED)
-			return 1;
-	}
+	if (a_active != b_active)
+		return a_active ? -1 : 1;
 
 	/*
 	 * also make sure nodes that haven't sent a CTRL_ACTIVE
@@ -152,7 +154,7 @@ void pgroup_assign_peer_ids(merlin_peer_group *pg)
 		 */
 		node->peer_id = i;
 		ldebug("pg:   %.1d: %s (%s)", node->peer_id, node->name, node_state_name(node->state));
-		if (node == &ipc || (node->state == STATE_CONNECTED)) {
+		if (assignable(node)) {
 			pg->active_nodes++;
 		}
 	}
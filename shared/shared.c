@@ -16,6 +16,8 @@ int use_database = 0;
 char *merlin_config_file = NULL;
 merlin_nodeinfo *self = NULL;
 char *binlog_dir = NULL;
+unsigned int binlog_drain_ratio = 64;
+unsigned int flow_control_window = 8 << 20;
 
 char *next_word(char *str)
 {
@@ -272,6 +274,10 @@ static const char *control_names[] = {
 	CTRL_ENTRY(STALL),
 	CTRL_ENTRY(RESUME),
 	CTRL_ENTRY(STOP),
+	CTRL_ENTRY(SHMRING),
+	CTRL_ENTRY(CREDIT),
+	CTRL_ENTRY(SNAPSHOT),
+	CTRL_ENTRY(HANDOVER),
 };
 const char *ctrl_name(uint code)
 {
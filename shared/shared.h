@@ -52,6 +52,8 @@ extern int is_module;
 extern int pulse_interval;
 extern int debug;
 extern char *binlog_dir;
+extern unsigned int binlog_drain_ratio;
+extern unsigned int flow_control_window;
 extern char *merlin_config_file;
 
 
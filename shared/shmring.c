@@ -0,0 +1,265 @@
+/*
+ * Shared memory ring buffer, used as a cheaper transport than the
+ * ipc socket between the module and the daemon.
+ *
+ * Both "head" and "tail" are free-running byte counters. Only the
+ * producer ever writes "head" and only the consumer ever writes
+ * "tail", so all we need to keep things sane are memory barriers
+ * between touching the data and publishing the new position.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "shmring.h"
+#include "shared.h"
+#include "logging.h"
+
+#define SHMRING_MAGIC 0x4d52494e /* "MRIN" */
+
+struct shmring_ctl {
+	uint32_t magic;
+	uint32_t size;
+	/* keep producer and consumer state in separate cache-lines */
+	volatile uint64_t head;
+	char pad1[64 - 16];
+	volatile uint64_t tail;
+	volatile uint32_t waiting;
+	char pad2[64 - 12];
+};
+
+struct shmring {
+	struct shmring_ctl *ctl;
+	unsigned char *data;
+	unsigned int size;
+	size_t map_size;
+	int fd, efd;
+};
+
+static int shmring_memfd(size_t len)
+{
+	int fd;
+
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "merlin-ipc", 1 /* MFD_CLOEXEC */);
+	if (fd < 0)
+#endif
+	{
+		char path[] = "/dev/shm/merlin-ipc.XXXXXX";
+
+		fd = mkstemp(path);
+		if (fd < 0)
+			return -1;
+		unlink(path);
+	}
+
+	if (ftruncate(fd, len) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static shmring *shmring_map(int fd, int efd, size_t map_size)
+{
+	shmring *r;
+	void *map;
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		munmap(map, map_size);
+		return NULL;
+	}
+
+	r->ctl = map;
+	r->data = (unsigned char *)map + sizeof(struct shmring_ctl);
+	r->map_size = map_size;
+	r->fd = fd;
+	r->efd = efd;
+	return r;
+}
+
+shmring *shmring_create(unsigned int size)
+{
+	unsigned int real_size = SHMRING_MIN_SIZE;
+	size_t map_size;
+	shmring *r;
+	int fd, efd;
+
+	/* the data area must be a power of 2 so we can mask positions */
+	while (real_size < size && real_size < (1U << 31))
+		real_size <<= 1;
+
+	map_size = sizeof(struct shmring_ctl) + real_size;
+	if ((fd = shmring_memfd(map_size)) < 0) {
+		lerr("shmring: Failed to create shared memory file: %s", strerror(errno));
+		return NULL;
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		lerr("shmring: Failed to create eventfd: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	if (!(r = shmring_map(fd, efd, map_size))) {
+		lerr("shmring: Failed to map %lu bytes: %s", map_size, strerror(errno));
+		close(fd);
+		close(efd);
+		return NULL;
+	}
+
+	r->size = real_size;
+	r->ctl->size = real_size;
+	r->ctl->head = r->ctl->tail = 0;
+	r->ctl->waiting = 0;
+	r->ctl->magic = SHMRING_MAGIC;
+
+	return r;
+}
+
+shmring *shmring_attach(int fd, int efd)
+{
+	struct stat st;
+	shmring *r;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size <= sizeof(struct shmring_ctl)) {
+		lerr("shmring: Refusing to attach to fd %d: bad size", fd);
+		return NULL;
+	}
+
+	if (!(r = shmring_map(fd, efd, st.st_size))) {
+		lerr("shmring: Failed to map fd %d: %s", fd, strerror(errno));
+		return NULL;
+	}
+
+	r->size = r->ctl->size;
+	if (r->ctl->magic != SHMRING_MAGIC || !r->size || (r->size & (r->size - 1)) ||
+	    r->size + sizeof(struct shmring_ctl) > r->map_size)
+	{
+		lerr("shmring: fd %d doesn't contain a valid ring", fd);
+		munmap(r->ctl, r->map_size);
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void shmring_destroy(shmring *r)
+{
+	if (!r)
+		return;
+
+	munmap(r->ctl, r->map_size);
+	close(r->fd);
+	close(r->efd);
+	free(r);
+}
+
+int shmring_fd(shmring *r)
+{
+	return r->fd;
+}
+
+int shmring_event_fd(shmring *r)
+{
+	return r->efd;
+}
+
+unsigned int shmring_size(shmring *r)
+{
+	return r->size;
+}
+
+unsigned int shmring_used(shmring *r)
+{
+	return (unsigned int)(r->ctl->head - r->ctl->tail);
+}
+
+int shmring_push(shmring *r, const void *buf, unsigned int len)
+{
+	uint64_t head = r->ctl->head;
+	unsigned int pos, first;
+
+	if (len > r->size - (unsigned int)(head - r->ctl->tail))
+		return -1;
+
+	pos = head & (r->size - 1);
+	first = min(len, r->size - pos);
+	memcpy(r->data + pos, buf, first);
+	if (first < len)
+		memcpy(r->data, (const unsigned char *)buf + first, len - first);
+
+	/* data must be visible before the new head is */
+	__sync_synchronize();
+	r->ctl->head = head + len;
+
+	/* ...and the head must be visible before we check for sleepers */
+	__sync_synchronize();
+	if (r->ctl->waiting && __sync_bool_compare_and_swap(&r->ctl->waiting, 1, 0)) {
+		uint64_t one = 1;
+		if (write(r->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			lerr("shmring: Failed to wake consumer: %s", strerror(errno));
+	}
+
+	return 0;
+}
+
+int shmring_drain(shmring *r, nm_bufferqueue *bq)
+{
+	uint64_t head, tail = r->ctl->tail;
+	unsigned int used, pos, first;
+
+	head = r->ctl->head;
+	/* don't read data older than the head we just saw */
+	__sync_synchronize();
+
+	used = (unsigned int)(head - tail);
+	if (!used)
+		return 0;
+
+	if (used > r->size) {
+		lerr("shmring: Ring is corrupt (%u bytes used of %u)", used, r->size);
+		return -1;
+	}
+
+	pos = tail & (r->size - 1);
+	first = min(used, r->size - pos);
+	if (nm_bufferqueue_push(bq, r->data + pos, first))
+		return -1;
+	if (first < used && nm_bufferqueue_push(bq, r->data, used - first))
+		return -1;
+
+	/* we're done with the data, so the producer may overwrite it */
+	__sync_synchronize();
+	r->ctl->tail = head;
+
+	return used;
+}
+
+unsigned int shmring_prepare_wait(shmring *r)
+{
+	r->ctl->waiting = 1;
+	__sync_synchronize();
+	return shmring_used(r);
+}
+
+void shmring_finish_wait(shmring *r)
+{
+	uint64_t count;
+
+	r->ctl->waiting = 0;
+	if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		lerr("shmring: Failed to read eventfd: %s", strerror(errno));
+}
@@ -0,0 +1,91 @@
+#ifndef INCLUDE_shmring_h__
+#define INCLUDE_shmring_h__
+
+#include <naemon/naemon.h>
+
+/**
+ * @file shmring.h
+ * @brief single-producer, single-consumer byte ring in shared memory
+ *
+ * The ring lives in a memfd (or an unlinked file if memfd_create()
+ * isn't available) so it can be handed to another process as a file
+ * descriptor. An eventfd is used to wake the consumer, but only when
+ * it has announced that it's about to go to sleep, so a busy producer
+ * never has to enter the kernel.
+ * @{
+ */
+
+/** A shared memory ring. */
+typedef struct shmring shmring;
+
+/** smallest ring we create. Must hold at least one full packet */
+#define SHMRING_MIN_SIZE (1 << 20)
+
+/**
+ * Create a new ring with room for at least "size" bytes
+ * @param size Requested size of the data area
+ * @return A ring on success, NULL on errors
+ */
+extern shmring *shmring_create(unsigned int size);
+
+/**
+ * Map a ring created by another process
+ * @param fd The memory file descriptor of the ring
+ * @param efd The eventfd used to wake the consumer
+ * @return A ring on success, NULL on errors
+ */
+extern shmring *shmring_attach(int fd, int efd);
+
+/**
+ * Unmap a ring and close its file descriptors
+ * @param r The ring to destroy
+ */
+extern void shmring_destroy(shmring *r);
+
+/** @return the memory file descriptor of the ring */
+extern int shmring_fd(shmring *r);
+
+/** @return the eventfd used to wake the consumer of the ring */
+extern int shmring_event_fd(shmring *r);
+
+/** @return size of the ring's data area */
+extern unsigned int shmring_size(shmring *r);
+
+/** @return number of bytes written but not yet consumed */
+extern unsigned int shmring_used(shmring *r);
+
+/**
+ * Add len bytes from buf to the ring. Either all of it is added,
+ * or none of it is.
+ * @param r The ring to write to
+ * @param buf The data to write
+ * @param len Length of the data
+ * @return 0 on success, -1 if there isn't enough room
+ */
+extern int shmring_push(shmring *r, const void *buf, unsigned int len);
+
+/**
+ * Move everything available in the ring to a bufferqueue
+ * @param r The ring to read from
+ * @param bq The bufferqueue to append the data to
+ * @return Number of bytes moved, or < 0 on errors
+ */
+extern int shmring_drain(shmring *r, nm_bufferqueue *bq);
+
+/**
+ * Tell the producer we're going to sleep on the eventfd. The
+ * caller must not sleep if this returns non-zero, since data
+ * may have arrived before the producer saw the flag.
+ * @param r The ring we'll be waiting for
+ * @return Number of bytes available for reading
+ */
+extern unsigned int shmring_prepare_wait(shmring *r);
+
+/**
+ * Reset the wakeup state after the eventfd has fired
+ * @param r The ring we were waiting for
+ */
+extern void shmring_finish_wait(shmring *r);
+
+/** @} */
+#endif
@@ -139,6 +139,36 @@ CREATE TABLE IF NOT EXISTS report_data (
 
 CREATE TABLE IF NOT EXISTS report_data_extras LIKE report_data;
 
+--
+-- Seconds each object spent in each state per hour, maintained by
+-- merlind when log_report_rollups is enabled and built from history
+-- by "import --rollups". Daily or monthly figures are sums of these.
+--
+CREATE TABLE IF NOT EXISTS report_data_rollup(
+  host_name varchar(255) NOT NULL,
+  service_description varchar(255) NOT NULL default '',
+  period int(11) NOT NULL,
+  state int(2) NOT NULL,
+  hard int(2) NOT NULL,
+  downtime int(2) NOT NULL,
+  duration int(11) NOT NULL default '0',
+  PRIMARY KEY(host_name, service_description, period, state, hard, downtime)
+) ENGINE=MyISAM DEFAULT CHARSET=latin1 COLLATE latin1_general_cs;
+
+--
+-- The state each object has been in since "since", which hasn't
+-- made it into report_data_rollup yet.
+--
+CREATE TABLE IF NOT EXISTS report_data_rollup_open(
+  host_name varchar(255) NOT NULL,
+  service_description varchar(255) NOT NULL default '',
+  since int(11) NOT NULL,
+  state int(2) NOT NULL,
+  hard int(2) NOT NULL,
+  downtime_depth int(11) NOT NULL default '0',
+  PRIMARY KEY(host_name, service_description)
+) ENGINE=MyISAM DEFAULT CHARSET=latin1 COLLATE latin1_general_cs;
+
 --
 -- This table is not automagically recreated every time we upgrade
 -- and logging to it is not enabled by default. Repairing it if it
@@ -133,7 +133,8 @@ class MerlinPktNodeInfo(MerlinPkt):
 		("L", "configured_masters", 0),
 		("L", "host_checks_handled", 0),
 		("L", "service_checks_handled", 0),
-		("L", "monitored_object_state_size", 0)
+		("L", "monitored_object_state_size", 0),
+		("L", "capabilities", 0)
 		]
 
 	def __init__(self):
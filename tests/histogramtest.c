@@ -0,0 +1,48 @@
+#include "histogram.h"
+#include "test_utils.h"
+#include <stdio.h>
+#include <string.h>
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	histogram h;
+	uint64_t i;
+
+	t_set_colors(0);
+	t_start("histogram tests");
+
+	memset(&h, 0, sizeof(h));
+	ok_uint((unsigned int)histogram_percentile(&h, 50), 0, "empty histogram has no percentiles");
+	ok_uint((unsigned int)histogram_mean(&h), 0, "empty histogram has no mean");
+
+	for (i = 0; i < 4; i++)
+		histogram_add(&h, i);
+	for (i = 0; i < 4; i++) {
+		ok_uint((unsigned int)histogram_percentile(&h, (i + 1) * 25), (unsigned int)i,
+		        "small values are exact");
+	}
+
+	histogram_reset(&h);
+	for (i = 1; i <= 1000; i++)
+		histogram_add(&h, i);
+	ok_uint((unsigned int)h.count, 1000, "all values are counted");
+	ok_uint((unsigned int)histogram_mean(&h), 500, "mean is exact");
+	ok_uint((unsigned int)histogram_percentile(&h, 100), 1000, "p100 is the max");
+	i = histogram_percentile(&h, 50);
+	if (i >= 500 && i < 625)
+		t_pass("p50 is within 25%% of the real value");
+	else
+		t_fail("p50 is %lu. Expected 500 - 625", (unsigned long)i);
+	i = histogram_percentile(&h, 99);
+	if (i >= 990 && i <= 1000)
+		t_pass("p99 is capped by the max");
+	else
+		t_fail("p99 is %lu. Expected 990 - 1000", (unsigned long)i);
+
+	histogram_reset(&h);
+	histogram_add(&h, (uint64_t)1 << 50);
+	ok_uint((unsigned int)(histogram_percentile(&h, 50) >> HIST_MAX_BITS), 0,
+	        "huge values end up in the last bucket");
+
+	return t_end();
+}
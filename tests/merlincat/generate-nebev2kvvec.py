@@ -266,6 +266,7 @@ event_structs = {
 		'uint:host_checks_handled',
 		'uint:service_checks_handled',
 		'uint:monitored_object_state_size',
+		'uint:capabilities',
 	]
 }
 
@@ -0,0 +1,103 @@
+#include "shmring.h"
+#include "test_utils.h"
+#include "shared.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned char buf[SHMRING_MIN_SIZE];
+
+static int bq_check(nm_bufferqueue *bq, unsigned int len, unsigned char seed)
+{
+	unsigned int i;
+
+	memset(buf, 0, len);
+	if (nm_bufferqueue_unshift(bq, len, buf))
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (buf[i] != (unsigned char)(seed + i))
+			return -1;
+	}
+	return 0;
+}
+
+static void fill(unsigned int len, unsigned char seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char)(seed + i);
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char **argv)
+{
+	shmring *prod, *cons;
+	nm_bufferqueue *bq;
+	unsigned int size, i;
+
+	t_set_colors(0);
+	t_start("shared memory ring tests");
+
+	prod = shmring_create(1);
+	if (!prod) {
+		t_fail("Failed to create ring");
+		return t_end();
+	}
+	size = shmring_size(prod);
+	ok_uint(size, SHMRING_MIN_SIZE, "small rings are rounded up");
+
+	/* the consumer maps the same memory, as the daemon would */
+	cons = shmring_attach(dup(shmring_fd(prod)), dup(shmring_event_fd(prod)));
+	if (!cons) {
+		t_fail("Failed to attach to ring");
+		shmring_destroy(prod);
+		return t_end();
+	}
+	ok_uint(shmring_size(cons), size, "attached ring has the same size");
+
+	bq = nm_bufferqueue_create();
+
+	fill(1000, 1);
+	ok_int(shmring_push(prod, buf, 1000), 0, "push to empty ring");
+	ok_uint(shmring_used(cons), 1000, "consumer sees pushed data");
+	ok_int(shmring_drain(cons, bq), 1000, "drain moves everything");
+	ok_uint(shmring_used(prod), 0, "producer sees ring emptied");
+	ok_int(bq_check(bq, 1000, 1), 0, "drained data is intact");
+
+	/* fill the ring up to the brim, starting off-center */
+	fill(size - 1000, 2);
+	ok_int(shmring_push(prod, buf, size - 1000), 0, "push up to end of ring");
+	fill(1000, 3);
+	ok_int(shmring_push(prod, buf, 1000), 0, "push wrapping past end of ring");
+	ok_int(shmring_push(prod, buf, 1), -1, "push to full ring fails");
+	ok_int(shmring_drain(cons, bq), (int)size, "drain of full ring");
+	ok_int(bq_check(bq, size - 1000, 2), 0, "data before wrap is intact");
+	ok_int(bq_check(bq, 1000, 3), 0, "wrapped data is intact");
+
+	fill(size / 2 + 1, 4);
+	ok_int(shmring_push(prod, buf, size / 2 + 1), 0, "push more than half");
+	ok_int(shmring_push(prod, buf, size / 2), -1, "push is all-or-nothing");
+	ok_uint(shmring_used(cons), size / 2 + 1, "failed push leaves no trace");
+	shmring_drain(cons, bq);
+	ok_int(bq_check(bq, size / 2 + 1, 4), 0, "data split across the end is intact");
+
+	/* wakeups are only sent when the consumer asked for them */
+	ok_uint(shmring_prepare_wait(cons), 0, "prepare_wait on empty ring");
+	for (i = 0; i < 3; i++)
+		shmring_push(prod, "x", 1);
+	ok_uint(shmring_used(cons), 3, "data available after wakeup");
+	{
+		uint64_t count = 0;
+		ok_int(read(shmring_event_fd(cons), &count, sizeof(count)), sizeof(count), "eventfd was signalled");
+		ok_int((int)count, 1, "only one wakeup for several pushes");
+	}
+	shmring_finish_wait(cons);
+	shmring_drain(cons, bq);
+
+	nm_bufferqueue_destroy(bq);
+	shmring_destroy(cons);
+	shmring_destroy(prod);
+
+	return t_end();
+}
@@ -0,0 +1,131 @@
+#include "test_utils.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define T_ASSERT(pred, msg) do {\
+	if ((pred)) { t_pass("%s: %s", __FUNCTION__, msg); } else { t_fail("%s: %s", __FUNCTION__, msg); } \
+	} while (0)
+
+static void test_host_states(void)
+{
+	state_init();
+	T_ASSERT(host_has_new_state("foo", 0, 1), "first state of a host is new");
+	T_ASSERT(!host_has_new_state("foo", 0, 1), "same state again isn't new");
+	T_ASSERT(host_has_new_state("foo", 1, 0), "soft problem state is new");
+	T_ASSERT(!host_has_new_state("foo", 1, 0), "next soft attempt isn't new");
+	T_ASSERT(host_has_new_state("foo", 1, 1), "going hard is new");
+	T_ASSERT(host_has_new_state("bar", 1, 1), "other hosts are tracked separately");
+	T_ASSERT(!host_has_new_state(NULL, 0, 1), "NULL host is ignored");
+	state_deinit();
+}
+
+static void test_service_states(void)
+{
+	state_init();
+	T_ASSERT(service_has_new_state("foo", "disk", 0, 1), "first state of a service is new");
+	T_ASSERT(!service_has_new_state("foo", "disk", 0, 1), "same state again isn't new");
+	T_ASSERT(service_has_new_state("bar", "disk", 0, 1), "same description on another host is a different service");
+	T_ASSERT(host_has_new_state("foo", 0, 1), "host with only services seen has no state yet");
+	T_ASSERT(service_has_new_state("foo", "disk", 2, 1), "state change is new");
+	T_ASSERT(!service_has_new_state("foo", NULL, 0, 1), "NULL description is ignored");
+	state_deinit();
+}
+
+/* more objects than the tables start out with, so they have to grow */
+static void test_growth(void)
+{
+	char host[32], desc[32];
+	unsigned int i, news = 0, olds = 0;
+
+	state_init();
+	for (i = 0; i < 100000; i++) {
+		sprintf(host, "host%u", i / 10);
+		sprintf(desc, "service%u", i % 10);
+		news += service_has_new_state(host, desc, 0, 1);
+	}
+	for (i = 0; i < 100000; i++) {
+		sprintf(host, "host%u", i / 10);
+		sprintf(desc, "service%u", i % 10);
+		olds += !service_has_new_state(host, desc, 0, 1);
+	}
+	T_ASSERT(news == 100000, "all services are new the first time around");
+	T_ASSERT(olds == 100000, "all services are found the second time around");
+	state_deinit();
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Run as "statetest --bench [objects]" to see how fast lookups are
+ * and how much memory the tables use, with 20 services per host.
+ */
+static void bench(unsigned int objects)
+{
+	char **host, **desc;
+	struct timespec start;
+	unsigned int i, round, changes = 0;
+	double secs;
+
+	host = malloc(objects * sizeof(*host));
+	desc = malloc(objects * sizeof(*desc));
+	for (i = 0; i < objects; i++) {
+		char buf[64];
+
+		sprintf(buf, "host-%u.example.com", i / 20);
+		host[i] = strdup(buf);
+		sprintf(buf, "Service check number %u", i % 20);
+		desc[i] = strdup(buf);
+	}
+
+	state_init();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < objects; i++)
+		changes += service_has_new_state(host[i], desc[i], 0, 1);
+	secs = elapsed(&start);
+	printf("inserted %u services in %.3fs (%.0f/s), using %zu bytes (%.1f bytes/service)\n",
+	       changes, secs, objects / secs, state_memory_usage(),
+	       (double)state_memory_usage() / objects);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < 5; round++) {
+		for (i = 0; i < objects; i++)
+			changes += service_has_new_state(host[i], desc[i], round & 1, 1);
+	}
+	secs = elapsed(&start);
+	printf("looked up %u services in %.3fs (%.0f/s)\n",
+	       objects * 5, secs, objects * 5 / secs);
+	state_deinit();
+
+	for (i = 0; i < objects; i++) {
+		free(host[i]);
+		free(desc[i]);
+	}
+	free(host);
+	free(desc);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		bench(argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000);
+		return 0;
+	}
+
+	t_set_colors(0);
+	t_verbose = 1;
+
+	t_start("testing state tracking");
+	test_host_states();
+	test_service_states();
+	test_growth();
+
+	return t_end();
+}
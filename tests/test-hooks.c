@@ -2,6 +2,10 @@
 #include "hooks.c"
 #include "node.h"
 #include <check.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <naemon/naemon.h>
 
@@ -66,12 +70,18 @@ int ipc_is_connected(__attribute__((unused)) int msec) { return 0; }
 void ipc_init_struct(void) {}
 void ipc_deinit(void) {}
 int dump_nodeinfo(__attribute__((unused)) merlin_node *n, __attribute__((unused)) int sd, __attribute__((unused)) int instance_id) {return 0;}
+int ipc_shm_offer(void) { return 0; }
+int ipc_shm_ctrl(__attribute__((unused)) merlin_event *pkt) { return 0; }
+void ipc_shm_close(void) {}
+unsigned int ipc_shm_flush(void) { return 0; }
 
 
 static merlin_event last_decoded_event;
+static unsigned int ipc_events_sent;
 int ipc_send_event(merlin_event *pkt) {
-	merlin_decode_event(merlin_sender, pkt);
-	memcpy(&last_decoded_event, pkt, sizeof(merlin_event));
+	ipc_events_sent++;
+	memcpy(&last_decoded_event, pkt, packet_size(pkt));
+	merlin_decode_event(merlin_sender, &last_decoded_event);
 	return 0;
 }
 int ipc_grok_var(__attribute__((unused)) char *var, __attribute__((unused)) char *val) {return 1;}
@@ -214,6 +224,46 @@ START_TEST(test_callback_service_check)
 }
 END_TEST
 
+START_TEST(test_dedup_interleaved)
+{
+	host *a, *b;
+	int event_type = NEBTYPE_PROCESS_EVENTLOOPSTART;
+	nebstruct_host_check_data ev_data = {0,};
+
+	init_objects_host(2);
+	a = create_host("host-a");
+	register_host(a);
+	b = create_host("host-b");
+	register_host(b);
+
+	post_config_init(0, &event_type);
+
+	ev_data.type = NEBTYPE_HOSTCHECK_PROCESSED;
+	ev_data.attr = NEBATTR_CHECK_ALERT;
+	ev_data.end_time.tv_sec = time(NULL);
+	ev_data.object_ptr = a;
+	merlin_mod_hook(NEBCALLBACK_HOST_CHECK_DATA, &ev_data);
+	ev_data.object_ptr = b;
+	merlin_mod_hook(NEBCALLBACK_HOST_CHECK_DATA, &ev_data);
+	ck_assert_str_eq(((merlin_host_status *)last_decoded_event.body)->name, b->name);
+
+	/* same state for 'a' again, with another object in between */
+	memset(&last_decoded_event, 0, sizeof(merlin_event));
+	ev_data.object_ptr = a;
+	merlin_mod_hook(NEBCALLBACK_HOST_CHECK_DATA, &ev_data);
+	ck_assert_int_eq(last_decoded_event.hdr.type, 0);
+	ck_assert_int_eq(dedup_stats[NEBCALLBACK_HOST_CHECK_DATA].dupes, 1);
+
+	/* a state change must go through */
+	a->current_state = STATE_DOWN;
+	merlin_mod_hook(NEBCALLBACK_HOST_CHECK_DATA, &ev_data);
+	ck_assert_int_eq(last_decoded_event.hdr.type, NEBCALLBACK_HOST_CHECK_DATA);
+	ck_assert_int_eq(dedup_stats[NEBCALLBACK_HOST_CHECK_DATA].dupes, 1);
+
+	destroy_objects_host();
+}
+END_TEST
+
 START_TEST(set_clear_svc_expire)
 {
 	merlin_event pkt = {{{0,},0,0,0,0,0,{0,},{0}},{0}};
@@ -274,6 +324,211 @@ START_TEST(set_clear_host_expire)
 }
 END_TEST
 
+/*
+ * Sends more host checks from a peer than we can apply in one go,
+ * closes the connection and checks that they're all applied anyway
+ */
+/* connects "node" to a socket with "events" host checks waiting in it */
+static void queue_host_checks(merlin_node *node, unsigned int events)
+{
+	merlin_host_status st_obj;
+	merlin_event pkt;
+	unsigned int i;
+	int sv[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+
+	memset(&pkt, 0, sizeof(pkt));
+	memset(&st_obj, 0, sizeof(st_obj));
+	pkt.hdr.sig.id = MERLIN_SIGNATURE;
+	pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	pkt.hdr.type = NEBCALLBACK_HOST_CHECK_DATA;
+	st_obj.name = host_ary[0]->name;
+	pkt.hdr.len = merlin_encode_event(&pkt, &st_obj);
+	for (i = 0; i < events; i++)
+		ck_assert_int_eq(write(sv[1], &pkt, packet_size(&pkt)), packet_size(&pkt));
+	close(sv[1]);
+}
+
+/* lets the I/O broker run until "events" events have been applied */
+static void poll_events(unsigned int events)
+{
+	unsigned int polls;
+
+	for (polls = 0; ipc_events_sent < events && polls < 100; polls++)
+		iobroker_poll(nagios_iobs, 10);
+}
+
+static void check_inbound_drained(unsigned int events)
+{
+	merlin_node *node = node_table[0];
+	unsigned int reads;
+
+	queue_host_checks(node, events);
+
+	/* a single event uses up all of the budget */
+	inbound_budget = 1;
+	ipc_events_sent = 0;
+	for (reads = 0; node->sock >= 0 && reads < 100; reads++)
+		net_input(node->sock, 0, node);
+	ck_assert_msg(node->sock < 0, "Node should be disconnected on EOF");
+	poll_events(events);
+	inbound_budget = 20000;
+
+	ck_assert_int_eq(ipc_events_sent, events);
+	ck_assert_int_eq(nm_bufferqueue_get_available(node->bq), 0);
+}
+
+START_TEST(inbound_drained_on_eof)
+{
+	/* apply events in the main thread */
+	if (inbound_running()) {
+		iobroker_close(nagios_iobs, inbound_ready_fd());
+		inbound_deinit();
+	}
+	check_inbound_drained(50);
+}
+END_TEST
+
+START_TEST(inbound_worker_drained_on_eof)
+{
+	ck_assert_msg(inbound_running(), "Inbound worker should be running");
+	check_inbound_drained(50);
+	ck_assert_msg(inbound_idle(), "Nothing should be left in the inbound pipeline");
+}
+END_TEST
+
+START_TEST(disconnect_defers_input)
+{
+	merlin_node *node = node_table[0], *other = node_table[1];
+	void *applying = host_ary[1];
+
+	queue_host_checks(other, 5);
+	ck_assert(node_recv(other) > 0);
+	queue_host_checks(node, 5);
+	ck_assert(node_recv(node) > 0);
+
+	/* as if we were in the middle of applying one of other's events */
+	ipc_events_sent = 0;
+	merlin_recv_object = applying;
+	node_disconnect(node, "Test");
+	ck_assert_int_eq(ipc_events_sent, 0);
+	ck_assert_msg(merlin_recv_object == applying,
+	              "Disconnecting mustn't touch the event being applied");
+	merlin_recv_object = NULL;
+
+	poll_events(10);
+	ck_assert_int_eq(ipc_events_sent, 10);
+	ck_assert_int_eq(nm_bufferqueue_get_available(node->bq), 0);
+	node_disconnect(other, "Test");
+}
+END_TEST
+
+/* pretend the node has pulsed every 10 seconds, last time "ago" ms ago */
+static void fake_pulses(merlin_node *node, unsigned int ago)
+{
+	struct merlin_liveness *l = &node->liveness;
+	unsigned int i;
+
+	memset(l, 0, sizeof(*l));
+	for (i = 0; i < 10; i++)
+		l->interval[i] = 10000;
+	l->count = l->next = 10;
+	gettimeofday(&l->last, NULL);
+	l->last.tv_sec -= ago / 1000;
+	node->last_recv = l->last.tv_sec;
+}
+
+START_TEST(suspect_node_keeps_its_checks)
+{
+	merlin_node *node = node_table[0];
+	unsigned int active = ipc.pgroup->active_nodes;
+	int sv[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	node->sock = sv[0];
+	node->data_timeout = 60;
+
+	fake_pulses(node, 20000);
+	net_check_activity(node);
+	ck_assert_msg(node->liveness.suspect, "A node 10 seconds late should be suspect");
+	ck_assert_int_eq(node->state, STATE_CONNECTED);
+	ck_assert_msg(ipc.pgroup->active_nodes == active,
+	              "Only we suspect the node, so it must keep its checks");
+
+	/* its pulse may be stuck behind lots of other data */
+	fake_pulses(node, 30000);
+	node->last_recv = time(NULL);
+	net_check_activity(node);
+	ck_assert_msg(node->state == STATE_CONNECTED, "Nodes still sending data aren't dead");
+
+	fake_pulses(node, 30000);
+	net_check_activity(node);
+	ck_assert_int_eq(node->state, STATE_NONE);
+	ck_assert_msg(ipc.pgroup->active_nodes == active - 1,
+	              "A dead node's checks should be taken over");
+	close(sv[1]);
+}
+END_TEST
+
+static void send_ctrl(int sd, int code, const void *body, unsigned int len)
+{
+	merlin_event pkt;
+
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.sig.id = MERLIN_SIGNATURE;
+	pkt.hdr.protocol = MERLIN_PROTOCOL_VERSION;
+	pkt.hdr.type = CTRL_PACKET;
+	pkt.hdr.code = code;
+	pkt.hdr.selection = CTRL_GENERIC;
+	pkt.hdr.len = len;
+	memcpy(pkt.body, body, len);
+	ck_assert_int_eq(write(sd, &pkt, packet_size(&pkt)), packet_size(&pkt));
+}
+
+/* pulses count from when we read them, and nothing else counts */
+START_TEST(pulse_arrival)
+{
+	merlin_node *node = node_table[0];
+	struct merlin_liveness *l = &node->liveness;
+	struct merlin_pulse pulse;
+	struct timeval read_at, last;
+	merlin_event *pkt;
+	int sv[2];
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	node->sock = sv[0];
+	memset(l, 0, sizeof(*l));
+
+	memset(&pulse, 0, sizeof(pulse));
+	send_ctrl(sv[1], CTRL_PULSE, &pulse, sizeof(pulse));
+	ck_assert(node_recv(node) > 0);
+	gettimeofday(&read_at, NULL);
+	usleep(100000);
+	ck_assert((pkt = node_get_event(node)) != NULL);
+	free(pkt);
+	ck_assert_msg(l->last.tv_sec != 0, "A pulse should be recorded");
+	ck_assert_msg(l->last.tv_sec < read_at.tv_sec ||
+	              (l->last.tv_sec == read_at.tv_sec && l->last.tv_usec <= read_at.tv_usec),
+	              "A pulse should count as arriving when it was read");
+	last = l->last;
+
+	send_ctrl(sv[1], CTRL_ACTIVE, &ipc.info, sizeof(ipc.info));
+	pulse.echo = 1;
+	send_ctrl(sv[1], CTRL_PULSE, &pulse, sizeof(pulse));
+	ck_assert(node_recv(node) > 0);
+	while ((pkt = node_get_event(node)))
+		free(pkt);
+	ck_assert_msg(!memcmp(&l->last, &last, sizeof(last)) && !l->count,
+	              "Only pulses we're not echoing count as heartbeats");
+
+	close(sv[1]);
+}
+END_TEST
+
 START_TEST(multiple_svc_expire)
 {
 	void *first_user_data;
@@ -358,6 +613,544 @@ START_TEST(multiple_host_expire)
 }
 END_TEST
 
+START_TEST(test_output_reuse)
+{
+	char *cur = strdup("OK - all is well"), *ret;
+
+	memset(&merlin_output_stats, 0, sizeof(merlin_output_stats));
+	ret = net2mod_strdup(cur, "OK - all is well");
+	ck_assert_msg(ret == cur, "Unchanged output should be reused");
+	ck_assert_int_eq(merlin_output_stats.reused, 1);
+	ck_assert_int_eq(merlin_output_stats.bytes_reused, strlen(cur) + 1);
+
+	ret = net2mod_strdup(cur, "CRITICAL - all is not well");
+	ck_assert_msg(ret != cur, "Changed output should be copied");
+	ck_assert_str_eq(ret, "CRITICAL - all is not well");
+	ck_assert_int_eq(merlin_output_stats.copied, 1);
+	free(ret);
+
+	ck_assert_msg(net2mod_strdup(cur, NULL) == NULL, "Missing output should stay missing");
+	ret = net2mod_strdup(NULL, "OK");
+	ck_assert_str_eq(ret, "OK");
+	free(ret);
+	free(cur);
+}
+END_TEST
+
+/* the other end of node_table[0]'s connection */
+static int snap_sd = -1;
+
+static void snapshot_setup(void)
+{
+	int sv[2];
+
+	expiration_setup();
+
+	/* with both peers gone, we own all objects */
+	node_set_state(node_table[0], STATE_NONE, "Fake disconnected");
+	node_set_state(node_table[1], STATE_NONE, "Fake disconnected");
+	pgroup_assign_peer_ids(ipc.pgroup);
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	node_table[0]->sock = sv[0];
+	node_table[0]->state = STATE_CONNECTED;
+	snap_sd = sv[1];
+}
+
+static void snapshot_teardown(void)
+{
+	close(snap_sd);
+	expiration_teardown();
+}
+
+/* reads the next packet we sent to node_table[0] */
+static merlin_event *snapshot_read(void)
+{
+	merlin_event *pkt = malloc(sizeof(*pkt));
+
+	if (read(snap_sd, &pkt->hdr, HDR_SIZE) != HDR_SIZE) {
+		free(pkt);
+		return NULL;
+	}
+	ck_assert_int_eq(read(snap_sd, pkt->body, pkt->hdr.len), pkt->hdr.len);
+	return pkt;
+}
+
+#define SET_STATE(obj, when, st, output) do { \
+	(obj)->has_been_checked = 1; \
+	(obj)->last_check = (when); \
+	(obj)->last_state_change = (when) - 100; \
+	(obj)->last_hard_state_change = (when) - 200; \
+	(obj)->current_state = (st); \
+	(obj)->last_hard_state = (st); \
+	(obj)->state_type = HARD_STATE; \
+	(obj)->current_attempt = 1; \
+	free((obj)->plugin_output); \
+	(obj)->plugin_output = strdup(output); \
+	} while (0)
+
+START_TEST(snapshot_round_trip)
+{
+	merlin_event *hosts, *services;
+	merlin_host_status *hst;
+	char long_output[5000];
+	unsigned int i;
+
+	memset(long_output, 'x', sizeof(long_output) - 1);
+	long_output[sizeof(long_output) - 1] = 0;
+	for (i = 0; i < 3; i++) {
+		SET_STATE(host_ary[i], 1000 + i, STATE_DOWN, "host is down");
+		SET_STATE(service_ary[i], 2000 + i, STATE_CRITICAL, "service is critical");
+	}
+	SET_STATE(host_ary[2], 1002, STATE_DOWN, long_output);
+
+	ck_assert_int_eq(snapshot_send(node_table[0]), 0);
+	hosts = snapshot_read();
+	services = snapshot_read();
+	ck_assert_msg(hosts && services, "Snapshot should be one packet each for hosts and services");
+	ck_assert_msg(snapshot_read() == NULL, "Snapshot should be one packet each for hosts and services");
+	ck_assert_int_eq(hosts->hdr.code, CTRL_SNAPSHOT);
+	ck_assert_int_eq(((struct merlin_snapshot *)hosts->body)->count, 3);
+
+	/* what the receiving peer knew before */
+	for (i = 0; i < 3; i++) {
+		SET_STATE(host_ary[i], 500, STATE_UP, "host is up");
+		SET_STATE(service_ary[i], 500, STATE_CRITICAL, "service was critical");
+	}
+	SET_STATE(host_ary[1], 5000, STATE_UNREACHABLE, "newer than the snapshot");
+	service_ary[0]->has_been_checked = 0;
+
+	ipc_events_sent = 0;
+	ck_assert_int_eq(snapshot_apply(node_table[0], hosts), 2);
+	ck_assert_int_eq(host_ary[0]->current_state, STATE_DOWN);
+	ck_assert_int_eq(host_ary[0]->last_check, 1000);
+	ck_assert_int_eq(host_ary[0]->last_state_change, 900);
+	ck_assert_int_eq(host_ary[0]->last_hard_state_change, 800);
+	ck_assert_int_eq(host_ary[0]->state_type, HARD_STATE);
+	ck_assert_str_eq(host_ary[0]->plugin_output, "host is down");
+	ck_assert_msg(host_ary[1]->last_check == 5000, "Newer results must not be overwritten");
+	ck_assert_str_eq(host_ary[1]->plugin_output, "newer than the snapshot");
+	ck_assert_int_eq(strlen(host_ary[2]->plugin_output), 4095);
+
+	/* the daemon must hear about the state changes */
+	ck_assert_int_eq(ipc_events_sent, 2);
+	ck_assert_int_eq(last_decoded_event.hdr.type, NEBCALLBACK_HOST_CHECK_DATA);
+	hst = (merlin_host_status *)last_decoded_event.body;
+	ck_assert_str_eq(hst->name, host_ary[2]->name);
+	ck_assert_int_eq(hst->nebattr, NEBATTR_CHECK_ALERT);
+	ck_assert_int_eq(hst->state.current_state, STATE_DOWN);
+	ck_assert_int_eq(hst->state.last_check, 902);
+
+	/* only the service we hadn't seen a result for changes state */
+	ipc_events_sent = 0;
+	ck_assert_int_eq(snapshot_apply(node_table[0], services), 3);
+	ck_assert_int_eq(service_ary[0]->last_check, 2000);
+	ck_assert_str_eq(service_ary[2]->plugin_output, "service is critical");
+	ck_assert_int_eq(ipc_events_sent, 1);
+	ck_assert_int_eq(last_decoded_event.hdr.type, NEBCALLBACK_SERVICE_CHECK_DATA);
+
+	services->hdr.len = sizeof(struct merlin_snapshot) + 10;
+	ck_assert_msg(snapshot_apply(node_table[0], services) < 0, "Truncated snapshots should be rejected");
+
+	free(hosts);
+	free(services);
+}
+END_TEST
+
+/* the backlog it replaces has results for objects the peer owns too */
+START_TEST(snapshot_has_all_objects)
+{
+	merlin_event *hosts, *services;
+	unsigned int i;
+
+	node_set_state(node_table[1], STATE_CONNECTED, "Fake connected");
+	pgroup_assign_peer_ids(ipc.pgroup);
+	ck_assert_int_eq(ipc.pgroup->active_nodes, 3);
+	for (i = 0; i < 3; i++) {
+		SET_STATE(host_ary[i], 1000 + i, STATE_DOWN, "host is down");
+		SET_STATE(service_ary[i], 2000 + i, STATE_CRITICAL, "service is critical");
+	}
+
+	ck_assert_int_eq(snapshot_send(node_table[0]), 0);
+	hosts = snapshot_read();
+	services = snapshot_read();
+	ck_assert_msg(hosts && services, "Snapshot should be one packet each for hosts and services");
+	ck_assert_int_eq(((struct merlin_snapshot *)hosts->body)->count, 3);
+	ck_assert_int_eq(((struct merlin_snapshot *)services->body)->count, 3);
+	free(hosts);
+	free(services);
+}
+END_TEST
+
+START_TEST(snapshot_skips_backlog)
+{
+	merlin_node *node = node_table[0];
+	merlin_event ev, *pkt;
+	unsigned int events = 0;
+
+	memset(&ev.hdr, 0, HDR_SIZE);
+	ev.hdr.len = 16;
+	ev.hdr.type = NEBCALLBACK_HOST_CHECK_DATA;
+	node_binlog_add(node, &ev);
+	ev.hdr.type = NEBCALLBACK_SERVICE_STATUS_DATA;
+	node_binlog_add(node, &ev);
+	ev.hdr.type = NEBCALLBACK_DOWNTIME_DATA;
+	node_binlog_add(node, &ev);
+
+	SET_STATE(host_ary[0], 1000, STATE_DOWN, "host is down");
+	ck_assert_int_eq(snapshot_send(node), 0);
+	ck_assert_int_eq(node->resync_skip, 3);
+	while ((pkt = snapshot_read())) {
+		ck_assert_int_eq(pkt->hdr.code, CTRL_SNAPSHOT);
+		free(pkt);
+	}
+
+	/* the state events are redundant now, but the downtime isn't */
+	ck_assert_int_eq(node_drain_backlog(node, 100), 0);
+	while ((pkt = snapshot_read())) {
+		ck_assert_int_eq(pkt->hdr.type, NEBCALLBACK_DOWNTIME_DATA);
+		events++;
+		free(pkt);
+	}
+	ck_assert_int_eq(events, 1);
+	ck_assert_int_eq(node->resync_skip, 0);
+}
+END_TEST
+
+START_TEST(backlog_drain_deadline)
+{
+	merlin_node *node = node_table[0];
+	merlin_event ev, *pkt;
+	struct timeval deadline;
+	unsigned int i, events = 0;
+
+	memset(&ev.hdr, 0, HDR_SIZE);
+	ev.hdr.len = 16;
+	ev.hdr.type = NEBCALLBACK_DOWNTIME_DATA;
+	for (i = 0; i < 3; i++)
+		node_binlog_add(node, &ev);
+
+	/* a deadline other nodes have used up leaves nothing for this one */
+	node_drain_deadline(&deadline, 0);
+	ck_assert_int_eq(node_drain_backlog_until(node, &deadline), 3);
+	ck_assert_msg(snapshot_read() == NULL, "Nothing should be sent past the deadline");
+
+	ck_assert_int_eq(node_drain_backlog(node, 100), 0);
+	while ((pkt = snapshot_read())) {
+		events++;
+		free(pkt);
+	}
+	ck_assert_int_eq(events, 3);
+}
+END_TEST
+
+/* the other end of each node's connection, in node_table order */
+static int relay_sd[5];
+
+static void relay_setup(void)
+{
+	unsigned int i;
+
+	num_peer_groups = 0;
+	peer_group = NULL;
+	nagios_iobs = iobroker_create();
+	nebmodule_init(0, "tests/relay.conf", NULL);
+	ipc.name = "Local";
+	ipc.sock = -1;
+	relay_to_masters = 0;
+
+	for (i = 0; i < num_nodes; i++) {
+		int sv[2];
+
+		ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+		fcntl(sv[1], F_SETFL, O_NONBLOCK);
+		node_table[i]->sock = sv[0];
+		node_table[i]->state = STATE_CONNECTED;
+		relay_sd[i] = sv[1];
+	}
+}
+
+static void relay_teardown(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_nodes; i++)
+		close(relay_sd[i]);
+	relay_to_masters = 0;
+	iobroker_destroy(nagios_iobs, IOBROKER_CLOSE_SOCKETS);
+	nebmodule_deinit(0, 0);
+}
+
+/* returns the number of events a node got, with the header of the last one in "hdr" */
+static unsigned int relay_received(unsigned int node, merlin_header *hdr)
+{
+	merlin_event pkt;
+	unsigned int events = 0;
+
+	while (read(relay_sd[node], &pkt.hdr, HDR_SIZE) == HDR_SIZE) {
+		ck_assert_int_eq(read(relay_sd[node], pkt.body, pkt.hdr.len), pkt.hdr.len);
+		if (pkt.hdr.type == CTRL_PACKET)
+			continue;
+		*hdr = pkt.hdr;
+		events++;
+	}
+	return events;
+}
+
+/* a notification from the poller, which asks us to relay it to our peers */
+static void relay_from_poller(void)
+{
+	merlin_event *pkt = calloc(1, sizeof(*pkt));
+
+	pkt->hdr.type = NEBCALLBACK_CONTACT_NOTIFICATION_METHOD_DATA;
+	pkt->hdr.len = 64;
+	pkt->hdr.relay = 1;
+	handle_event(poller_table[0], pkt);
+	free(pkt);
+}
+
+START_TEST(relay_without_relay_to_masters)
+{
+	merlin_header hdr;
+
+	relay_from_poller();
+
+	ck_assert_int_eq(relay_received(0, &hdr), 1);
+	ck_assert_msg(!hdr.relay, "Masters must not relay events we sent to all of them");
+	ck_assert_int_eq(relay_received(1, &hdr), 1);
+	ck_assert_msg(!hdr.relay, "Masters must not relay events we sent to all of them");
+	ck_assert_int_eq(relay_received(2, &hdr), 1);
+	ck_assert_int_eq(hdr.hops, 1);
+	ck_assert_msg(!hdr.relay, "Peers must not relay events further");
+}
+END_TEST
+
+START_TEST(relay_with_relay_to_masters)
+{
+	merlin_header hdr;
+
+	relay_to_masters = 1;
+	relay_from_poller();
+
+	ck_assert_int_eq(relay_received(0, &hdr), 1);
+	ck_assert_msg(hdr.relay, "Our relaying master should be asked to relay the event");
+	ck_assert_int_eq(hdr.hops, 0);
+	ck_assert_int_eq(relay_received(1, &hdr), 0);
+	ck_assert_int_eq(relay_received(2, &hdr), 1);
+	ck_assert_int_eq(hdr.hops, 1);
+	ck_assert_msg(!hdr.relay, "Peers must not relay events further");
+	ck_assert_int_eq(hdr.origin, poller_table[0]->sain.sin_addr.s_addr);
+	ck_assert_int_eq(hdr.origin_port, poller_table[0]->sain.sin_port);
+}
+END_TEST
+
+/* both pollers run on the same address, so the port tells them apart */
+START_TEST(relay_origin_by_port)
+{
+	merlin_node *peer = node_table[2];
+	merlin_event pkt;
+
+	ck_assert_int_eq(num_pollers, 2);
+	memset(&pkt.hdr, 0, HDR_SIZE);
+	pkt.hdr.hops = 1;
+	pkt.hdr.origin = poller_table[1]->sain.sin_addr.s_addr;
+	pkt.hdr.origin_port = poller_table[1]->sain.sin_port;
+	ck_assert_msg(net_relay_origin(peer, &pkt) == poller_table[1],
+	              "Relayed events should be credited to the poller that sent them");
+	pkt.hdr.origin_port = poller_table[0]->sain.sin_port;
+	ck_assert_msg(net_relay_origin(peer, &pkt) == poller_table[0],
+	              "Relayed events should be credited to the poller that sent them");
+	pkt.hdr.origin_port = htons(1);
+	ck_assert_msg(net_relay_origin(peer, &pkt) == peer,
+	              "Events from unknown pollers should be blamed on the peer");
+}
+END_TEST
+
+static double phi_after(const uint32_t *interval, unsigned int count, unsigned int ms)
+{
+	merlin_node node;
+	struct timeval now = { 1000000, 0 };
+
+	memset(&node, 0, sizeof(node));
+	memcpy(node.liveness.interval, interval, count * sizeof(*interval));
+	node.liveness.count = count;
+	node.liveness.last.tv_sec = now.tv_sec - ms / 1000;
+	node.liveness.last.tv_usec = (ms % 1000) * 1000;
+	if (node.liveness.last.tv_usec) {
+		node.liveness.last.tv_sec--;
+		node.liveness.last.tv_usec = 1000000 - node.liveness.last.tv_usec;
+	}
+	return node_phi(&node, &now);
+}
+
+#define ck_assert_phi(phi, expect, tol) \
+	ck_assert_msg(fabs((phi) - (expect)) < (tol), "phi should be %f, not %f", (double)(expect), (phi))
+
+START_TEST(test_node_phi)
+{
+	uint32_t steady[] = { 10000, 10000, 10000, 10000, 10000 };
+	uint32_t jittery[] = { 5000, 15000, 5000, 15000, 5000, 15000 };
+
+	/* half of all pulses arrive later than the mean */
+	ck_assert_phi(phi_after(steady, 5, 10000), log10(2), 1e-9);
+	ck_assert_phi(phi_after(steady, 5, 0), 0, 1e-4);
+	/* a steady link's deviation is floored at a quarter of the mean */
+	ck_assert_phi(phi_after(steady, 5, 12500), 0.7995, 1e-4);
+	ck_assert_phi(phi_after(steady, 5, 20000), 4.7367, 1e-4);
+	ck_assert_phi(phi_after(steady, 5, 22500), 7.2999, 1e-4);
+	ck_assert_phi(phi_after(steady, 5, 30000), 21.2416, 1e-4);
+	ck_assert_phi(phi_after(steady, 5, 1000000), 300, 1e-9);
+	/* real deviation counts when it's larger */
+	ck_assert_phi(phi_after(jittery, 6, 10000), log10(2), 1e-9);
+	ck_assert_phi(phi_after(jittery, 6, 20000), 1.6428, 1e-4);
+	ck_assert_phi(phi_after(jittery, 6, 30000), 4.7367, 1e-4);
+	/* sub-second precision */
+	ck_assert_msg(phi_after(steady, 5, 20500) > phi_after(steady, 5, 20000),
+	              "phi should grow as the pulse gets later");
+}
+END_TEST
+
+static char cfg_dir[PATH_MAX], cfg_path[PATH_MAX], cache_path[PATH_MAX];
+static const char *default_cfg_hash_cache;
+
+static void write_cfg(const char *name, const char *content)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/objects/%s", cfg_dir, name);
+	fp = fopen(path, "w");
+	ck_assert_msg(fp != NULL, "Failed to create %s", path);
+	fputs(content, fp);
+	fclose(fp);
+}
+
+static void remove_cfg(const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/objects/%s", cfg_dir, name);
+	ck_assert_int_eq(unlink(path), 0);
+}
+
+static void cfghash_setup(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	strcpy(cfg_dir, "/tmp/merlin-cfghash-XXXXXX");
+	ck_assert(mkdtemp(cfg_dir) != NULL);
+	snprintf(path, sizeof(path), "%s/objects", cfg_dir);
+	ck_assert_int_eq(mkdir(path, 0755), 0);
+
+	snprintf(cfg_path, sizeof(cfg_path), "%s/naemon.cfg", cfg_dir);
+	fp = fopen(cfg_path, "w");
+	ck_assert(fp != NULL);
+	fputs("cfg_dir=objects\n", fp);
+	fclose(fp);
+	config_file = cfg_path;
+
+	snprintf(cache_path, sizeof(cache_path), "%s/config-hash.cache", cfg_dir);
+	default_cfg_hash_cache = cfg_hash_cache;
+	cfg_hash_cache = cache_path;
+}
+
+static void cfghash_teardown(void)
+{
+	char cmd[PATH_MAX + 10];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", cfg_dir);
+	if (system(cmd))
+		fprintf(stderr, "Failed to remove %s\n", cfg_dir);
+	config_file = NULL;
+	cfg_hash_cache = default_cfg_hash_cache;
+}
+
+static const char *config_hash(void)
+{
+	unsigned char hash[20];
+
+	ck_assert_int_eq(get_config_info(hash, NULL), 0);
+	return tohex(hash, 20);
+}
+
+/* replace every cached digest with zeroes, so we can tell it's used */
+static void zero_cached_digests(void)
+{
+	unsigned int i, num_files = 0;
+	file_list **flist;
+	FILE *fp;
+
+	flist = get_sorted_oconf_files(&num_files);
+	fp = fopen(cache_path, "w");
+	ck_assert(fp != NULL);
+	fputs("# merlin config hash cache v1\n", fp);
+	for (i = 0; i < num_files; i++) {
+		fprintf(fp, "%lu %lld %lld.%ld %040d %s\n",
+		        (unsigned long)flist[i]->st.st_ino, (long long)flist[i]->st.st_size,
+		        (long long)flist[i]->st.st_mtim.tv_sec, flist[i]->st.st_mtim.tv_nsec,
+		        0, flist[i]->name);
+		flist[i]->next = NULL;
+		file_list_free(flist[i]);
+	}
+	fclose(fp);
+	free(flist);
+}
+
+/* the config hash is compared between nodes, so it must never change */
+START_TEST(config_hash_vectors)
+{
+	char name[16], content[16];
+	unsigned int i;
+
+	/* a single file's hash is its digest, as oconfsplit expects */
+	write_cfg("hosts.cfg", "define host {\n}\n");
+	ck_assert_str_eq(config_hash(), "96f4f35ebf1ff10b5ee34d3c9f73e3fdc5f6e2d9");
+
+	/* otherwise it's the digest of the digests, sorted by path */
+	write_cfg("empty.cfg", "");
+	ck_assert_str_eq(config_hash(), "3db053a4316212b0797b892a290b7685fd215b2b");
+
+	/* enough files to be hashed in several threads */
+	unlink(cache_path);
+	remove_cfg("hosts.cfg");
+	remove_cfg("empty.cfg");
+	write_cfg("README", "not object config");
+	for (i = 0; i < 20; i++) {
+		sprintf(name, "f%02u.cfg", i);
+		sprintf(content, "# file %02u\n", i);
+		write_cfg(name, content);
+	}
+	ck_assert_str_eq(config_hash(), "297f2f10ab149624e754b5a469f92901f2382392");
+}
+END_TEST
+
+START_TEST(config_hash_cache)
+{
+	struct stat st;
+
+	write_cfg("hosts.cfg", "define host {\n}\n");
+	write_cfg("empty.cfg", "");
+	ck_assert_str_eq(config_hash(), "3db053a4316212b0797b892a290b7685fd215b2b");
+	ck_assert_msg(stat(cache_path, &st) == 0, "Digests should be cached after hashing");
+
+	/* nothing changed, so the cached digests are used */
+	zero_cached_digests();
+	ck_assert_str_eq(config_hash(), "b80de5d138758541c5f05265ad144ab9fa86d1db");
+
+	/* a changed file is hashed again, while the others still aren't */
+	write_cfg("hosts.cfg", "define service {\n}\n");
+	ck_assert_str_eq(config_hash(), "b3176f5a48e716a04a98a1b0d57f0de7368cea84");
+
+	/* caches we don't understand are ignored */
+	zero_cached_digests();
+	ck_assert_int_eq(truncate(cache_path, 10), 0);
+	write_cfg("hosts.cfg", "define host {\n}\n");
+	ck_assert_str_eq(config_hash(), "3db053a4316212b0797b892a290b7685fd215b2b");
+}
+END_TEST
+
 Suite *
 check_hooks_suite(void)
 {
@@ -367,6 +1160,8 @@ check_hooks_suite(void)
 	tcase_add_checked_fixture (tc, general_setup, general_teardown);
 	tcase_add_test(tc, test_callback_host_check);
 	tcase_add_test(tc, test_callback_service_check);
+	tcase_add_test(tc, test_dedup_interleaved);
+	tcase_add_test(tc, test_output_reuse);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("expiration");
@@ -375,6 +1170,36 @@ check_hooks_suite(void)
 	tcase_add_test(tc, set_clear_svc_expire);
 	tcase_add_test(tc, multiple_host_expire);
 	tcase_add_test(tc, multiple_svc_expire);
+	tcase_add_test(tc, inbound_drained_on_eof);
+	tcase_add_test(tc, inbound_worker_drained_on_eof);
+	tcase_add_test(tc, disconnect_defers_input);
+	tcase_add_test(tc, suspect_node_keeps_its_checks);
+	tcase_add_test(tc, pulse_arrival);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("config hash");
+	tcase_add_checked_fixture(tc, cfghash_setup, cfghash_teardown);
+	tcase_add_test(tc, config_hash_vectors);
+	tcase_add_test(tc, config_hash_cache);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("liveness");
+	tcase_add_test(tc, test_node_phi);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("snapshot");
+	tcase_add_checked_fixture(tc, snapshot_setup, snapshot_teardown);
+	tcase_add_test(tc, snapshot_round_trip);
+	tcase_add_test(tc, snapshot_has_all_objects);
+	tcase_add_test(tc, snapshot_skips_backlog);
+	tcase_add_test(tc, backlog_drain_deadline);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("relay");
+	tcase_add_checked_fixture(tc, relay_setup, relay_teardown);
+	tcase_add_test(tc, relay_without_relay_to_masters);
+	tcase_add_test(tc, relay_with_relay_to_masters);
+	tcase_add_test(tc, relay_origin_by_port);
 	suite_add_tcase(s, tc);
 
 	return s;
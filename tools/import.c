@@ -6,6 +6,7 @@
 #include "shared.h"
 #include "sql.h"
 #include "state.h"
+#include "rollup.h"
 #include "lparse.h"
 #include "logutils.h"
 #include "cfgfile.h"
@@ -33,6 +34,7 @@ static time_t daemon_start, daemon_stop, incremental;
 static int daemon_is_running;
 static uint skipped_files;
 static int repair_table;
+static int do_rollups;
 
 static time_t ltime; /* the timestamp from the current log-line */
 
@@ -130,6 +132,10 @@ static int insert_host_result(nebstruct_host_check_data *ds)
 		 ds->timestamp.tv_sec, ds->type, host_name, ds->state,
 		 ds->state_type == HARD_STATE || ds->state == 0, ds->current_attempt,
 		 output);
+	if (do_rollups) {
+		rollup_state(ds->host_name, NULL, ds->timestamp.tv_sec, ds->state,
+		             ds->state_type == HARD_STATE || ds->state == 0);
+	}
 
 	free(host_name);
 	free(output);
@@ -161,6 +167,10 @@ static int insert_service_result(nebstruct_service_check_data *ds)
 		 service_description, ds->state,
 		 ds->state_type == HARD_STATE || ds->state == 0, ds->current_attempt,
 		 output);
+	if (do_rollups) {
+		rollup_state(ds->host_name, ds->service_description, ds->timestamp.tv_sec,
+		             ds->state, ds->state_type == HARD_STATE || ds->state == 0);
+	}
 	free(host_name);
 	free(service_description);
 	free(output);
@@ -195,6 +205,10 @@ static int sql_insert_downtime(nebstruct_downtime_data *ds)
 			 ds->type == NEBTYPE_DOWNTIME_START);
 	}
 	free(host_name);
+	if (do_rollups) {
+		rollup_downtime(ds->host_name, ds->service_description, ds->timestamp.tv_sec,
+		                ds->type == NEBTYPE_DOWNTIME_START);
+	}
 	return result;
 }
 
@@ -864,6 +878,7 @@ static void usage(const char *fmt, ...)
 	printf("  --incremental[=<when>]             do an incremental import (since $when)\n");
 	printf("  --truncate-db                      truncate database before importing\n");
 	printf("  --only-notifications               only import notifications\n");
+	printf("  --rollups                          also build availability rollups\n");
 	printf("  --nagios-cfg=</path/to/nagios.cfg> path to nagios.cfg\n");
 	printf("  --list-files                       list files to import\n");
 	printf("\n\n");
@@ -950,6 +965,10 @@ int main(int argc, char **argv)
 			db_table = db_table ? db_table : "notification";
 			continue;
 		}
+		if (!prefixcmp(arg, "--rollups")) {
+			do_rollups = 1;
+			continue;
+		}
 		if (!prefixcmp(arg, "--no-progress")) {
 			do_progress = 0;
 			continue;
@@ -1104,6 +1123,7 @@ int main(int argc, char **argv)
 
 		sql_config("commit_interval", "0");
 		sql_config("commit_queries", "10000");
+		sql_config("commit_adaptive", "no");
 
 		if (sql_init() < 0) {
 			crash("sql_init() failed. db=%s, table=%s, user=%s, db msg=[%s]",
@@ -1111,6 +1131,14 @@ int main(int argc, char **argv)
 		}
 		if (truncate_db)
 			sql_query("TRUNCATE %s", db_table);
+		if (only_notifications)
+			do_rollups = 0;
+		if (do_rollups) {
+			/* open intervals are saved once we're done */
+			rollup_persist = 0;
+			if (truncate_db)
+				rollup_truncate();
+		}
 
 		if (incremental == 1) {
 			db_wrap_result * result = NULL;
@@ -1199,6 +1227,8 @@ int main(int argc, char **argv)
 	if (use_database) {
 		if (!only_notifications)
 			insert_extras(); /* must be before indexing */
+		if (do_rollups)
+			rollup_flush();
 		enable_indexes();
 		sql_close();
 	}
@@ -1209,5 +1239,6 @@ int main(int argc, char **argv)
 	print_unhandled_events();
 
 	state_deinit();
+	rollup_deinit();
 	return 0;
 }
@@ -377,6 +377,7 @@ main(int argc, char **argv)
 
 	sql_config("commit_interval", "0");
 	sql_config("commit_queries", "10000");
+	sql_config("commit_adaptive", "no");
 
 	if (sql_init()) {
 		lerr("Couldn't connect to database. Aborting.");